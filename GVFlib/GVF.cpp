@@ -26,22 +26,65 @@
 
 using namespace std;
 
+#define GVF_PARTICLES_PER_CHUNK 1024    // particles propagated together (multiple of the SIMD width)
+#define GVF_TEXT_BUFFER_SIZE    65536   // bytes read at once by loadTemplates(), also the longest line accepted
+#define GVF_KLD_ALIGNMENT_BINS  32      // alignment bins of each gesture counted by the adaptive number of particles
+#define GVF_KLD_HYSTERESIS      0.2f    // relative change of the adapted number of particles that triggers a resampling
+#define GVF_DEADLINE_HEADROOM   0.8f    // share of the time budget the particles are sized for
+#define GVF_DEADLINE_RISE       0.5f    // smoothing of the cost per particle on the frames over the budget
+#define GVF_DEADLINE_DECAY      0.05f   // smoothing of the cost per particle on the other frames
+#define GVF_PRUNING_TRIGGER     0.1f    // share of the particles held by pruned gestures beyond their budget that triggers a resampling
+
+#define GVF_STATE_FILE_MAGIC    "GVFS"
+#define GVF_STATE_FILE_VERSION  1
+
+// header of the files written by saveState()
+typedef struct
+{
+    char        magic[4];               // GVF_STATE_FILE_MAGIC
+    uint32_t    version;                // GVF_STATE_FILE_VERSION
+    uint32_t    byteOrder;              // GVF_TEMPLATE_FILE_BYTE_ORDER as written by the machine
+    uint32_t    numberOfGestures;       // [G]
+    uint32_t    inputDimensions;        // [D]
+    uint32_t    numberParticles;        // [ns]
+    uint32_t    scalingsDim;
+    uint32_t    rotationsDim;
+    uint32_t    offsetsDim;
+    uint32_t    logDomain;
+    uint32_t    rotationIsIdentity;
+    uint32_t    numberOfRandomWords;
+    uint32_t    originSize;
+} GVFStateFileHeader;
+
 //--------------------------------------------------------------
 GVF::GVF()
 {
     config.inputDimensions   = 2;
     config.translate         = true;
     config.segmentation      = false;
+    config.logDomain         = false;
     
     parameters.numberParticles       = 1000;
     parameters.tolerance             = 0.2f;
     parameters.resamplingThreshold   = 250;
+    parameters.resamplingScheme      = RESAMPLING_SYSTEMATIC;
     parameters.distribution          = 0.0f;
     parameters.alignmentVariance     = sqrt(0.000001f);
     parameters.dynamicsVariance      = vector<float>(1,sqrt(0.001f));
     parameters.scalingsVariance      = vector<float>(1,sqrt(0.00001f));
     parameters.rotationsVariance     = vector<float>(1,sqrt(0.0f));
     parameters.predictionSteps       = 1;
+    parameters.liveHistoryLength     = 256;
+    parameters.adaptiveParticles     = false;
+    parameters.minimumParticles      = 100;
+    parameters.maximumParticles      = 5000;
+    parameters.kldError              = 0.05f;
+    parameters.kldQuantile           = 2.33f;
+    parameters.classPruning          = false;
+    parameters.pruningFloor          = 0.001f;
+    parameters.explorationParticles  = 1;
+    parameters.timeBudget            = 0.0f;
+    parameters.budgetMinimumParticles = 100;
     parameters.dimWeights            = vector<float>(1,sqrt(1.0f));
     parameters.alignmentSpreadingCenter     = 0.0;
     parameters.alignmentSpreadingRange      = 0.2;
@@ -55,11 +98,26 @@ GVF::GVF()
     tolerancesetmanually = false;
     learningGesture = -1;
     
-    normgen = std::mt19937(rd());
-    rndnorm = new std::normal_distribution<float>(0.0,1.0);
-    unifgen = std::default_random_engine(rd());
-    rndunif = new std::uniform_real_distribution<float>(0.0,1.0);
-    
+    seed = ((uint64_t)rd() << 32) | rd();
+    rng.setSeed(seed);
+    
+    threadPool = NULL;
+    numberChunks = 0;
+    particlesPerFilter = parameters.numberParticles;
+    trainedParticles = parameters.numberParticles;
+    numberPruned = 0;
+    prunedResampling = false;
+    livePredictionSteps = parameters.predictionSteps;
+    deadlineUnitCost = 0.0f;
+    memset(&deadlineStatus, 0, sizeof(deadlineStatus));
+    vocabularyFrameStride = 0;
+    
+    likelihoodKernel = gvfSelectLikelihoodKernel(config.inputDimensions);
+    expSumKernel     = gvfSelectExpSumKernel();
+    rotationKernel   = gvfSelectRotationKernel();
+    rotationIsIdentity = false;
+    
+    packVocabulary();       // empty vocabulary
 }
 
 ////--------------------------------------------------------------
@@ -144,8 +202,8 @@ GVF::GVF()
 //--------------------------------------------------------------
 GVF::~GVF()
 {
-    if (rndnorm != NULL)
-        delete (rndnorm);
+    if (threadPool != NULL)
+        delete threadPool;
     clear(); // not really necessary but it's polite ;)
 }
 
@@ -154,6 +212,8 @@ void GVF::clear()
 {
     state = STATE_CLEAR;
     gestureTemplates.clear();
+    templateFile.close();
+    packVocabulary();
     activeGestures.clear(); //ISMM
     mostProbableIndex = -1;
 }
@@ -189,19 +249,31 @@ void GVF::addGestureTemplate(GVFGesture & gestureTemplate)
     //    if (getState() != GVF::STATE_LEARNING)
     //        setState(GVF::STATE_LEARNING);
     
+    materializeTemplates();
+    
     int inputDimension = gestureTemplate.getNumberDimensions();
     config.inputDimensions = inputDimension;
     
     gestureTemplates.push_back(gestureTemplate);
     activeGestures.push_back(gestureTemplates.size());
     
+    updateRanges();
+    packVocabulary();
+    train();
+    
+}
+
+//--------------------------------------------------------------
+// every template gets the observation ranges of the whole vocabulary
+void GVF::updateRanges()
+{
     //if(minRange.size() == 0){
-    if((minRange.size() == 0) || (minRange.size() != inputDimension)){ //ISMM
-        minRange.resize(inputDimension);
-        maxRange.resize(inputDimension);
+    if((minRange.size() == 0) || ((int)minRange.size() != config.inputDimensions)){ //ISMM
+        minRange.resize(config.inputDimensions);
+        maxRange.resize(config.inputDimensions);
     }
     
-    for(int j = 0; j < inputDimension; j++){
+    for(int j = 0; j < config.inputDimensions; j++){
         minRange[j] = INFINITY;
         maxRange[j] = -INFINITY;
     }
@@ -211,7 +283,7 @@ void GVF::addGestureTemplate(GVFGesture & gestureTemplate)
         GVFGesture& tGestureTemplate = gestureTemplates[i];
         vector<float>& tMinRange = tGestureTemplate.getMinRange();
         vector<float>& tMaxRange = tGestureTemplate.getMaxRange();
-        for(int j = 0; j < inputDimension; j++){
+        for(int j = 0; j < config.inputDimensions; j++){
             if(tMinRange[j] < minRange[j]) minRange[j] = tMinRange[j];
             if(tMaxRange[j] > maxRange[j]) maxRange[j] = tMaxRange[j];
         }
@@ -222,8 +294,6 @@ void GVF::addGestureTemplate(GVFGesture & gestureTemplate)
         tGestureTemplate.setMinRange(minRange);
         tGestureTemplate.setMaxRange(maxRange);
     }
-    train();
-    
 }
 
 //--------------------------------------------------------------
@@ -231,6 +301,7 @@ void GVF::replaceGestureTemplate(GVFGesture & gestureTemplate, int index)
 {
     if(gestureTemplate.getNumberDimensions()!=config.inputDimensions)
         return;
+    materializeTemplates();
     if(minRange.size() == 0)
     {
         minRange.resize(config.inputDimensions);
@@ -243,6 +314,7 @@ void GVF::replaceGestureTemplate(GVFGesture & gestureTemplate, int index)
     }
     if (index<=gestureTemplates.size())
         gestureTemplates[index-1]=gestureTemplate;
+    packVocabulary();
     for(int i = 0; i < gestureTemplates.size(); i++)
     {
         GVFGesture& tGestureTemplate = gestureTemplates[i];
@@ -271,40 +343,117 @@ void GVF::replaceGestureTemplate(GVFGesture & gestureTemplate, int index)
 
 //--------------------------------------------------------------
 GVFGesture & GVF::getGestureTemplate(int index){
+    materializeTemplates();
     assert(index < gestureTemplates.size());
     return gestureTemplates[index];
 }
 
 //--------------------------------------------------------------
 vector<GVFGesture> & GVF::getAllGestureTemplates(){
+    materializeTemplates();
     return gestureTemplates;
 }
 
 //--------------------------------------------------------------
 int GVF::getNumberOfGestureTemplates(){
-    return (int)gestureTemplates.size();
+    return (int)vocabularyLengths.size();     // the vocabulary follows every change of the templates
 }
 
 //--------------------------------------------------------------
 void GVF::removeGestureTemplate(int index){
+    materializeTemplates();
     assert(index < gestureTemplates.size());
     gestureTemplates.erase(gestureTemplates.begin() + index);
+    packVocabulary();
 }
 
 //--------------------------------------------------------------
 void GVF::removeAllGestureTemplates(){
     gestureTemplates.clear();
+    templateFile.close();
+    packVocabulary();
+}
+
+//----------------------------------------------
+// copy the packed frames of every gesture template into one contiguous buffer
+void GVF::packVocabulary(){
+    
+    int numberOfGestures = (int)gestureTemplates.size();
+    if (numberOfGestures > 0)
+        config.inputDimensions = gestureTemplates[0].getTemplateDimension();
+    vocabularyFrameStride = (numberOfGestures > 0) ? gestureTemplates[0].getFrameStride() : 0;
+    vocabularyOffsets.resize(numberOfGestures);
+    vocabularyLengths.resize(numberOfGestures);
+    
+    int size = 0;
+    for (int g = 0; g < numberOfGestures; g++)
+    {
+        assert(gestureTemplates[g].getFrameStride() == vocabularyFrameStride);
+        vocabularyOffsets[g] = size;
+        vocabularyLengths[g] = gestureTemplates[g].getTemplateLength();
+        size += vocabularyLengths[g] * vocabularyFrameStride;
+    }
+    
+    vocabularyFrames.resize(size + 1);     // never empty, so that its data can always be handed to the kernels
+    for (int g = 0; g < numberOfGestures; g++)
+        std::copy(gestureTemplates[g].getFrames(),
+                  gestureTemplates[g].getFrames() + vocabularyLengths[g] * vocabularyFrameStride,
+                  vocabularyFrames.begin() + vocabularyOffsets[g]);
+    vocabulary = &vocabularyFrames[0];
+}
+
+//----------------------------------------------
+// a mapped vocabulary is turned into gesture templates before they are accessed or edited,
+// the frames being copied out of the file which is then released
+void GVF::materializeTemplates(){
+    
+    if (!templateFile.isOpen())
+        return;
+    
+    int dimensions = templateFile.getDimensions();
+    int stride     = templateFile.getFrameStride();
+    vector<float> frame(dimensions);
+    gestureTemplates.assign(templateFile.getNumberOfTemplates(), GVFGesture(dimensions));
+    for (int g = 0; g < (int)gestureTemplates.size(); g++)
+    {
+        const float *frames = templateFile.getFrames() + templateFile.getOffsets()[g];
+        for (int o = 0; o < templateFile.getLengths()[g]; o++)
+        {
+            std::copy(frames + o * stride, frames + o * stride + dimensions, frame.begin());
+            gestureTemplates[g].addObservation(frame);      // frames are already translated: the first one is the origin
+        }
+        gestureTemplates[g].setMinRange(minRange);
+        gestureTemplates[g].setMaxRange(maxRange);
+    }
+    templateFile.close();
+    packVocabulary();
+}
+
+//----------------------------------------------
+// use the packed vocabulary of another model as is (see GVFBank)
+void GVF::copyVocabulary(GVF & model){
+    
+    config.inputDimensions  = model.config.inputDimensions;
+    minRange                = model.minRange;
+    maxRange                = model.maxRange;
+    vocabularyFrameStride   = model.vocabularyFrameStride;
+    vocabularyOffsets       = model.vocabularyOffsets;
+    vocabularyLengths       = model.vocabularyLengths;
+    
+    int numberOfGestures = model.getNumberOfGestureTemplates();
+    int size = (numberOfGestures > 0) ? vocabularyOffsets.back() + vocabularyLengths.back() * vocabularyFrameStride : 0;
+    vocabularyFrames.assign(model.vocabulary, model.vocabulary + size);
+    vocabularyFrames.push_back(0.0f);
+    vocabulary = &vocabularyFrames[0];
 }
 
 //----------------------------------------------
 void GVF::train(){
     
-    if (gestureTemplates.size() > 0)
+    if (getNumberOfGestureTemplates() > 0)
     {
         
-        // get the number of dimension in templates
-        config.inputDimensions = gestureTemplates[0].getTemplateDimension();
-        
+        // the number of dimension in templates is set with the vocabulary
         dynamicsDim = 2;    // hard coded: just speed now
         scalingsDim = config.inputDimensions;
         
@@ -313,22 +462,64 @@ void GVF::train(){
         else if (config.inputDimensions==3) rotationsDim=3;
         else rotationsDim=0;
         
-        // Init state space
-        initVec(classes, parameters.numberParticles);                           // Vector of gesture class
-        initVec(alignment, parameters.numberParticles);                         // Vector of phase values (alignment)
-        initMat(dynamics, parameters.numberParticles, dynamicsDim);             // Matric of dynamics
-        initMat(scalings, parameters.numberParticles, scalingsDim);             // Matrix of scaling
-        if (rotationsDim!=0) initMat(rotations, parameters.numberParticles, rotationsDim);             // Matrix of rotations
-        initMat(offsets, parameters.numberParticles, config.inputDimensions);
-        initVec(weights, parameters.numberParticles);                           // Weights
+        // likelihood kernel specialised for the input dimension
+        likelihoodKernel = gvfSelectLikelihoodKernel(config.inputDimensions);
+        
+        // Init state space: classes, alignment, dynamics, scalings, rotations, offsets and weights
+        // (with adaptive particles the columns hold the largest number of particles)
+        int capacity = parameters.numberParticles;
+        if (parameters.adaptiveParticles)
+            capacity = max(capacity, parameters.maximumParticles);
+        if (parameters.timeBudget > 0.0f)
+            capacity = max(capacity, trainedParticles);     // what the budget may go back to
+        particleStore.resize(parameters.numberParticles, scalingsDim, rotationsDim, config.inputDimensions, capacity);
         
-        initMat(particles, parameters.numberParticles, 3);
         //            std::cout << particles.size() << " "  << parameters.numberParticles << std::endl;
+        particlesPerFilter = parameters.numberParticles;
         
-        // bayesian elements
-        initVec(prior, parameters.numberParticles);
-        initVec(posterior, parameters.numberParticles);
-        initVec(likelihood, parameters.numberParticles);
+        // bayesian elements (the posterior is the weight column of the particle store)
+        initVec(prior, capacity);
+        initVec(logPosterior, capacity);
+        initVec(likelihood, capacity);
+        initVec(frameIndices, particleStore.getStride());
+        initVec(noiseBuffer, (3 + scalingsDim + rotationsDim) * particleStore.getStride());
+        
+        // scratch buffers of the following mode
+        initVec(lastObservation, config.inputDimensions);
+        resamplingParticles = particleStore;
+        initVec(cumulativeWeights, capacity);
+        initVec(ancestors, capacity);
+        initVec(resamplingScratch, capacity);
+        initVec(aliasIndices, capacity);
+        initVec(aliasWork, capacity);
+        initVec(binMasses, parameters.adaptiveParticles ? getNumberOfGestureTemplates() * GVF_KLD_ALIGNMENT_BINS : 0);
+        initVec(occupiedMasses, binMasses.size());
+        initVec(classMasses, getNumberOfGestureTemplates());
+        initVec(classCounts, getNumberOfGestureTemplates());
+        initVec(classShares, getNumberOfGestureTemplates());
+        initVec(classWeights, getNumberOfGestureTemplates());
+        initVec(prunedWeights, parameters.classPruning ? capacity : 0);
+        numberPruned = 0;
+        estimateStride = 4 + dynamicsDim + scalingsDim + rotationsDim;
+        initOutcomes(outcomes);
+        
+        // chunks of particles and their random streams, for as many chunks as the columns can hold
+        int maximumChunks = (capacity + GVF_PARTICLES_PER_CHUNK - 1) / GVF_PARTICLES_PER_CHUNK;
+        numberChunks = (parameters.numberParticles + GVF_PARTICLES_PER_CHUNK - 1) / GVF_PARTICLES_PER_CHUNK;
+        chunkRng.resize(maximumChunks);
+        for (int c = 0; c < maximumChunks; c++)
+            chunkRng[c].setSeed(seed + c);
+        initVec(chunkSums, maximumChunks);
+        initVec(estimateAccumulators, maximumChunks * getNumberOfGestureTemplates() * estimateStride);
+        profiler.setNumberOfChunks(maximumChunks);
+        
+        // ring of the live gesture, allocated now rather than over its first frames (learning mode
+        // records the templates entirely)
+        if (state != STATE_LEARNING)
+        {
+            theGesture.setNumberDimensions(config.inputDimensions);
+            theGesture.setHistoryLength(parameters.liveHistoryLength);
+        }
         
         
         initPrior();            // prior on init state values
@@ -378,40 +569,82 @@ void GVF::train(){
 //}
 
 //--------------------------------------------------------------
-void GVF::initPrior() //int pf_n)
+void GVF::initPrior()
 {
-    for (int pf_n = 0; pf_n < parameters.numberParticles; pf_n++)
-    {
-    // alignment
-    alignment[pf_n] = ((*rndunif)(unifgen) - 0.5) * parameters.alignmentSpreadingRange + parameters.alignmentSpreadingCenter;    // spread phase
+    initPrior(0, parameters.numberParticles, rng);
+}
+
+//--------------------------------------------------------------
+// spread the particles in [begin, end) over the initial state space, as one filter of end - begin particles
+void GVF::initPrior(int begin, int end, GVFRandom & random)
+{
+    int     *classes   = particleStore.classes();
+    float   *alignment = particleStore.alignment();
+    float   *speed     = particleStore.speed();
+    float   *accel     = particleStore.accel();
+    float   *posterior = particleStore.weight();
+    int     ns         = end - begin;
+    int     stride     = particleStore.getStride();
+    
+    // one column of uniform draws for each state component
+    const float *u = &noiseBuffer[0];
+    for (int c = 0; c < 3 + scalingsDim + rotationsDim; c++)
+        random.fillUniform(&noiseBuffer[c * stride + begin], ns);
     
+    // alignment
+    for (int pf_n = begin; pf_n < end; pf_n++)
+        alignment[pf_n] = (u[pf_n] - 0.5) * parameters.alignmentSpreadingRange + parameters.alignmentSpreadingCenter;    // spread phase
+    u += stride;
     
     // dynamics
-    dynamics[pf_n][0] = ((*rndunif)(unifgen) - 0.5) * parameters.dynamicsSpreadingRange + parameters.dynamicsSpreadingCenter; // spread speed
-    if (dynamics[pf_n].size()>1)
-    {
-        dynamics[pf_n][1] = ((*rndunif)(unifgen) - 0.5) * parameters.dynamicsSpreadingRange; // spread accel
-    }
+    for (int pf_n = begin; pf_n < end; pf_n++)
+        speed[pf_n] = (u[pf_n] - 0.5) * parameters.dynamicsSpreadingRange + parameters.dynamicsSpreadingCenter; // spread speed
+    u += stride;
+    for (int pf_n = begin; pf_n < end; pf_n++)
+        accel[pf_n] = (u[pf_n] - 0.5) * parameters.dynamicsSpreadingRange; // spread accel
+    u += stride;
     
     // scalings
-    for(int l = 0; l < scalings[pf_n].size(); l++) {
-        scalings[pf_n][l] = ((*rndunif)(unifgen) - 0.5) * parameters.scalingsSpreadingRange + parameters.scalingsSpreadingCenter; // spread scalings
+    for(int l = 0; l < scalingsDim; l++, u += stride)
+    {
+        float *scaling = particleStore.scaling(l);
+        for (int pf_n = begin; pf_n < end; pf_n++)
+            scaling[pf_n] = (u[pf_n] - 0.5) * parameters.scalingsSpreadingRange + parameters.scalingsSpreadingCenter; // spread scalings
     }
     
     // rotations
-    if (rotationsDim!=0)
-        for(int l = 0; l < rotations[pf_n].size(); l++)
-            rotations[pf_n][l] = ((*rndunif)(unifgen) - 0.5) * parameters.rotationsSpreadingRange + parameters.rotationsSpreadingCenter;    // spread rotations
+    for(int l = 0; l < rotationsDim; l++, u += stride)
+    {
+        float *rotation = particleStore.rotation(l);
+        for (int pf_n = begin; pf_n < end; pf_n++)
+            rotation[pf_n] = (u[pf_n] - 0.5) * parameters.rotationsSpreadingRange + parameters.rotationsSpreadingCenter;    // spread rotations
+    }
     
-    if (config.translate) for(int l = 0; l < offsets[pf_n].size(); l++) offsets[pf_n][l] = 0.0;
+    // rotation terms, kept up to date by updatePrior() from now on
+    if (rotationsDim != 0)
+        rotationKernel(particleStore.rotation(0), particleStore.rotationTerm(0), rotationsDim, stride, begin, end);
     
+    // no rotation at all until the rotations are spread or walk
+    rotationIsIdentity = (parameters.rotationsSpreadingRange == 0.0f && parameters.rotationsSpreadingCenter == 0.0f);
+    for (int l = 0; l < (int)parameters.rotationsVariance.size(); l++)
+        if (parameters.rotationsVariance[l] != 0.0f)
+            rotationIsIdentity = false;
     
-    prior[pf_n] = 1.0 / (float) parameters.numberParticles;
+    if (config.translate)
+        for(int l = 0; l < config.inputDimensions; l++)
+            fill(particleStore.offset(l) + begin, particleStore.offset(l) + end, 0.0f);
     
-    // set the posterior to the prior at the initialization
-    posterior[pf_n] = prior[pf_n];
+    for (int pf_n = begin; pf_n < end; pf_n++)
+    {
+        prior[pf_n] = 1.0 / (float) ns;
         
-                classes[pf_n] = activeGestures[pf_n % activeGestures.size()] - 1;
+        // set the posterior to the prior at the initialization
+        posterior[pf_n] = prior[pf_n];
+        logPosterior[pf_n] = -log((float) ns);
+        if (config.logDomain)
+            prior[pf_n] = logPosterior[pf_n];
+        
+        classes[pf_n] = activeGestures[(pf_n - begin) % activeGestures.size()] - 1;
     }
     
 }
@@ -452,13 +685,10 @@ void GVF::initNoiseParameters() {
     // ADAPTATION OF THE TOLERANCE IF DEFAULT PARAMTERS
     // ---------------------------
     if (!tolerancesetmanually){
+        // every template shares the ranges of the whole vocabulary
         float obsMeanRange = 0.0f;
-        for (int gt=0; gt<gestureTemplates.size(); gt++) {
-            for (int d=0; d<config.inputDimensions; d++)
-                obsMeanRange += (gestureTemplates[gt].getMaxRange()[d] - gestureTemplates[gt].getMinRange()[d])
-                /config.inputDimensions;
-        }
-        obsMeanRange /= gestureTemplates.size();
+        for (int d=0; d<config.inputDimensions; d++)
+            obsMeanRange += (maxRange[d] - minRange[d]) / config.inputDimensions;
         parameters.tolerance = obsMeanRange / 4.0f;  // dividing by an heuristic factor [to be learned?]
     }
 }
@@ -488,6 +718,7 @@ void GVF::setState(GVFState _state, vector<int> indexes)
             }
             state = _state;
             theGesture.clear();
+            theGesture.setHistoryLength(0);     // templates are recorded entirely
             break;
             
         case STATE_FOLLOWING:
@@ -501,10 +732,10 @@ void GVF::setState(GVFState _state, vector<int> indexes)
                     learningGesture=-1;
                 }
             }
-            if (gestureTemplates.size() > 0)
+            if (getNumberOfGestureTemplates() > 0)
             {
-                train();
                 state = _state;
+                train();
             }
             else
                 state = STATE_CLEAR;
@@ -531,7 +762,8 @@ GVF::GVFState GVF::getState()
 //--------------------------------------------------------------
 vector<int> GVF::getGestureClasses()
 {
-    return classes;
+    const int *classes = particleStore.classes();
+    return vector<int>(classes, classes + particleStore.size());
 }
 
 ////--------------------------------------------------------------
@@ -629,121 +861,373 @@ void GVF::restart()
 #pragma mark - PARTICLE FILTERING
 
 //--------------------------------------------------------------
-void GVF::updatePrior(int n) {
+void GVF::updatePrior(int begin, int end, GVFRandom & random) {
+    
+    const int   *classes   = particleStore.classes();
+    float       *alignment = particleStore.alignment();
+    float       *speed     = particleStore.speed();
+    float       *accel     = particleStore.accel();
+    const float *posterior = particleStore.weight();
+    int         stride     = particleStore.getStride();
+    
+    // draw the noise of the whole transition at once, one column per state component
+    // (rotations that do not walk need no noise)
+    const float *noise = &noiseBuffer[0];
+    for (int c = 0; c < 3 + scalingsDim; c++)
+        random.fillNormal(&noiseBuffer[c * stride + begin], end - begin);
+    bool rotationsWalk = false;
+    for (int l = 0; l < rotationsDim; l++)
+    {
+        if (parameters.rotationsVariance[l] == 0.0f)
+            continue;
+        random.fillNormal(&noiseBuffer[(3 + scalingsDim + l) * stride + begin], end - begin);
+        rotationsWalk = true;
+    }
     
     // Update alignment / dynamics / scalings
-    float L = gestureTemplates[classes[n]].getTemplateLength();
-    alignment[n] += (*rndnorm)(normgen) * parameters.alignmentVariance + dynamics[n][0]/L; // + dynamics[n][1]/(L*L);
+    for (int n = begin; n < end; n++)
+    {
+        float L = vocabularyLengths[classes[n]];
+        alignment[n] += noise[n] * parameters.alignmentVariance + speed[n]/L; // + accel[n]/(L*L);
+        speed[n]     += noise[stride + n] * parameters.dynamicsVariance[0] + accel[n]/L;
+    }
+    noise += 2 * stride;
+    
+    for (int n = begin; n < end; n++)
+        accel[n] += noise[n] * parameters.dynamicsVariance[1];
+    noise += stride;
     
-    if (dynamics[n].size()>1){
-        dynamics[n][0] += (*rndnorm)(normgen) * parameters.dynamicsVariance[0] + dynamics[n][1]/L;
-        dynamics[n][1] += (*rndnorm)(normgen) * parameters.dynamicsVariance[1];
+    for(int l = 0; l < scalingsDim; l++, noise += stride)
+    {
+        float *scaling = particleStore.scaling(l);
+        float variance = parameters.scalingsVariance[l];
+        for (int n = begin; n < end; n++)
+            scaling[n] += noise[n] * variance;
     }
-    else {
-        dynamics[n][0] += (*rndnorm)(normgen) * parameters.dynamicsVariance[0];
+    for(int l = 0; l < rotationsDim; l++, noise += stride)
+    {
+        float *rotation = particleStore.rotation(l);
+        float variance  = parameters.rotationsVariance[l];
+        if (variance == 0.0f)
+            continue;
+        for (int n = begin; n < end; n++)
+            rotation[n] += noise[n] * variance;
     }
     
-    //    for(int l= 0; l < dynamics[n].size(); l++)  dynamics[n][l] += (*rndnorm)(normgen) * parameters.dynamicsVariance[l];
-    for(int l= 0; l < scalings[n].size(); l++)  scalings[n][l] += (*rndnorm)(normgen) * parameters.scalingsVariance[l];
-    if (rotationsDim!=0) for(int l= 0; l < rotations[n].size(); l++)  rotations[n][l] += (*rndnorm)(normgen) * parameters.rotationsVariance[l];
+    // update the rotation terms when the rotations have moved
+    if (rotationsWalk)
+    {
+        if (rotationsDim == 1)
+        {
+            // 2-d: rotate (cos, sin) by the increment, with a Taylor expansion for small increments
+            float *c = particleStore.rotationTerm(0);
+            float *s = particleStore.rotationTerm(1);
+            const float *rotation = particleStore.rotation(0);
+            float variance = parameters.rotationsVariance[0];
+            for (int n = begin; n < end; n++)
+            {
+                float delta = noise[n - stride] * variance;
+                if (fabs(delta) < 0.25f)
+                {
+                    float d2 = delta * delta;
+                    float cd = 1.0f - d2 * (0.5f - d2 * (1.0f / 24.0f - d2 * (1.0f / 720.0f)));
+                    float sd = delta * (1.0f - d2 * (1.0f / 6.0f - d2 * (1.0f / 120.0f)));
+                    float cn = c[n] * cd - s[n] * sd;
+                    float sn = s[n] * cd + c[n] * sd;
+                    float renorm = 1.5f - 0.5f * (cn * cn + sn * sn);  // keeps the rounding errors from drifting
+                    c[n] = cn * renorm;
+                    s[n] = sn * renorm;
+                }
+                else
+                {
+                    c[n] = cos(rotation[n]);
+                    s[n] = sin(rotation[n]);
+                }
+            }
+        }
+        else
+            rotationKernel(particleStore.rotation(0), particleStore.rotationTerm(0), rotationsDim, stride, begin, end);
+    }
     
     // update prior (bayesian incremental inference)
-    prior[n] = posterior[n];
+    if (config.logDomain)
+        copy(logPosterior.begin() + begin, logPosterior.begin() + end, prior.begin() + begin);
+    else
+        copy(posterior + begin, posterior + end, prior.begin() + begin);
 }
 
 //--------------------------------------------------------------
-void GVF::updateLikelihood(vector<float> obs, int n)
+// returns the number of particles respawned by segmentation
+int GVF::updateLikelihood(vector<float> & obs, int begin, int end, GVFRandom & random)
 {
-
-//    if (config.normalization) for (int kk=0; kk<vobs.size(); kk++) vobs[kk] = vobs[kk] / globalNormalizationFactor;
     
-    if(alignment[n] < 0.0)
-    {
-        alignment[n] = fabs(alignment[n]);  // re-spread at the beginning
-//        if (config.segmentation)
-//            classes[n]   = n % getNumberOfGestureTemplates();
-    }
-    else if(alignment[n] > 1.0)
+    int     *classes   = particleStore.classes();
+    float   *alignment = particleStore.alignment();
+    int     stride     = particleStore.getStride();
+    int     respawns   = 0;
+    
+    for (int n = begin; n < end; n++)
     {
-        if (config.segmentation)
+        if(alignment[n] < 0.0)
         {
-//            alignment[n] = fabs(1.0-alignment[n]); // re-spread at the beginning
-            alignment[n] = fabs((*rndunif)(unifgen) * 0.5);    //
-            classes[n]   = n % getNumberOfGestureTemplates();
-            offsets[n]   = obs;
-            // dynamics
-            dynamics[n][0] = ((*rndunif)(unifgen) - 0.5) * parameters.dynamicsSpreadingRange + parameters.dynamicsSpreadingCenter; // spread speed
-            if (dynamics[n].size()>1)
-                dynamics[n][1] = ((*rndunif)(unifgen) - 0.5) * parameters.dynamicsSpreadingRange;
-            // scalings
-            for(int l = 0; l < scalings[n].size(); l++)
-                scalings[n][l] = ((*rndunif)(unifgen) - 0.5) * parameters.scalingsSpreadingRange + parameters.scalingsSpreadingCenter; // spread scalings
-            // rotations
-            if (rotationsDim!=0)
-                for(int l = 0; l < rotations[n].size(); l++)
-                    rotations[n][l] = ((*rndunif)(unifgen) - 0.5) * parameters.rotationsSpreadingRange + parameters.rotationsSpreadingCenter;    // spread rotations
-            // prior
-            prior[n] = 1/(float)parameters.numberParticles;
+            alignment[n] = fabs(alignment[n]);  // re-spread at the beginning
         }
-        else{
-            alignment[n] = fabs(2.0-alignment[n]); // re-spread at the end
+        else if(alignment[n] > 1.0)
+        {
+            if (config.segmentation)
+            {
+                alignment[n] = fabs(random.uniform() * 0.5);    //
+                classes[n]   = n % getNumberOfGestureTemplates();
+                for (int j=0; j < config.inputDimensions; j++)
+                    particleStore.offset(j)[n] = obs[j];
+                // dynamics
+                particleStore.speed()[n] = (random.uniform() - 0.5) * parameters.dynamicsSpreadingRange + parameters.dynamicsSpreadingCenter; // spread speed
+                particleStore.accel()[n] = (random.uniform() - 0.5) * parameters.dynamicsSpreadingRange;
+                // scalings
+                for(int l = 0; l < scalingsDim; l++)
+                    particleStore.scaling(l)[n] = (random.uniform() - 0.5) * parameters.scalingsSpreadingRange + parameters.scalingsSpreadingCenter; // spread scalings
+                // rotations
+                for(int l = 0; l < rotationsDim; l++)
+                    particleStore.rotation(l)[n] = (random.uniform() - 0.5) * parameters.rotationsSpreadingRange + parameters.rotationsSpreadingCenter;    // spread rotations
+                if (rotationsDim != 0)
+                    gvfRotationTermsScalar(particleStore.rotation(0), particleStore.rotationTerm(0), rotationsDim, stride, n, n + 1);
+                // prior
+                prior[n] = config.logDomain ? -log((float)particlesPerFilter) : 1/(float)particlesPerFilter;
+                respawns++;
+            }
+            else{
+                alignment[n] = fabs(2.0-alignment[n]); // re-spread at the end
+            }
         }
+        
+        // locate vref in the vocabulary at the given alignment, the kernel gathers it
+        int gestureIndex = classes[n];
+        float cursor = alignment[n];
+        int frameindex = min(vocabularyLengths[gestureIndex] - 1,
+                             (int)(floor(cursor * vocabularyLengths[gestureIndex] ) ) );
+        frameIndices[n] = vocabularyOffsets[gestureIndex] + frameindex * vocabularyFrameStride;
     }
     
-    vector<float> vobs(config.inputDimensions);
-    setVec(vobs, obs);
-    
-    if (config.translate)
-        for (int j=0; j < config.inputDimensions; j++)
-            vobs[j] = vobs[j] - offsets[n][j];
+    // scale, rotate and compare the gathered frames to the observation for every particle at once
+    GVFLikelihoodBatch batch;
+    batch.dimensions    = config.inputDimensions;
+    batch.rotationsDim  = rotationIsIdentity ? 0 : rotationsDim;
+    batch.stride        = stride;
+    batch.vocabulary    = vocabulary;
+    batch.frameIndices  = &frameIndices[0];
+    batch.scalings      = particleStore.scaling(0);
+    batch.rotationTerms = (rotationsDim != 0) ? particleStore.rotationTerm(0) : NULL;
+    batch.offsets       = config.translate ? particleStore.offset(0) : NULL;
+    batch.observation   = &obs[0];
+    batch.dimWeights    = &parameters.dimWeights[0];
+    batch.tolerance     = parameters.tolerance;
+    batch.distribution  = parameters.distribution;
+    batch.logDomain     = config.logDomain;
+    batch.likelihood    = &likelihood[0];
+    likelihoodKernel(batch, begin, end);
+    return respawns;
+}
+
+//--------------------------------------------------------------
+void GVF::updatePosterior(int begin, int end) {
+    if (config.logDomain)
+    {
+        for (int n = begin; n < end; n++)
+            logPosterior[n] = prior[n] + likelihood[n];
+        return;
+    }
+    float *posterior = particleStore.weight();
+    for (int n = begin; n < end; n++)
+        posterior[n] = prior[n] * likelihood[n];
+}
+
+//--------------------------------------------------------------
+// prior / likelihood / posterior updates of a chunk of particles for every prediction step
+void GVF::propagateChunk(int chunk)
+{
+    int begin = chunk * GVF_PARTICLES_PER_CHUNK;
+    int end   = min(begin + GVF_PARTICLES_PER_CHUNK, parameters.numberParticles);
     
+    for (int m=0; m<livePredictionSteps; m++)
+    {
+        GVF_PROFILE(double start = GVFProfiler::now());
+        updatePrior(begin, end, chunkRng[chunk]);
+        GVF_PROFILE(double propagated = GVFProfiler::now());
+        int respawns = updateLikelihood(*currentObservation, begin, end, chunkRng[chunk]);
+        updatePosterior(begin, end);
+        GVF_PROFILE(profiler.addChunkTime(chunk, STAGE_PRIOR, propagated - start));
+        GVF_PROFILE(profiler.addChunkTime(chunk, STAGE_LIKELIHOOD, GVFProfiler::now() - propagated));
+        GVF_PROFILE(profiler.addChunkCount(chunk, GVF_PROFILING_RESPAWNS, respawns));
+        (void)respawns;
+    }
     
-    // take vref from template at the given alignment
-    int gestureIndex = classes[n];
-    float cursor = alignment[n];
-    int frameindex = min((int)(gestureTemplates[gestureIndex].getTemplateLength() - 1),
-                         (int)(floor(cursor * gestureTemplates[gestureIndex].getTemplateLength() ) ) );
-//    return gestureTemplates[gestureIndex].getTemplate()[frameindex];
-    vector<float> vref = gestureTemplates[gestureIndex].getTemplate()[frameindex];; //getGestureTemplateSample(classes[n], alignment[n]);
+    chunkSums[chunk] = partialWeights(begin, end);
+}
+
+//--------------------------------------------------------------
+// normalisation of the weights of a chunk, leaves the partial resampling criterion in chunkSums
+void GVF::normaliseChunk(int chunk)
+{
+    int begin = chunk * GVF_PARTICLES_PER_CHUNK;
+    int end   = min(begin + GVF_PARTICLES_PER_CHUNK, parameters.numberParticles);
     
-    // Apply scaling coefficients
-    for (int k=0;k < config.inputDimensions; k++)
+    chunkSums[chunk] = scaleWeights(begin, end, sumWeights, maxLogWeight);
+    GVF_PROFILE(const float *posterior = particleStore.weight());
+    GVF_PROFILE(int nans = 0; for (int k = begin; k < end; k++) nans += (posterior[k] != posterior[k]));
+    GVF_PROFILE(profiler.addChunkCount(chunk, GVF_PROFILING_NANS, nans));
+}
+
+//--------------------------------------------------------------
+// partial result of the normalisation of a range of particles: in the log domain the largest
+// log-weight, the shift of the log-sum-exp, otherwise the sum of the weights
+float GVF::partialWeights(int begin, int end)
+{
+    if (config.logDomain)
     {
-//        if (config.normalization) vref[k] = vref[k] / globalNormalizationFactor;
-        vref[k] *= scalings[n][k];
+        float maxw = -INFINITY;
+        for(int n = begin; n < end; n++)
+            maxw = max(maxw, logPosterior[n]);
+        return maxw;
+    }
+    const float *posterior = particleStore.weight();
+    float sumw = 0.0;
+    for(int n = begin; n < end; n++)
+        sumw += posterior[n];   // sum posterior to normalise the distrib afterwards
+    return sumw;
+}
+
+//--------------------------------------------------------------
+// divide the weights of a range of particles by their sum (in the log domain the weights are relative
+// to the shift, and the log-weights are normalised too), returns the sum of the squared weights
+float GVF::scaleWeights(int begin, int end, float sum, float shift)
+{
+    float *posterior = particleStore.weight();
+    float dotProdw = 0.0;
+    for (int k = begin; k < end; k++){
+        posterior[k] /= sum;
+        dotProdw   += posterior[k] * posterior[k];
     }
     
-    // Apply rotation coefficients
-    if (config.inputDimensions==2) {
-        float tmp0=vref[0]; float tmp1=vref[1];
-        vref[0] = cos(rotations[n][0])*tmp0 - sin(rotations[n][0])*tmp1;
-        vref[1] = sin(rotations[n][0])*tmp0 + cos(rotations[n][0])*tmp1;
+    // normalised log posterior: log(w) - (max + log(sum(exp(log(w) - max))))
+    if (config.logDomain)
+    {
+        float logNormalisation = shift + log(sum);
+        for (int k = begin; k < end; k++)
+            logPosterior[k] -= logNormalisation;
     }
-    else if (config.inputDimensions==3) {
-        // Rotate template sample according to the estimated angles of rotations (3d)
-        vector<vector< float> > RotMatrix = getRotationMatrix3d(rotations[n][0],rotations[n][1],rotations[n][2]);
-        vref = multiplyMat(RotMatrix, vref);
+    return dotProdw;
+}
+
+//--------------------------------------------------------------
+// normalisation of the weights of a range of particles on the calling thread, the same steps as
+// update() without the chunks; returns the sum of the squared weights (the inverse of the ESS)
+float GVF::normaliseRange(int begin, int end)
+{
+    float sumw  = partialWeights(begin, end);
+    float shift = 0.0f;
+    if (config.logDomain)
+    {
+        shift = isfinite(sumw) ? sumw : 0.0f;
+        sumw  = expSumKernel(&logPosterior[0], shift, particleStore.weight(), begin, end);
     }
+    return scaleWeights(begin, end, sumw, shift);
+}
+
+//--------------------------------------------------------------
+void GVF::propagateTask(void * gvf, int chunk)
+{
+    ((GVF *)gvf)->propagateChunk(chunk);
+}
+
+//--------------------------------------------------------------
+void GVF::normaliseTask(void * gvf, int chunk)
+{
+    ((GVF *)gvf)->normaliseChunk(chunk);
+}
+
+//--------------------------------------------------------------
+// Metropolis draw of the ancestors of a chunk, each chunk using its own random stream
+void GVF::metropolisChunk(int chunk)
+{
+    int begin = chunk * GVF_PARTICLES_PER_CHUNK;
+    int end   = min(begin + GVF_PARTICLES_PER_CHUNK, parameters.numberParticles);
+    
+    gvfResampleMetropolis(particleStore.weight(), parameters.numberParticles, metropolisSteps,
+                          chunkRng[chunk], begin, end, &ancestors[0]);
+}
+
+//--------------------------------------------------------------
+void GVF::metropolisTask(void * gvf, int chunk)
+{
+    ((GVF *)gvf)->metropolisChunk(chunk);
+}
+
+//--------------------------------------------------------------
+// copy the ancestors of a chunk into the back buffer, with uniform weights
+void GVF::gatherChunk(int chunk)
+{
+    int begin = chunk * GVF_PARTICLES_PER_CHUNK;
+    int end   = min(begin + GVF_PARTICLES_PER_CHUNK, parameters.numberParticles);
     
-    // weighted euclidean distance
-    float dist = distance_weightedEuclidean(vref,vobs,parameters.dimWeights);
+    resamplingParticles.gather(particleStore, &ancestors[0], begin, end);
     
-    if(parameters.distribution == 0.0f){    // Gaussian distribution
-        likelihood[n] = exp(- dist * 1 / (parameters.tolerance * parameters.tolerance));
-    }
-    else {            // Student's distribution
-        likelihood[n] = pow(dist/parameters.distribution + 1, -parameters.distribution/2 - 1);    // dimension is 2 .. pay attention if editing]
+    // update posterior (partilces' weights)
+    if (prunedResampling)
+    {
+        // weight of the gesture the particle was drawn for
+        float *weight = resamplingParticles.weight();
+        const int *classes = resamplingParticles.classes();
+        for (int j = begin; j < end; j++)
+            weight[j] = classWeights[classes[j]];
+        if (config.logDomain)
+            for (int j = begin; j < end; j++)
+                logPosterior[j] = log(weight[j]);
+        return;
     }
-//    // if log on keep track on vref and vobs
-//    if (config.logOn){
-//        vecRef.push_back(vref);
-//        vecObs = vobs;
-//    }
+    uniformWeights(resamplingParticles, begin, end, parameters.numberParticles);
 }
 
 //--------------------------------------------------------------
-void GVF::updatePosterior(int n) {
-    posterior[n]  = prior[n] * likelihood[n];
+// weights of a range of particles after resampling: uniform, out of 'count' particles
+void GVF::uniformWeights(GVFParticles & particles, int begin, int end, int count)
+{
+    float *weight = particles.weight();
+    for (int j = begin; j < end; j++)
+        weight[j] = 1.0/(float)count;
+    if (config.logDomain)
+        fill(logPosterior.begin() + begin, logPosterior.begin() + end, -log((float)count));
+}
+
+//--------------------------------------------------------------
+void GVF::gatherTask(void * gvf, int chunk)
+{
+    ((GVF *)gvf)->gatherChunk(chunk);
+}
+
+//--------------------------------------------------------------
+// log domain: weights of a chunk relative to the largest one, leaves their sum in chunkSums
+void GVF::expSumChunk(int chunk)
+{
+    int begin = chunk * GVF_PARTICLES_PER_CHUNK;
+    int end   = min(begin + GVF_PARTICLES_PER_CHUNK, parameters.numberParticles);
+    
+    chunkSums[chunk] = expSumKernel(&logPosterior[0], maxLogWeight, particleStore.weight(), begin, end);
+}
+
+//--------------------------------------------------------------
+void GVF::expSumTask(void * gvf, int chunk)
+{
+    ((GVF *)gvf)->expSumChunk(chunk);
+}
+
+//--------------------------------------------------------------
+void GVF::runChunks(GVFTask task)
+{
+    if (threadPool != NULL && numberChunks > 1)
+        threadPool->run(task, this, numberChunks);
+    else
+        for (int c = 0; c < numberChunks; c++)
+            task(this, c);
 }
 
 //--------------------------------------------------------------
@@ -751,205 +1235,586 @@ GVFOutcomes & GVF::update(vector<float> & observation)
 {
     
     if (state != GVF::STATE_FOLLOWING) setState(GVF::STATE_FOLLOWING);
+    GVF_PROFILE(profiler.beginFrame());
+    double frameStart = (parameters.timeBudget > 0.0f) ? GVFProfiler::now() : 0.0;
+    int frameUnits = parameters.numberParticles * livePredictionSteps;
     
+    if (theGesture.getHistoryLength() != parameters.liveHistoryLength)
+        theGesture.setHistoryLength(parameters.liveHistoryLength);
     theGesture.addObservation(observation);
-    vector<float> obs = theGesture.getLastObservation();
+    vector<float> & obs = lastObservation;
+    obs = theGesture.getLastObservation();      // same size: copied in place
     
     //    std::cout << obs[0] << " " << obs[0] << " "
     //                << gestureTemplates[0].getTemplate()[20][0] << " " << gestureTemplates[0].getTemplate()[20][1] << " "
     //                << gestureTemplates[1].getTemplate()[20][0] << " " << gestureTemplates[1].getTemplate()[20][1] << std::endl;
     
-    
-    // for each particle: perform updates of state space / likelihood / prior (weights)
-    float sumw = 0.0;
-    for(int n = 0; n< parameters.numberParticles; n++)
-    {
-        
-        for (int m=0; m<parameters.predictionSteps; m++)
-        {
-            updatePrior(n);
-            updateLikelihood(obs, n);
-            updatePosterior(n);
-        }
-        
-        sumw += posterior[n];   // sum posterior to normalise the distrib afterwards
-        
-        particles[n][0] = alignment[n];
-        particles[n][1] = scalings[n][0];
-        particles[n][2] = classes[n];
-    }
-    
-    // normalize the weights and compute the resampling criterion
-    float dotProdw = 0.0;
-    for (int k = 0; k < parameters.numberParticles; k++){
-        posterior[k] /= sumw;
-        dotProdw   += posterior[k] * posterior[k];
-    }
-    // avoid degeneracy (no particles active, i.e. weight = 0) by resampling
-    if( (1./dotProdw) < parameters.resamplingThreshold)
-        resampleAccordingToWeights(obs);
+    filterFrame(obs);
     
     // estimate outcomes
     estimates();
+    GVF_PROFILE(profiler.lap(STAGE_ESTIMATES));
+    GVF_PROFILE(profiler.endFrame());
+    
+    if (parameters.timeBudget > 0.0f)
+        updateDeadline((float)(GVFProfiler::now() - frameStart), frameUnits);
     
     return outcomes;
     
 }
 
 //--------------------------------------------------------------
-void GVF::resampleAccordingToWeights(vector<float> obs)
+// filter steps of a frame on its translated observation, up to resampling (update() and updateBatch())
+void GVF::filterFrame(vector<float> & obs)
 {
-    // covennient
-    int numOfPart = parameters.numberParticles;
-    
-    // cumulative dist
-    vector<float>           c(numOfPart);
+    // perform updates of state space / likelihood / prior (weights) chunk by chunk,
+    // the likelihood being evaluated for all the particles of a chunk at once
+    currentObservation = &obs;
+    for (int l = 0; l < (int)parameters.rotationsVariance.size(); l++)
+        if (parameters.rotationsVariance[l] != 0.0f)
+            rotationIsIdentity = false;
+    GVF_PROFILE(profiler.skip());
+    runChunks(&GVF::propagateTask);
+    GVF_PROFILE(profiler.skip());
+    
+    // partial sums are reduced in chunk order so that the result does not depend on the threads
+    float sumw = 0.0;
+    if (config.logDomain)
+    {
+        // log-sum-exp: shift by the largest log-weight before exponentiating
+        maxLogWeight = -INFINITY;
+        for (int c = 0; c < numberChunks; c++)
+            maxLogWeight = max(maxLogWeight, chunkSums[c]);
+        if (!isfinite(maxLogWeight))
+            maxLogWeight = 0.0f;
+        runChunks(&GVF::expSumTask);
+    }
+    for (int c = 0; c < numberChunks; c++)
+        sumw += chunkSums[c];
     
-    // tmp matrices
-    vector<int>             oldClasses;
-    vector<float>           oldAlignment;
-    vector< vector<float> > oldDynamics;
-    vector< vector<float> > oldScalings;
-    vector< vector<float> > oldRotations;
+    // normalize the weights and compute the resampling criterion
+    sumWeights = sumw;
+    runChunks(&GVF::normaliseTask);
+    GVF_PROFILE(profiler.lap(STAGE_NORMALISATION));
+    float dotProdw = 0.0;
+    for (int c = 0; c < numberChunks; c++)
+        dotProdw += chunkSums[c];
     
-    setVec(oldClasses,   classes);
-    setVec(oldAlignment, alignment);
-    setMat(oldDynamics,  dynamics);
-    setMat(oldScalings,  scalings);
-    if (rotationsDim!=0) setMat(oldRotations, rotations);
+    // avoid degeneracy (no particles active, i.e. weight = 0) by resampling
+    float threshold = parameters.resamplingThreshold * (parameters.numberParticles / (float)trainedParticles);
+    bool resample = (1./dotProdw) < threshold;
+    
+    // adaptive number of particles and deadline mode: resample to the KLD bound or to the number of
+    // the user, within what the time budget affords, once it moves away from the current number
+    // (at once when the current number exceeds the budget)
+    int count = parameters.numberParticles;
+    if (parameters.adaptiveParticles || parameters.timeBudget > 0.0f)
+    {
+        int target = parameters.adaptiveParticles ? adaptedNumberOfParticles() : trainedParticles;
+        bool overBudget = false;
+        if (parameters.timeBudget > 0.0f)
+        {
+            deadlineStatus.degraded = (target > deadlineStatus.numberParticles
+                                       || livePredictionSteps < parameters.predictionSteps);
+            overBudget = count > deadlineStatus.numberParticles;
+            target     = min(target, deadlineStatus.numberParticles);
+        }
+        if (resample || overBudget || fabs((float)(target - count)) > GVF_KLD_HYSTERESIS * count)
+        {
+            count    = target;
+            resample = true;
+        }
+    }
     
+    // class pruning: resample once the pruned gestures hold too many particles beyond their budget
+    if (parameters.classPruning && prunedParticles(count) > GVF_PRUNING_TRIGGER * parameters.numberParticles)
+        resample = true;
+    GVF_PROFILE(profiler.lap(STAGE_ESS));
+    if (resample)
+    {
+        resampleAccordingToWeights(count);
+        GVF_PROFILE(profiler.countResample());
+    }
+    GVF_PROFILE(profiler.lap(STAGE_RESAMPLING));
+}
+
+//--------------------------------------------------------------
+size_t GVF::updateBatch(const float * data, size_t frames, size_t stride, GVFOutcomeSink & sink)
+{
+    if (state != GVF::STATE_FOLLOWING) setState(GVF::STATE_FOLLOWING);
+    if (state != GVF::STATE_FOLLOWING)  // no template to follow
+        return 0;
     
-    c[0] = 0;
-    for(int i = 1; i < numOfPart; i++) c[i] = c[i-1] + posterior[i];
+    assert(stride >= (size_t)config.inputDimensions);
+    assert(sink.numberOfGestures == getNumberOfGestureTemplates());
     
+    size_t count = min(frames, sink.capacity);
+    if (count == 0)
+        return 0;
     
-    float u0 = (*rndunif)(unifgen)/numOfPart;
+    // the frames are translated to the origin of the current gesture (its first frame if it has not
+    // started yet) without being recorded in the live gesture
+    if (theGesture.getNumberOfTemplates() == 0 || theGesture.getTemplateLength() == 0)
+    {
+        if (theGesture.getHistoryLength() != parameters.liveHistoryLength)
+            theGesture.setHistoryLength(parameters.liveHistoryLength);
+        batchObservation.assign(data, data + config.inputDimensions);
+        theGesture.addObservation(batchObservation);
+    }
+    const vector<float> & origin = theGesture.getInitialObservation();
+    batchObservation.resize(config.inputDimensions);
     
-    int i = 0;
-    for (int j = 0; j < numOfPart; j++)
+    for (size_t f = 0; f < count; f++)
     {
-        float uj = u0 + (j + 0.) / numOfPart;
-        
-        while (uj > c[i] && i < numOfPart - 1){
-            i++;
-        }
+        GVF_PROFILE(profiler.beginFrame());
+        double frameStart = (parameters.timeBudget > 0.0f) ? GVFProfiler::now() : 0.0;
+        int frameUnits = parameters.numberParticles * livePredictionSteps;
         
-        classes[j]   = oldClasses[i];
-        alignment[j] = oldAlignment[i];
+        const float *frame = data + f * stride;
+        for (int d = 0; d < config.inputDimensions; d++)
+            batchObservation[d] = frame[d] - origin[d];
+        filterFrame(batchObservation);
         
-        for (int l=0;l<dynamicsDim;l++)     dynamics[j][l] = oldDynamics[i][l];
-        for (int l=0;l<scalingsDim;l++)     scalings[j][l] = oldScalings[i][l];
-        if (rotationsDim!=0) for (int l=0;l<rotationsDim;l++) rotations[j][l] = oldRotations[i][l];
+        // estimates written straight into the row of the frame
+        writeOutcomes(estimateSums(), sink, f);
+        GVF_PROFILE(profiler.lap(STAGE_ESTIMATES));
+        GVF_PROFILE(profiler.endFrame());
         
-        // update posterior (partilces' weights)
-        posterior[j] = 1.0/(float)numOfPart;
+        if (parameters.timeBudget > 0.0f)
+            updateDeadline((float)(GVFProfiler::now() - frameStart), frameUnits);
     }
-    
+    return count;
 }
 
+//--------------------------------------------------------------
+// outcomes of the current frame from the weighted sums of estimateRange() into row 'frame' of the
+// columns of a sink: the same values as fillOutcomes(), without going through GVFOutcomes
+void GVF::writeOutcomes(const float * sums, GVFOutcomeSink & sink, size_t frame)
+{
+    int numberOfGestures = getNumberOfGestureTemplates();
+    size_t row = frame * numberOfGestures;
+    float maxProbability = 0.0f;
+    int likeliest = -1;
+    for (int gi = 0; gi < numberOfGestures; ++gi)
+    {
+        const float *sum = sums + gi * estimateStride;
+        float invNormalisation = (sum[0] > 0.0f) ? 1.0f / sum[0] : 0.0f;
+        
+        if (sink.likelihoods != NULL)
+            sink.likelihoods[row + gi] = sum[1];
+        if (sink.alignments != NULL)
+            sink.alignments[row + gi]  = sum[2];
+        
+        const float *state = sum + 4;
+        if (sink.dynamics != NULL)
+            for (int j = 0; j < dynamicsDim; ++j) sink.dynamics[(row + gi) * dynamicsDim + j] = state[j] * invNormalisation;
+        state += dynamicsDim;
+        if (sink.scalings != NULL)
+            for (int j = 0; j < scalingsDim; ++j) sink.scalings[(row + gi) * scalingsDim + j] = state[j] * invNormalisation;
+        state += scalingsDim;
+        if (sink.rotations != NULL)
+            for (int j = 0; j < rotationsDim; ++j) sink.rotations[(row + gi) * rotationsDim + j] = state[j] * invNormalisation;
+        
+        if (sum[1] > maxProbability){
+            maxProbability  = sum[1];
+            likeliest       = gi;
+        }
+    }
+    if (sink.likeliestGestures != NULL)
+        sink.likeliestGestures[frame] = likeliest;
+    mostProbableIndex = likeliest;
+}
 
 //--------------------------------------------------------------
-void GVF::estimates(){
+// resample 'count' particles from the current ones, which changes the number of particles when it differs
+void GVF::resampleAccordingToWeights(int count)
+{
+    // covennient
+    int numOfPart = parameters.numberParticles;
+    const float *posterior = particleStore.weight();
     
+    // pruned gestures: draw from the weights scaled by the share of each gesture
+    prunedResampling = parameters.classPruning && numberPruned > 0;
+    if (prunedResampling)
+    {
+        scalePrunedWeights();
+        posterior = &prunedWeights[0];
+    }
     
-    int numOfPart = parameters.numberParticles;
-    vector<float> probabilityNormalisation(getNumberOfGestureTemplates());
-    setVec(probabilityNormalisation, 0.0f, getNumberOfGestureTemplates());            // rows are gestures
-    setVec(estimatedAlignment, 0.0f, getNumberOfGestureTemplates());            // rows are gestures
-    setMat(estimatedDynamics,  0.0f, getNumberOfGestureTemplates(), dynamicsDim);  // rows are gestures, cols are features + probabilities
-    setMat(estimatedScalings,  0.0f, getNumberOfGestureTemplates(), scalingsDim);   // rows are gestures, cols are features + probabilities
-    if (rotationsDim!=0) setMat(estimatedRotations,  0.0f, getNumberOfGestureTemplates(), rotationsDim);   // ..
-    setVec(estimatedProbabilities, 0.0f, getNumberOfGestureTemplates());            // rows are gestures
-    setVec(estimatedLikelihoods, 0.0f, getNumberOfGestureTemplates());            // rows are gestures
+    // the number of particles and the shares of the gestures can only change through the schemes
+    // walking the cumulative weights
+    GVFResamplingScheme scheme = parameters.resamplingScheme;
+    if ((count != numOfPart || prunedResampling) && scheme != RESAMPLING_STRATIFIED)
+        scheme = RESAMPLING_SYSTEMATIC;
+    
+    // draw the ancestor of each new particle (the Metropolis chains are independent: one per chunk)
+    if (scheme == RESAMPLING_METROPOLIS)
+    {
+        metropolisSteps = gvfMetropolisSteps(posterior, numOfPart);
+        runChunks(&GVF::metropolisTask);
+    }
+    else
+        drawAncestors(posterior, numOfPart, count, scheme, rng, 0);
+    if (prunedResampling)
+        weighPrunedDraws(count);
+    if (count != numOfPart)
+        setLiveParticles(count);
+    
+    // gather the ancestors into the back buffer and swap it with the front one
+    runChunks(&GVF::gatherTask);
+    particleStore.swap(resamplingParticles);
+}
+
+//--------------------------------------------------------------
+// draw 'count' ancestors for the n particles starting at 'offset' from their weights, into the
+// ancestors (relative to offset) and with the scratch buffers of that range, which are persistent
+void GVF::drawAncestors(const float * weights, int n, int count, GVFResamplingScheme scheme, GVFRandom & random, int offset)
+{
+    int *drawn = &ancestors[offset];
+    switch (scheme)
+    {
+        case RESAMPLING_STRATIFIED:
+            gvfResampleStratified(weights, n, random, &cumulativeWeights[offset], &resamplingScratch[offset], drawn, count);
+            break;
+        case RESAMPLING_RESIDUAL:
+            gvfResampleResidual(weights, n, random, &cumulativeWeights[offset], &resamplingScratch[offset], drawn);
+            break;
+        case RESAMPLING_MULTINOMIAL:
+            gvfResampleMultinomial(weights, n, random, &resamplingScratch[offset], &aliasIndices[offset], &aliasWork[offset], drawn);
+            break;
+        case RESAMPLING_METROPOLIS:
+            gvfResampleMetropolis(weights, n, gvfMetropolisSteps(weights, n), random, 0, n, drawn);
+            break;
+        case RESAMPLING_SYSTEMATIC:
+        default:
+            gvfResampleSystematic(weights, n, random, &cumulativeWeights[offset], drawn, count);
+            break;
+    }
+}
+
+//--------------------------------------------------------------
+// resampling of a range of particles on the calling thread with its own random stream, e.g. a session
+// of a GVFBank: the number of particles of the range stays the same (no adaptive number of particles nor
+// class pruning) and the resampled particles are copied back in place through the back buffer
+void GVF::resampleRange(int begin, int end, GVFRandom & random)
+{
+    int n = end - begin;
+    drawAncestors(particleStore.weight() + begin, n, n, parameters.resamplingScheme, random, begin);
+    for (int j = begin; j < end; j++)
+        ancestors[j] += begin;
+    
+    // the front buffer cannot be swapped for a range: gather and copy back
+    resamplingParticles.gather(particleStore, &ancestors[0], begin, end);
+    particleStore.copyRange(resamplingParticles, begin, end);
+    uniformWeights(particleStore, begin, end, n);
+}
+
+//--------------------------------------------------------------
+// change the number of particles within the capacity of the columns, keeping their state
+void GVF::setLiveParticles(int count)
+{
+    assert(count <= particleStore.getCapacity());
+    parameters.numberParticles = count;
+    particlesPerFilter = count;
+    numberChunks = (count + GVF_PARTICLES_PER_CHUNK - 1) / GVF_PARTICLES_PER_CHUNK;
+    particleStore.setSize(count);
+    resamplingParticles.setSize(count);
+}
+
+//--------------------------------------------------------------
+// KLD-sampling bound (Fox, 2003): number of draws for the KL divergence between the particles and
+// the posterior to stay below error with the confidence of the normal quantile, for k occupied bins
+static float kldBound(float k, float error, float quantile)
+{
+    if (k <= 1.0f)
+        return 1.0f;
+    float a = 2.0f / (9.0f * (k - 1.0f));
+    float b = 1.0f - a + sqrt(a) * quantile;
+    return (k - 1.0f) / (2.0f * error) * b * b * b;
+}
+
+//--------------------------------------------------------------
+// number of particles for the posterior of the current frame: the posterior mass is binned over
+// gesture and alignment, and the number of bins n draws would occupy (sum of 1 - exp(-n m) over the
+// masses m of the bins) and the KLD bound for that many bins are iterated to their fixed point
+int GVF::adaptedNumberOfParticles()
+{
+    const int   bins      = GVF_KLD_ALIGNMENT_BINS;
+    const int   *classes  = particleStore.classes();
+    const float *alignment = particleStore.alignment();
+    const float *posterior = particleStore.weight();
     
-    //    float sumposterior = 0.;
+    fill(binMasses.begin(), binMasses.end(), 0.0f);
+    for (int n = 0; n < parameters.numberParticles; n++)
+    {
+        int bin = min(max((int)(alignment[n] * bins), 0), bins - 1);
+        binMasses[classes[n] * bins + bin] += posterior[n];
+    }
+    int numberOccupied = 0;
+    for (int b = 0; b < (int)binMasses.size(); b++)
+        if (binMasses[b] > 0.0f)
+            occupiedMasses[numberOccupied++] = binMasses[b];
     
-    for(int n = 0; n < numOfPart; n++)
+    float count = (float)parameters.numberParticles;
+    for (int iteration = 0; iteration < 4; iteration++)
     {
-        probabilityNormalisation[classes[n]] += posterior[n];
+        float occupied = 0.0f;
+        for (int b = 0; b < numberOccupied; b++)
+            occupied += 1.0f - exp(-count * occupiedMasses[b]);
+        count = kldBound(occupied, parameters.kldError, parameters.kldQuantile);
+        count = min(max(count, (float)parameters.minimumParticles), (float)parameters.maximumParticles);
     }
+    return (int)count;
+}
+
+//--------------------------------------------------------------
+// class pruning for a resampling to count particles: the gestures below the floor get a budget of
+// exploration particles and the leading gestures the rest in proportion to their mass; returns the
+// particles the pruned gestures hold beyond their budget
+int GVF::prunedParticles(int count)
+{
+    int         numberOfGestures = getNumberOfGestureTemplates();
+    const int   *classes   = particleStore.classes();
+    const float *posterior = particleStore.weight();
     
+    fill(classMasses.begin(), classMasses.end(), 0.0f);
+    fill(classCounts.begin(), classCounts.end(), 0);
+    for (int n = 0; n < parameters.numberParticles; n++)
+    {
+        classMasses[classes[n]] += posterior[n];
+        classCounts[classes[n]]++;
+    }
     
-    // compute the estimated features and likelihoods
-    for(int n = 0; n < numOfPart; n++)
+    numberPruned = 0;
+    float leadingMass = 0.0f;
+    for (int g = 0; g < numberOfGestures; g++)
     {
-        
-        //        sumposterior += posterior[n];
-        estimatedAlignment[classes[n]] += alignment[n] * posterior[n];
-        
-        for(int m = 0; m < dynamicsDim; m++)
-            estimatedDynamics[classes[n]][m] += dynamics[n][m] * (posterior[n]/probabilityNormalisation[classes[n]]);
-        
-        for(int m = 0; m < scalingsDim; m++)
-            estimatedScalings[classes[n]][m] += scalings[n][m] * (posterior[n]/probabilityNormalisation[classes[n]]);
-        
-        if (rotationsDim!=0)
-            for(int m = 0; m < rotationsDim; m++)
-                estimatedRotations[classes[n]][m] += rotations[n][m] * (posterior[n]/probabilityNormalisation[classes[n]]);
-        
-        if (!isnan(posterior[n]))
-            estimatedProbabilities[classes[n]] += posterior[n];
-        estimatedLikelihoods[classes[n]] += likelihood[n];
+        if (classMasses[g] < parameters.pruningFloor)
+            numberPruned++;
+        else
+            leadingMass += classMasses[g];
+    }
+    if (numberPruned == 0 || numberPruned == numberOfGestures)
+    {
+        numberPruned = 0;
+        return 0;
     }
     
-    // calculate most probable index during scaling...
-    float maxProbability = 0.0f;
-    mostProbableIndex = -1;
+    // the pruned gestures never take more than a quarter of the particles
+    int budget = min(parameters.explorationParticles, count / (4 * numberPruned));
+    int excess = 0;
+    float exploration = 0.0f;
+    for (int g = 0; g < numberOfGestures; g++)
+    {
+        if (classMasses[g] >= parameters.pruningFloor)
+            continue;
+        classShares[g] = (classMasses[g] > 0.0f) ? budget / (float)count : 0.0f;   // no particle to draw from otherwise
+        exploration   += classShares[g];
+        excess        += max(classCounts[g] - budget, 0);
+    }
+    for (int g = 0; g < numberOfGestures; g++)
+        if (classMasses[g] >= parameters.pruningFloor)
+            classShares[g] = (1.0f - exploration) * classMasses[g] / leadingMass;
+    return excess;
+}
+
+//--------------------------------------------------------------
+// weights scaled by the share of their gesture over its mass, which the ancestors are drawn from
+// (divided by the mass first: the share over a vanishing mass would overflow)
+void GVF::scalePrunedWeights()
+{
+    const int   *classes   = particleStore.classes();
+    const float *posterior = particleStore.weight();
     
-    for(int gi = 0; gi < getNumberOfGestureTemplates(); gi++)
+    for (int n = 0; n < parameters.numberParticles; n++)
     {
-        if(estimatedProbabilities[gi] > maxProbability){
-            maxProbability      = estimatedProbabilities[gi];
-            mostProbableIndex   = gi;
-        }
+        int g = classes[n];
+        prunedWeights[n] = (classMasses[g] > 0.0f) ? classShares[g] * (posterior[n] / classMasses[g]) : 0.0f;
     }
-    //    std::cout << estimatedProbabilities[0] << " " << estimatedProbabilities[1] << std::endl;
+}
+
+//--------------------------------------------------------------
+// weight of the particles drawn for each gesture: its mass over the number of its draws, so that
+// the estimates are unbiased (normalised over the gestures drawn at least once)
+void GVF::weighPrunedDraws(int count)
+{
+    int         numberOfGestures = getNumberOfGestureTemplates();
+    const int   *classes   = particleStore.classes();
+    
+    fill(classCounts.begin(), classCounts.end(), 0);
+    for (int j = 0; j < count; j++)
+        classCounts[classes[ancestors[j]]]++;
+    float drawnMass = 0.0f;
+    for (int g = 0; g < numberOfGestures; g++)
+        if (classCounts[g] > 0)
+            drawnMass += classMasses[g];
+    for (int g = 0; g < numberOfGestures; g++)
+        classWeights[g] = (classCounts[g] > 0) ? classMasses[g] / (classCounts[g] * drawnMass) : 0.0f;
+}
+
+//--------------------------------------------------------------
+// deadline mode: smooth the cost of a particle and prediction step with the duration of the frame
+// (units particles times prediction steps), and size the next frames for the budget, shedding the
+// prediction steps before the particles
+void GVF::updateDeadline(float duration, int units)
+{
+    float budget   = parameters.timeBudget;
+    float unitCost = duration / units;
+    float rate     = (duration > budget) ? GVF_DEADLINE_RISE : GVF_DEADLINE_DECAY;
+    if (deadlineUnitCost == 0.0f)
+    {
+        deadlineUnitCost    = unitCost;
+        deadlineStatus.cost = duration;
+    }
+    deadlineUnitCost    += rate * (unitCost - deadlineUnitCost);
+    deadlineStatus.cost += rate * (duration - deadlineStatus.cost);
+    if (duration > budget)
+        deadlineStatus.overruns++;
+    
+    float affordable = GVF_DEADLINE_HEADROOM * budget / deadlineUnitCost;
+    int   wanted     = parameters.adaptiveParticles ? parameters.numberParticles : trainedParticles;
+    int   steps      = parameters.predictionSteps;
+    while (steps > 1 && affordable < wanted * steps)
+        steps--;
+    livePredictionSteps = steps;
+    
+    float particles = min(max(affordable / steps, (float)parameters.budgetMinimumParticles),
+                          (float)particleStore.getCapacity());
+    deadlineStatus.numberParticles = (int)particles;
+    deadlineStatus.predictionSteps = steps;
+}
+
+//--------------------------------------------------------------
+// shape the outcomes for the current vocabulary and state dimensions
+void GVF::initOutcomes(GVFOutcomes & result)
+{
+    int numberOfGestures = getNumberOfGestureTemplates();
+    result.likelihoods.resize(numberOfGestures);
+    result.alignments.resize(numberOfGestures);
+    initMat(result.dynamics, numberOfGestures, dynamicsDim);
+    initMat(result.scalings, numberOfGestures, scalingsDim);
+    if (rotationsDim != 0)
+        initMat(result.rotations, numberOfGestures, rotationsDim);
+    else
+        result.rotations.clear();
+}
+
+//--------------------------------------------------------------
+void GVF::estimates(){
     
-    //    outcomes.estimations.clear();
-    outcomes.likelihoods.clear();
-    outcomes.alignments.clear();
-    outcomes.scalings.clear();
-    outcomes.dynamics.clear();
-    outcomes.rotations.clear();
+    fillOutcomes(estimateSums(), outcomes);
+    mostProbableIndex = outcomes.likeliestGesture;
+}
+
+//--------------------------------------------------------------
+// weighted sums of the state of every particle, per gesture [G x K] (see estimateRange)
+float * GVF::estimateSums(){
     
-    // most probable gesture index
-    outcomes.likeliestGesture = mostProbableIndex;
+    int numberOfGestures = getNumberOfGestureTemplates();
     
-    // Fill estimation for each gesture
-    for (int gi = 0; gi < gestureTemplates.size(); ++gi) {
-        
-        //        GVFEstimation estimation;
-        outcomes.likelihoods.push_back(estimatedProbabilities[gi]);
-        outcomes.alignments.push_back(estimatedAlignment[gi]);
-        //        estimation.probability = estimatedProbabilities[gi];
-        //        estimation.alignment   = estimatedAlignment[gi];
+    // one pass over the particles, bucketed by gesture, each chunk in its own accumulators (sized by
+    // train() for the most chunks, cleared by estimateRange())
+    runChunks(&GVF::estimateTask);
+    
+    // reduce the chunks in order into the first one
+    float *sums = &estimateAccumulators[0];
+    for (int c = 1; c < numberChunks; c++)
+    {
+        const float *chunkSum = sums + c * numberOfGestures * estimateStride;
+        for (int k = 0; k < numberOfGestures * estimateStride; k++)
+            sums[k] += chunkSum[k];
+    }
+    return sums;
+}
+
+//--------------------------------------------------------------
+// Fill estimation for each gesture from the weighted sums of estimateRange() (outcomes are resized
+// in place, which only allocates when the number of gestures changes), the state being averaged over
+// the particles of the gesture
+void GVF::fillOutcomes(const float * sums, GVFOutcomes & result)
+{
+    int numberOfGestures = getNumberOfGestureTemplates();
+    initOutcomes(result);
+    float maxProbability = 0.0f;
+    int likeliest = -1;
+    for (int gi = 0; gi < numberOfGestures; ++gi) {
         
+        const float *sum = sums + gi * estimateStride;
+        float invNormalisation = (sum[0] > 0.0f) ? 1.0f / sum[0] : 0.0f;
         
-        vector<float> gDynamics(dynamicsDim, 0.0);
-        for (int j = 0; j < dynamicsDim; ++j) gDynamics[j] = estimatedDynamics[gi][j];
-        outcomes.dynamics.push_back(gDynamics);
+        result.likelihoods[gi] = sum[1];
+        result.alignments[gi]  = sum[2];
         
-        vector<float> gScalings(scalingsDim, 0.0);
-        for (int j = 0; j < scalingsDim; ++j) gScalings[j] = estimatedScalings[gi][j];
-        outcomes.scalings.push_back(gScalings);
+        const float *state = sum + 4;
+        for (int j = 0; j < dynamicsDim; ++j) result.dynamics[gi][j] = state[j] * invNormalisation;
+        state += dynamicsDim;
+        for (int j = 0; j < scalingsDim; ++j) result.scalings[gi][j] = state[j] * invNormalisation;
+        state += scalingsDim;
+        for (int j = 0; j < rotationsDim; ++j) result.rotations[gi][j] = state[j] * invNormalisation;
         
-        vector<float> gRotations;
-        if (rotationsDim!=0)
-        {
-            gRotations.resize(rotationsDim);
-            for (int j = 0; j < rotationsDim; ++j) gRotations[j] = estimatedRotations[gi][j];
-            outcomes.rotations.push_back(gRotations);
+        // calculate most probable index
+        if (sum[1] > maxProbability){
+            maxProbability  = sum[1];
+            likeliest       = gi;
         }
-        
-        //        estimation.likelihood = estimatedLikelihoods[gi];
-        
-        // push estimation for gesture gi in outcomes
-        //        outcomes.estimations.push_back(estimation);
     }
     
+    // most probable gesture index
+    result.likeliestGesture = likeliest;
+}
+
+//--------------------------------------------------------------
+// weighted sums of the state of the particles of a chunk, per gesture
+void GVF::estimateChunk(int chunk)
+{
+    int begin = chunk * GVF_PARTICLES_PER_CHUNK;
+    int end   = min(begin + GVF_PARTICLES_PER_CHUNK, parameters.numberParticles);
+    
+    estimateRange(begin, end, &estimateAccumulators[chunk * getNumberOfGestureTemplates() * estimateStride]);
+}
+
+//--------------------------------------------------------------
+// weighted sums of the state of the particles in [begin, end), per gesture [G x K]
+void GVF::estimateRange(int begin, int end, float * sums)
+{
+    fill(sums, sums + getNumberOfGestureTemplates() * estimateStride, 0.0f);
     
-    //    assert(outcomes.estimations.size() == gestureTemplates.size());
+    const int   *classes   = particleStore.classes();
+    const float *alignment = particleStore.alignment();
+    const float *speed     = particleStore.speed();
+    const float *accel     = particleStore.accel();
+    const float *posterior = particleStore.weight();
     
+    for (int n = begin; n < end; n++)
+    {
+        float w = posterior[n];
+        float *sum = sums + classes[n] * estimateStride;
+        sum[0] += w;
+        if (!isnan(w))
+            sum[1] += w;
+        sum[2] += alignment[n] * w;
+        sum[3] += likelihood[n];
+        sum[4] += speed[n] * w;
+        sum[5] += accel[n] * w;
+    }
+    for (int m = 0; m < scalingsDim; m++)
+    {
+        const float *scaling = particleStore.scaling(m);
+        for (int n = begin; n < end; n++)
+            sums[classes[n] * estimateStride + 4 + dynamicsDim + m] += scaling[n] * posterior[n];
+    }
+    for (int m = 0; m < rotationsDim; m++)
+    {
+        const float *rotation = particleStore.rotation(m);
+        for (int n = begin; n < end; n++)
+            sums[classes[n] * estimateStride + 4 + dynamicsDim + scalingsDim + m] += rotation[n] * posterior[n];
+    }
+}
+
+//--------------------------------------------------------------
+void GVF::estimateTask(void * gvf, int chunk)
+{
+    ((GVF *)gvf)->estimateChunk(chunk);
 }
 
 ////--------------------------------------------------------------
@@ -1003,6 +1868,14 @@ void GVF::estimates(){
 
 //--------------------------------------------------------------
 const vector<vector<float> > & GVF::getParticlesPositions(){
+    // built on request from the particle store, following does not maintain it
+    initMat(particles, particleStore.size(), 3);
+    for (int n = 0; n < particleStore.size(); n++)
+    {
+        particles[n][0] = particleStore.alignment()[n];
+        particles[n][1] = particleStore.scaling(0)[n];
+        particles[n][2] = particleStore.classes()[n];
+    }
     return particles;
 }
 
@@ -1043,6 +1916,7 @@ void GVF::setNumberOfParticles(int numberOfParticles){
     
     if (parameters.numberParticles < 4)     // minimum number of particles allowed
         parameters.numberParticles = 4;
+    trainedParticles = parameters.numberParticles;
     
     train();
     
@@ -1061,17 +1935,121 @@ int GVF::getNumberOfParticles(){
 void GVF::setActiveGestures(vector<int> activeGestureIds)
 {
     int argmax = *std::max_element(activeGestureIds.begin(), activeGestureIds.end());
-    if (activeGestureIds[argmax] <= gestureTemplates.size())
+    if (activeGestureIds[argmax] <= getNumberOfGestureTemplates())
     {
         activeGestures = activeGestureIds;
     }
     else
     {
-        activeGestures.resize(gestureTemplates.size());
+        activeGestures.resize(getNumberOfGestureTemplates());
         std::iota(activeGestures.begin(), activeGestures.end(), 1);
     }
 }
 
+//--------------------------------------------------------------
+void GVF::setNumberOfThreads(int numberOfThreads)
+{
+    if (numberOfThreads == getNumberOfThreads())
+        return;
+    if (threadPool != NULL)
+    {
+        delete threadPool;
+        threadPool = NULL;
+    }
+    if (numberOfThreads > 1)
+        threadPool = new GVFThreadPool(numberOfThreads);
+}
+
+//--------------------------------------------------------------
+int GVF::getNumberOfThreads()
+{
+    return (threadPool != NULL) ? threadPool->getNumberOfThreads() : 1;
+}
+
+//--------------------------------------------------------------
+void GVF::setAdaptiveParticles(bool adaptive, int minimumParticles, int maximumParticles, float error, float quantile)
+{
+    parameters.adaptiveParticles = adaptive;
+    parameters.minimumParticles  = max(minimumParticles, 4);
+    parameters.maximumParticles  = max(maximumParticles, parameters.minimumParticles);
+    parameters.kldError          = error;
+    parameters.kldQuantile       = quantile;
+    
+    // start again from the number of particles of the user, in columns sized for the largest number
+    parameters.numberParticles = trainedParticles;
+    train();
+}
+
+//--------------------------------------------------------------
+bool GVF::getAdaptiveParticles()
+{
+    return parameters.adaptiveParticles;
+}
+
+//--------------------------------------------------------------
+void GVF::setClassPruning(bool pruning, float floor, int explorationParticles)
+{
+    parameters.classPruning         = pruning;
+    parameters.pruningFloor         = floor;
+    parameters.explorationParticles = max(explorationParticles, 0);
+    
+    // takes effect at the next frame, the particles are kept
+    numberPruned = 0;
+    initVec(prunedWeights, pruning ? particleStore.getCapacity() : 0);
+}
+
+//--------------------------------------------------------------
+bool GVF::getClassPruning()
+{
+    return parameters.classPruning;
+}
+
+//--------------------------------------------------------------
+void GVF::setTimeBudget(float microseconds, int minimumParticles)
+{
+    parameters.timeBudget             = max(microseconds, 0.0f);
+    parameters.budgetMinimumParticles = max(minimumParticles, 4);
+    
+    // the cost is measured again from the next frame
+    deadlineUnitCost = 0.0f;
+    memset(&deadlineStatus, 0, sizeof(deadlineStatus));
+    deadlineStatus.budget          = parameters.timeBudget;
+    deadlineStatus.numberParticles = max(particleStore.getCapacity(), parameters.numberParticles);
+    deadlineStatus.predictionSteps = parameters.predictionSteps;
+    livePredictionSteps            = parameters.predictionSteps;
+    
+    // back to the number of particles of the user
+    if (parameters.timeBudget == 0.0f && !parameters.adaptiveParticles
+        && state == STATE_FOLLOWING && parameters.numberParticles < trainedParticles)
+        resampleAccordingToWeights(trainedParticles);
+}
+
+//--------------------------------------------------------------
+float GVF::getTimeBudget()
+{
+    return parameters.timeBudget;
+}
+
+//--------------------------------------------------------------
+GVFDeadlineStatus GVF::getDeadlineStatus()
+{
+    return deadlineStatus;
+}
+
+//--------------------------------------------------------------
+GVFPerformanceStats GVF::getPerformanceStats()
+{
+    GVFPerformanceStats stats;
+    profiler.getStats(stats);
+    return stats;
+}
+
+//--------------------------------------------------------------
+void GVF::resetPerformanceStats()
+{
+    profiler.reset();
+}
+
 //--------------------------------------------------------------
 void GVF::setPredictionSteps(int predictionSteps)
 {
@@ -1079,6 +2057,7 @@ void GVF::setPredictionSteps(int predictionSteps)
         parameters.predictionSteps = 1;
     else
         parameters.predictionSteps = predictionSteps;
+    livePredictionSteps = parameters.predictionSteps;     // until the time budget sheds some
 }
 
 //--------------------------------------------------------------
@@ -1101,6 +2080,28 @@ int GVF::getResamplingThreshold(){
     return parameters.resamplingThreshold;
 }
 
+//--------------------------------------------------------------
+void GVF::setLiveHistoryLength(int liveHistoryLength){
+    parameters.liveHistoryLength = max(liveHistoryLength, 0);
+    if (state == STATE_FOLLOWING)
+        theGesture.setHistoryLength(parameters.liveHistoryLength);
+}
+
+//--------------------------------------------------------------
+int GVF::getLiveHistoryLength(){
+    return parameters.liveHistoryLength;
+}
+
+//--------------------------------------------------------------
+void GVF::setResamplingScheme(GVFResamplingScheme resamplingScheme){
+    parameters.resamplingScheme = resamplingScheme;
+}
+
+//--------------------------------------------------------------
+GVFResamplingScheme GVF::getResamplingScheme(){
+    return parameters.resamplingScheme;
+}
+
 //--------------------------------------------------------------
 // Update the standard deviation of the observation distribution
 // this value acts as a tolerance for the algorithm
@@ -1256,6 +2257,8 @@ void GVF::setSpreadRotations(float center, float range, int dim)
 {
     parameters.rotationsSpreadingCenter = center;
     parameters.rotationsSpreadingRange = range;
+    if (center != 0.0f || range != 0.0f)
+        rotationIsIdentity = false;
 }
 
 //--------------------------------------------------------------
@@ -1270,6 +2273,19 @@ void GVF::segmentation(bool segmentationFlag)
     config.segmentation = segmentationFlag;
 }
 
+//--------------------------------------------------------------
+void GVF::logDomain(bool logDomainFlag)
+{
+    if (logDomainFlag == config.logDomain)
+        return;
+    config.logDomain = logDomainFlag;
+    
+    // the normalised weights carry over from one domain to the other
+    const float *posterior = particleStore.weight();
+    for (int n = 0; n < (int)logPosterior.size(); n++)
+        logPosterior[n] = log(posterior[n]);
+}
+
 
 // UTILITIES
 
@@ -1278,6 +2294,8 @@ void GVF::segmentation(bool segmentationFlag)
 // vocabulary in a text file given by filename (filename is also the complete path + filename)
 void GVF::saveTemplates(string filename){
     
+    materializeTemplates();
+    
     std::string directory = filename;
     
     std::ofstream file_write(directory.c_str());
@@ -1301,73 +2319,430 @@ void GVF::saveTemplates(string filename){
 
 
 //--------------------------------------------------------------
-// Load function. This function is used by applications to load a vocabulary
-// given by filename (filename is also the complete path + filename)
-void GVF::loadTemplates(string filename){
-    //    clear();
-    //
-    
-    GVFGesture loadedGesture;
-    loadedGesture.clear();
-    
-    ifstream infile;
-    stringstream doung;
-    
-    infile.open (filename.c_str(), ifstream::in);
-    //
-    string line;
-    vector<string> list;
-    int cl = -1;
-    while(!infile.eof())
+// Decimal value of a template file: numbers with a mantissa below 2^24 and a decimal exponent of at
+// most 10 (which covers what saveTemplates() writes) are a single correctly rounded float operation on
+// exact operands, hence the same float as strtof(), anything else goes through strtof()
+static float parseTemplateValue(char * p, char ** end)
+{
+    static const float powersOfTen[] = {1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f};
+    
+    char *q = p;
+    bool negative = (*q == '-');
+    if (*q == '-' || *q == '+')
+        q++;
+    
+    uint64_t mantissa = 0;
+    int digits = 0, exponent = 0;
+    for (; *q >= '0' && *q <= '9'; q++, digits++)
+        mantissa = mantissa * 10 + (*q - '0');
+    if (*q == '.')
+        for (q++; *q >= '0' && *q <= '9'; q++, digits++, exponent--)
+            mantissa = mantissa * 10 + (*q - '0');
+    if (*q == 'e' || *q == 'E')
     {
-        cl++;
-        infile >> line;
-        
-        list.push_back(line);
+        q++;
+        bool negativeExponent = (*q == '-');
+        if (*q == '-' || *q == '+')
+            q++;
+        int e = 0, exponentDigits = 0;
+        for (; *q >= '0' && *q <= '9'; q++, exponentDigits++)
+            if (e < 1000)
+                e = e * 10 + (*q - '0');
+        if (exponentDigits == 0)
+            return strtof(p, end);
+        exponent += negativeExponent ? -e : e;
     }
     
-    int k = 0;
-    int template_id = -1;
-    int template_dim = 0;
+    bool separated = (*q == '\0' || *q == ' ' || *q == '\t' || *q == '\r');
+    if (digits == 0 || digits > 18 || mantissa > (1 << 24) || exponent < -10 || exponent > 10 || !separated)
+        return strtof(p, end);
     
-    
-    while (k < (list.size() - 1)){ // TODO to be changed if dim>2
-        
+    float value = (float)mantissa;
+    value = (exponent < 0) ? value / powersOfTen[-exponent] : value * powersOfTen[exponent];
+    *end = q;
+    return negative ? -value : value;
+}
+
+//--------------------------------------------------------------
+// Load function. This function is used by applications to load a vocabulary
+// given by filename (filename is also the complete path + filename)
+// The file is streamed line by line through a fixed buffer, the templates being added and
+// trained once at the end (nothing is added if the file has an error)
+bool GVF::loadTemplates(string filename, string * error){
+    
+    FILE *file = fopen(filename.c_str(), "rb");
+    if (file == NULL)
+        return templatesError(error, filename, 0, "cannot open the file");
+    
+    vector<GVFGesture> loadedGestures;
+    vector<float> frame;
+    int templateDim = 0;        // dimension of the current template, 0 before the first header
+    int vocabularyDim = (getNumberOfGestureTemplates() > 0) ? config.inputDimensions : 0;   // every template must have it
+    int frameSize   = 0;        // values of the current frame read so far
+    int lineNumber  = 0;
+    string message;
+    
+    vector<char> buffer(GVF_TEXT_BUFFER_SIZE + 1);  // one more byte to terminate an unfinished last line
+    size_t filled = 0;
+    bool endOfFile = false;
+    while (message.empty() && !endOfFile)
+    {
+        filled += fread(&buffer[filled], 1, GVF_TEXT_BUFFER_SIZE - filled, file);
+        endOfFile = (filled < GVF_TEXT_BUFFER_SIZE);    // a short read only happens at the end (or on error)
+        if (ferror(file))
+        {
+            message = "read error";
+            break;
+        }
         
-        if (!strcmp(list[k].c_str(),"template"))
+        // parse the complete lines of the buffer, and the unfinished last line of the file
+        char *line = &buffer[0];
+        char *end  = line + filled;
+        while (message.empty() && line < end)
         {
-            template_id = atoi(list[k+1].c_str());
-            template_dim = atoi(list[k+2].c_str());
-            k = k + 3;
+            char *newline = (char *)memchr(line, '\n', end - line);
+            if (newline == NULL)
+            {
+                if (!endOfFile)
+                    break;
+                newline = end;
+            }
+            *newline = '\0';
+            lineNumber++;
             
-            if (loadedGesture.getNumberOfTemplates() > 0){
-                addGestureTemplate(loadedGesture);
-                loadedGesture.clear();
+            char *p = line;
+            while (message.empty())
+            {
+                while (*p == ' ' || *p == '\t' || *p == '\r')
+                    p++;
+                if (*p == '\0')
+                    break;
+                
+                if (strncmp(p, "template", 8) == 0)
+                {
+                    // template <id> <dim>
+                    char *q;
+                    strtol(p + 8, &q, 10);
+                    long dim = strtol(q, &p, 10);
+                    if (p == q || dim <= 0)
+                        message = "expected 'template <id> <dimension>'";
+                    else if (frameSize != 0)
+                        message = "unfinished frame before the template header";
+                    else if (vocabularyDim != 0 && dim != vocabularyDim)
+                    {
+                        std::ostringstream stream;
+                        stream << "template of dimension " << dim << " in a vocabulary of dimension " << vocabularyDim;
+                        message = stream.str();
+                    }
+                    else
+                    {
+                        vocabularyDim = (int)dim;
+                        templateDim = (int)dim;
+                        frame.resize(templateDim);
+                        loadedGestures.push_back(GVFGesture(templateDim));
+                    }
+                }
+                else
+                {
+                    char *q;
+                    float value = parseTemplateValue(p, &q);
+                    if (q == p)
+                        message = "invalid value '" + string(p, strcspn(p, " \t\r")) + "'";
+                    else if (templateDim == 0)
+                        message = "value before the first template header";
+                    else
+                    {
+                        frame[frameSize++] = value;
+                        if (frameSize == templateDim)
+                        {
+                            loadedGestures.back().addObservation(frame);
+                            frameSize = 0;
+                        }
+                        p = q;
+                    }
+                }
             }
+            line = newline + 1;
         }
         
-        if (template_dim <= 0){
-            //post("bug dim = -1");
-        }
-        else{
-            
-            vector<float> vect(template_dim);
-            
-            for (int kk = 0; kk < template_dim; kk++)
-                vect[kk] = (float) atof(list[k + kk].c_str());
-            
-            loadedGesture.addObservation(vect);
+        // keep the unfinished line for the next read
+        size_t remaining = (line < end) ? end - line : 0;
+        if (message.empty() && remaining == GVF_TEXT_BUFFER_SIZE)
+        {
+            lineNumber++;
+            message = "line too long";
         }
-        k += template_dim;
-        
+        memmove(&buffer[0], line, remaining);
+        filled = remaining;
     }
+    fclose(file);
     
-    if (loadedGesture.getTemplateLength() > 0){
-        addGestureTemplate(loadedGesture);
-        loadedGesture.clear();
+    if (message.empty() && frameSize != 0)
+        message = "unfinished frame at the end of the file";
+    if (!message.empty())
+        return templatesError(error, filename, lineNumber, message);
+    
+    // add every template at once
+    materializeTemplates();
+    for (int i = 0; i < (int)loadedGestures.size(); i++)
+    {
+        if (loadedGestures[i].getTemplateLength() == 0)
+            continue;
+        config.inputDimensions = loadedGestures[i].getNumberDimensions();
+        gestureTemplates.push_back(std::move(loadedGestures[i]));
+        activeGestures.push_back(gestureTemplates.size());
+    }
+    updateRanges();
+    packVocabulary();
+    train();
+    return true;
+}
+
+//--------------------------------------------------------------
+bool GVF::templatesError(string * error, const string & filename, int lineNumber, const string & message){
+    if (error != NULL)
+    {
+        std::ostringstream stream;
+        stream << filename << ":";
+        if (lineNumber > 0)
+            stream << lineNumber << ":";
+        stream << " " << message;
+        *error = stream.str();
     }
+    return false;
+}
+
+#pragma mark - FILTER STATE
+
+//--------------------------------------------------------------
+void GVF::snapshot(GVFSnapshot & snapshot){
+    
+    snapshot.numberOfGestures   = getNumberOfGestureTemplates();
+    snapshot.inputDimensions    = config.inputDimensions;
+    snapshot.logDomain          = config.logDomain;
+    snapshot.rotationIsIdentity = rotationIsIdentity;
+    snapshot.particles          = particleStore;
+    
+    if (config.logDomain)
+        snapshot.logPosterior.assign(logPosterior.begin(), logPosterior.begin() + particleStore.size());
+    else
+        snapshot.logPosterior.clear();
+    
+    snapshot.randomStates.resize((1 + numberChunks) * GVF_RANDOM_STATE_WORDS);
+    rng.getState(&snapshot.randomStates[0]);
+    for (int c = 0; c < numberChunks; c++)
+        chunkRng[c].getState(&snapshot.randomStates[(1 + c) * GVF_RANDOM_STATE_WORDS]);
     
-    infile.close();
+    if (theGesture.getNumberOfTemplates() > 0 && theGesture.getTemplateLength() > 0)
+        snapshot.gestureOrigin = theGesture.getInitialObservation();
+    else
+        snapshot.gestureOrigin.clear();
+}
+
+//--------------------------------------------------------------
+bool GVF::restore(const GVFSnapshot & snapshot){
+    
+    // check everything before touching the filter, against the vocabulary it will follow: the
+    // gesture being recorded in learning mode becomes a template when switching to following
+    int numberOfGestures = getNumberOfGestureTemplates();
+    int dimensions = config.inputDimensions;
+    if (state == GVF::STATE_LEARNING && theGesture.getNumberOfTemplates() > 0)
+    {
+        if (learningGesture == -1)
+            numberOfGestures++;
+        dimensions = theGesture.getNumberDimensions();
+    }
+    int expectedRotationsDim = (dimensions == 2) ? 1 : (dimensions == 3) ? 3 : 0;     // see train()
+    
+    const GVFParticles & particles = snapshot.particles;
+    int ns = particles.size();
+    int chunks = (ns + GVF_PARTICLES_PER_CHUNK - 1) / GVF_PARTICLES_PER_CHUNK;
+    if (numberOfGestures == 0 || snapshot.numberOfGestures != numberOfGestures || snapshot.inputDimensions != dimensions
+        || particles.getScalingsDim() != dimensions || particles.getRotationsDim() != expectedRotationsDim
+        || particles.getOffsetsDim() != dimensions || ns < 4
+        || (int)snapshot.randomStates.size() != (1 + chunks) * GVF_RANDOM_STATE_WORDS
+        || (snapshot.logDomain && (int)snapshot.logPosterior.size() != ns)
+        || (!snapshot.gestureOrigin.empty() && (int)snapshot.gestureOrigin.size() != dimensions))
+        return false;
+    const int *classes = particles.classes();
+    for (int n = 0; n < ns; n++)
+        if (classes[n] < 0 || classes[n] >= numberOfGestures)
+            return false;
+    
+    // the snapshot is accepted: only now switch to following (which trains the model)
+    if (state != GVF::STATE_FOLLOWING) setState(GVF::STATE_FOLLOWING);
+    if (state != GVF::STATE_FOLLOWING || getNumberOfGestureTemplates() != numberOfGestures
+        || config.inputDimensions != dimensions || scalingsDim != dimensions || rotationsDim != expectedRotationsDim)
+        return false;
+    
+    if (ns > particleStore.getCapacity())
+        setNumberOfParticles(ns);
+    else if (ns != parameters.numberParticles)
+        setLiveParticles(ns);
+    particleStore.copyParticles(particles);
+    
+    // weights in the current domain
+    if (config.logDomain)
+    {
+        if (snapshot.logDomain)
+            copy(snapshot.logPosterior.begin(), snapshot.logPosterior.end(), logPosterior.begin());
+        else
+            for (int n = 0; n < ns; n++)
+                logPosterior[n] = log(particleStore.weight()[n]);
+    }
+    
+    rng.setState(&snapshot.randomStates[0]);
+    for (int c = 0; c < numberChunks; c++)
+        chunkRng[c].setState(&snapshot.randomStates[(1 + c) * GVF_RANDOM_STATE_WORDS]);
+    rotationIsIdentity = snapshot.rotationIsIdentity;
+    
+    // the live gesture restarts from its origin
+    theGesture.clear();
+    if (!snapshot.gestureOrigin.empty())
+        theGesture.addObservation(snapshot.gestureOrigin);
+    
+    estimates();
+    return true;
+}
+
+//--------------------------------------------------------------
+// Binary export of the filter state: a GVFStateFileHeader followed by the classes [ns] (int32),
+// the float columns of the particles [C x ns], the log posterior [ns] (log domain only), the
+// random states and the origin of the live gesture
+bool GVF::saveState(string filename){
+    
+    GVFSnapshot state;
+    snapshot(state);
+    const GVFParticles & particles = state.particles;
+    int ns = particles.size();
+    
+    GVFStateFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, GVF_STATE_FILE_MAGIC, 4);
+    header.version              = GVF_STATE_FILE_VERSION;
+    header.byteOrder            = GVF_TEMPLATE_FILE_BYTE_ORDER;
+    header.numberOfGestures     = state.numberOfGestures;
+    header.inputDimensions      = state.inputDimensions;
+    header.numberParticles      = ns;
+    header.scalingsDim          = particles.getScalingsDim();
+    header.rotationsDim         = particles.getRotationsDim();
+    header.offsetsDim           = particles.getOffsetsDim();
+    header.logDomain            = state.logDomain;
+    header.rotationIsIdentity   = state.rotationIsIdentity;
+    header.numberOfRandomWords  = (uint32_t)state.randomStates.size();
+    header.originSize           = (uint32_t)state.gestureOrigin.size();
+    
+    FILE *file = fopen(filename.c_str(), "wb");
+    if (file == NULL)
+        return false;
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1
+                && fwrite(particles.classes(), sizeof(int), ns, file) == (size_t)ns;
+    for (int c = 0; written && c < particles.getNumberOfColumns(); c++)
+        written = fwrite(particles.column(c), sizeof(float), ns, file) == (size_t)ns;
+    if (written && state.logDomain)
+        written = fwrite(&state.logPosterior[0], sizeof(float), ns, file) == (size_t)ns;
+    if (written && !state.randomStates.empty())
+        written = fwrite(&state.randomStates[0], sizeof(uint32_t), state.randomStates.size(), file) == state.randomStates.size();
+    if (written && !state.gestureOrigin.empty())
+        written = fwrite(&state.gestureOrigin[0], sizeof(float), state.gestureOrigin.size(), file) == state.gestureOrigin.size();
+    return (fclose(file) == 0) && written;
+}
+
+//--------------------------------------------------------------
+bool GVF::loadState(string filename){
+    
+    FILE *file = fopen(filename.c_str(), "rb");
+    if (file == NULL)
+        return false;
+    fseek(file, 0, SEEK_END);
+    long fileSize = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    
+    GVFStateFileHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1
+        || memcmp(header.magic, GVF_STATE_FILE_MAGIC, 4) != 0
+        || header.version != GVF_STATE_FILE_VERSION
+        || header.byteOrder != GVF_TEMPLATE_FILE_BYTE_ORDER
+        || header.offsetsDim != header.inputDimensions)
+    {
+        fclose(file);
+        return false;
+    }
+    
+    // the sizes announced by the header must add up to the size of the file
+    GVFSnapshot state;
+    GVFParticles & particles = state.particles;
+    uint64_t ns = header.numberParticles;
+    uint64_t numberOfColumns = 4 + header.scalingsDim + header.rotationsDim + header.offsetsDim + gvfRotationTermsDim(header.rotationsDim);
+    uint64_t expectedSize = sizeof(header) + ns * (sizeof(int) + numberOfColumns * sizeof(float))
+                          + (header.logDomain ? ns * sizeof(float) : 0)
+                          + header.numberOfRandomWords * (uint64_t)sizeof(uint32_t) + header.originSize * (uint64_t)sizeof(float);
+    if (header.scalingsDim > 1024 || header.rotationsDim > 3 || expectedSize != (uint64_t)fileSize)
+    {
+        fclose(file);
+        return false;
+    }
+    
+    state.numberOfGestures      = header.numberOfGestures;
+    state.inputDimensions       = header.inputDimensions;
+    state.logDomain             = (header.logDomain != 0);
+    state.rotationIsIdentity    = (header.rotationIsIdentity != 0);
+    particles.resize((int)ns, header.scalingsDim, header.rotationsDim, header.offsetsDim);
+    state.logPosterior.resize(state.logDomain ? ns : 0);
+    state.randomStates.resize(header.numberOfRandomWords);
+    state.gestureOrigin.resize(header.originSize);
+    
+    bool read = fread(particles.classes(), sizeof(int), ns, file) == ns;
+    for (int c = 0; read && c < particles.getNumberOfColumns(); c++)
+        read = fread(particles.column(c), sizeof(float), ns, file) == ns;
+    if (read && state.logDomain)
+        read = fread(&state.logPosterior[0], sizeof(float), ns, file) == ns;
+    if (read && !state.randomStates.empty())
+        read = fread(&state.randomStates[0], sizeof(uint32_t), state.randomStates.size(), file) == state.randomStates.size();
+    if (read && !state.gestureOrigin.empty())
+        read = fread(&state.gestureOrigin[0], sizeof(float), state.gestureOrigin.size(), file) == state.gestureOrigin.size();
+    fclose(file);
+    
+    return read && restore(state);
+}
+
+//--------------------------------------------------------------
+// Binary export of the packed vocabulary, see GVFTemplateFile.h for the format
+bool GVF::saveTemplatesBinary(string filename){
+    
+    int numberOfGestures = getNumberOfGestureTemplates();
+    size_t size = (numberOfGestures > 0) ? vocabularyOffsets.back() + (size_t)vocabularyLengths.back() * vocabularyFrameStride : 0;
+    vector<float> emptyRange(config.inputDimensions, 0.0f);
+    bool ranged = ((int)minRange.size() == config.inputDimensions);
+    return GVFTemplateFile::write(filename, config.inputDimensions, vocabularyFrameStride,
+                                  vocabularyOffsets, vocabularyLengths,
+                                  ranged ? minRange : emptyRange, ranged ? maxRange : emptyRange,
+                                  vocabulary, size);
+}
+
+//--------------------------------------------------------------
+// Binary import: the file is mapped and its frames are followed in place
+bool GVF::loadTemplatesBinary(string filename){
+    
+    GVFTemplateFile file;
+    if (!file.open(filename))
+        return false;
+    templateFile.swap(file);    // the previous mapping, if any, is released when leaving
+    
+    gestureTemplates.clear();
+    config.inputDimensions  = templateFile.getDimensions();
+    minRange                = templateFile.getMinRange();
+    maxRange                = templateFile.getMaxRange();
+    vocabularyFrameStride   = templateFile.getFrameStride();
+    vocabularyOffsets       = templateFile.getOffsets();
+    vocabularyLengths       = templateFile.getLengths();
+    vocabulary              = templateFile.getFrames();
+    
+    activeGestures.resize(getNumberOfGestureTemplates());
+    std::iota(activeGestures.begin(), activeGestures.end(), 1);
+    
+    train();
+    return true;
 }
 
 
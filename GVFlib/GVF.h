@@ -16,6 +16,13 @@
 
 #include "GVFUtils.h"
 #include "GVFGesture.h"
+#include "GVFParticles.h"
+#include "GVFKernels.h"
+#include "GVFRandom.h"
+#include "GVFThreadPool.h"
+#include "GVFResampling.h"
+#include "GVFTemplateFile.h"
+#include "GVFProfiler.h"
 #include <random>
 #include <iostream>
 #include <iomanip>
@@ -27,9 +34,24 @@
 
 using namespace std;
 
+// State of a following filter, captured by GVF::snapshot() and written by GVF::saveState()
+typedef struct
+{
+    int                 numberOfGestures;       // vocabulary the state was captured with [G]
+    int                 inputDimensions;        // [D]
+    bool                logDomain;              // weights were computed in the log domain
+    bool                rotationIsIdentity;     // no particle had rotated yet
+    GVFParticles        particles;              // every particle column, classes and weights included
+    vector<float>       logPosterior;           // normalised log posterior [ns] (log domain only)
+    vector<uint32_t>    randomStates;           // main random stream then one per chunk [(1 + chunks) x GVF_RANDOM_STATE_WORDS]
+    vector<float>       gestureOrigin;          // first observation of the live gesture [D], empty before it starts
+} GVFSnapshot;
+
 class GVF
 {
     
+    friend class GVFBank;   // runs the filter steps of its sessions on the particle ranges of an engine GVF
+    
 public:
     
     /** 
@@ -157,6 +179,23 @@ public:
      */
     GVFOutcomes & update(vector<float> & observation);
     
+    /**
+     * Follow a whole recording in one call
+     *
+     * @details same as calling update() on every frame, without building an observation vector
+     * per frame: the outcomes of frame f are written in row f of the columns of the sink. The
+     * recording continues the current gesture, call startGesture() before it to follow a new one
+     * (its frames are followed relative to the origin of the gesture, but are not added to the
+     * live gesture)
+     *
+     * @param data first value of the first frame
+     * @param frames number of frames
+     * @param stride distance in floats between two consecutive frames (at least the input dimension)
+     * @param sink columnar buffers receiving the outcomes
+     * @return the number of frames processed (bounded by the capacity of the sink)
+     */
+    size_t updateBatch(const float * data, size_t frames, size_t stride, GVFOutcomeSink & sink);
+    
     /**
      * Define a subset of gesture templates on which to perform the recognition
      * and variation tracking
@@ -193,6 +232,15 @@ public:
      */
     void segmentation(bool segmentationFlag);
     
+    /**
+     * Compute the weights in the log domain
+     * @details likelihoods, priors and posteriors are kept as logarithms and normalised with a
+     * log-sum-exp, so that the weights cannot all underflow to zero with small tolerances or
+     * many prediction steps. The outcomes are unchanged.
+     * @param logDomainFlag boolean to activate or deactivate the log domain (default is false)
+     */
+    void logDomain(bool logDomainFlag);
+    
 #pragma mark - [ Accessors ]
 #pragma mark > Parameters
     /**
@@ -222,10 +270,56 @@ public:
     
     /**
      * Get the current number of particles
-     * @return the current number of particles
+     * @return the current number of particles (changes over time with adaptive particles)
      */
     int getNumberOfParticles();
     
+    /**
+     * Adapt the number of particles to the spread of the posterior (KLD-sampling)
+     * @details every frame, the posterior mass is binned over gesture and alignment, and the number
+     * of particles is set to the number needed for the KL divergence between the particles and the
+     * posterior to stay below error with the given confidence, for the number of bins the particles
+     * would occupy (Fox, 2003). Many particles are used while the posterior is spread over several
+     * gestures and alignments, few once it has converged. The number of particles changes through
+     * resampling only, so tracking goes on; the columns are allocated for maximumParticles once.
+     * The resampling threshold is relative to the number of particles set with setNumberOfParticles().
+     * Like setNumberOfParticles(), this re-initialises the particles.
+     * @param adaptive enable or disable the adaptation (disabled by default)
+     * @param minimumParticles lower bound of the number of particles
+     * @param maximumParticles upper bound of the number of particles
+     * @param error bound on the KL divergence (default is 0.05)
+     * @param quantile upper standard normal quantile of the confidence (default is 2.33, 99%)
+     */
+    void setAdaptiveParticles(bool adaptive, int minimumParticles = 100, int maximumParticles = 5000,
+                              float error = 0.05f, float quantile = 2.33f);
+    
+    /**
+     * Get whether the number of particles adapts to the posterior
+     */
+    bool getAdaptiveParticles();
+    
+    /**
+     * Prune the improbable gestures
+     * @details when resampling, the gestures whose probability is below floor only keep
+     * explorationParticles particles, so that they can still take over, and the other particles are
+     * drawn from the leading gestures in proportion to their probabilities; the weights of the drawn
+     * particles compensate, so the estimated probabilities are unbiased. A resampling is triggered as
+     * soon as the pruned gestures hold more than a tenth of the particles beyond their budget, which
+     * in segmentation mode trims the particles respawned on every gesture at the end of a gesture
+     * once the next one is recognised. The budget is lowered so that the pruned gestures never take
+     * more than a quarter of the particles. While gestures are pruned, resampling is systematic (or
+     * stratified when selected).
+     * @param pruning enable or disable the pruning (disabled by default)
+     * @param floor probability below which a gesture is pruned (default is 0.001)
+     * @param explorationParticles particles kept on each pruned gesture (default is 1)
+     */
+    void setClassPruning(bool pruning, float floor = 0.001f, int explorationParticles = 1);
+    
+    /**
+     * Get whether the improbable gestures are pruned
+     */
+    bool getClassPruning();
+    
     /**
      * Number of prediciton steps
      * @details it is possible to leave GVF to perform few steps of prediction
@@ -256,6 +350,37 @@ public:
      */
     int getResamplingThreshold();
     
+    /**
+     * Set the number of frames of the live gesture kept in following mode
+     * @details only the last observation is used by the filter, older frames are overwritten in a ring
+     * buffer so that long following sessions run in constant memory and time. The ring is allocated
+     * when the model is trained (at once in following mode), so update() does not allocate from the
+     * first frame. The translation origin stays the first observation of the gesture.
+     * @param liveHistoryLength number of frames (default is 256), 0 to keep the whole gesture
+     */
+    void setLiveHistoryLength(int liveHistoryLength);
+    
+    /**
+     * Get the number of frames of the live gesture kept in following mode
+     * @return live history length
+     */
+    int getLiveHistoryLength();
+    
+    /**
+     * Set the resampling scheme
+     * @details systematic and stratified resampling are the cheapest, residual resampling has the lowest
+     * variance, multinomial resampling draws the particles independently and Metropolis resampling
+     * avoids the cumulative sum of the weights so that it is split over the threads
+     * @param resamplingScheme the scheme (default is RESAMPLING_SYSTEMATIC)
+     */
+    void setResamplingScheme(GVFResamplingScheme resamplingScheme);
+    
+    /**
+     * Get the current resampling scheme
+     * @return resampling scheme
+     */
+    GVFResamplingScheme getResamplingScheme();
+    
 #pragma mark > Dynamics
     /**
      * Change variance of adaptation in dynamics
@@ -397,6 +522,104 @@ public:
      */
     void setSpreadRotations(float min, float max, int dim = -1);
     
+#pragma mark > Multithreading
+    
+    /**
+     * Set the number of threads used to propagate the particles
+     * @details particles are processed in chunks of fixed size, each chunk having its own
+     * random stream, so that the results do not depend on the number of threads. With the default value
+     * (1) everything runs on the calling thread; above 1 a pool of persistent worker threads is created.
+     * Multithreading only pays off with large numbers of particles (several thousands).
+     * @param numberOfThreads number of threads including the calling thread
+     */
+    void setNumberOfThreads(int numberOfThreads);
+    
+    /**
+     * Get the number of threads used to propagate the particles
+     * @return number of threads including the calling thread
+     */
+    int getNumberOfThreads();
+    
+#pragma mark > Performance
+    
+    /**
+     * Get the timings of the stages of update() and the filter counters
+     * @details the timings are the mean and percentiles (in microseconds) over the last
+     * GVF_PROFILING_WINDOW frames. They are only measured when the library is built with
+     * GVF_PROFILING defined; otherwise the timing code is compiled out and stats.enabled is false.
+     * @return timings and counters since the last reset
+     */
+    GVFPerformanceStats getPerformanceStats();
+    
+    /**
+     * Forget the timings and counters of getPerformanceStats()
+     */
+    void resetPerformanceStats();
+    
+    /**
+     * Keep update() within a time budget (deadline mode)
+     * @details update() measures its own duration and keeps a smoothed cost per particle and
+     * prediction step, which rises quickly on the frames over the budget and decays slowly. The
+     * particles are sized for 80% of the budget: the prediction steps are shed first, down to one,
+     * then the particles, down to minimumParticles. The number of particles only changes through
+     * resampling, at once when it exceeds what the budget affords, and goes back up to the number set
+     * with setNumberOfParticles() (or the adapted number, see setAdaptiveParticles()) when time
+     * allows. getDeadlineStatus() tells when quality is degraded.
+     * @param microseconds time budget of a frame, 0 to turn the mode off (default)
+     * @param minimumParticles fewest particles the budget can leave
+     */
+    void setTimeBudget(float microseconds, int minimumParticles = 100);
+    
+    /**
+     * Get the time budget of a frame in microseconds, 0 when the deadline mode is off
+     */
+    float getTimeBudget();
+    
+    /**
+     * Get the state of the deadline mode
+     * @return measured cost, particles and prediction steps afforded by the budget, whether quality
+     * is degraded and the number of frames over the budget
+     */
+    GVFDeadlineStatus getDeadlineStatus();
+    
+#pragma mark - Filter state
+    
+    /**
+     * Capture the state of the filter
+     * @details copies the particles, their weights, the random streams and the origin of the live
+     * gesture into the snapshot; a snapshot that is reused does not allocate. Restoring it makes the
+     * filter continue exactly as it would have from this point.
+     * @param snapshot state receiving the copy
+     */
+    void snapshot(GVFSnapshot & snapshot);
+    
+    /**
+     * Resume following from a captured state
+     * @details the model must hold the vocabulary the state was captured with (same number of gestures
+     * and dimensions); the number of particles of the state is adopted. The live gesture keeps its
+     * origin, the frames it had already received are not restored. In learning mode the gesture being
+     * recorded counts in the vocabulary, and the filter only switches to following once the state is
+     * accepted.
+     * @param snapshot state given by snapshot() or loadState()
+     * @return false if the state does not fit the vocabulary, the filter being left untouched
+     */
+    bool restore(const GVFSnapshot & snapshot);
+    
+    /**
+     * Save the state of the filter in a compact, versioned binary file
+     * @param filename file name as a string
+     * @return false if the file could not be written
+     */
+    bool saveState(string filename);
+    
+    /**
+     * Resume following from a file written by saveState()
+     * @details see restore()
+     * @param filename file name as a string
+     * @return false if the file is not a valid state file or does not fit the vocabulary
+     */
+    bool loadState(string filename);
+    
 #pragma mark - Import/Export templates
     /**
      * Export template data in a filename
@@ -406,10 +629,33 @@ public:
 
     /**
      * Import template data in a filename
-     * @details needs to respect a given format provided by saveTemplates()
+     * @details needs to respect a given format provided by saveTemplates(). The file is streamed
+     * through a fixed buffer and the templates are added to the current ones, the model being
+     * trained once at the end. Nothing is added if the file has an error, e.g. a template whose
+     * dimension differs from the other templates of the file or from the templates already loaded.
      * @param file name as a string
+     * @param error if not NULL, receives "filename:line: message" when the file cannot be loaded
+     * @return false if the file cannot be read or has an error
      */
-    void loadTemplates(string filename);
+    bool loadTemplates(string filename, string * error = NULL);
+    
+    /**
+     * Export template data in a binary file
+     * @details the packed vocabulary is written as is (see GVFTemplateFile.h for the format)
+     * @param filename file name as a string
+     * @return false if the file could not be written
+     */
+    bool saveTemplatesBinary(string filename);
+    
+    /**
+     * Import template data from a binary file written by saveTemplatesBinary()
+     * @details the file is memory-mapped and its frames are followed in place, without parsing; the
+     * loaded templates replace the current ones and the model is trained once. The frames are copied
+     * into gesture templates (and the file released) only when the templates are accessed or edited.
+     * @param filename file name as a string
+     * @return false if the file is not a valid template file, in which case the templates are kept
+     */
+    bool loadTemplatesBinary(string filename);
 
 protected:
     
@@ -431,54 +677,135 @@ protected:
     int     mostProbableIndex;                  // cached most probable index
     int     learningGesture;
     
-    vector<int>             classes;            // gesture index for each particle [ns x 1]
-    vector<float >          alignment;          // alignment index (between 0 and 1) [ns x 1]
-    vector<vector<float> >  dynamics;           // dynamics estimation [ns x 2]
-    vector<vector<float> >  scalings;           // scalings estimation [ns x D]
-    vector<vector<float> >  rotations;          // rotations estimation [ns x A]
-    vector<float>           weights;            // weight of each particle [ns x 1]
-    vector<float>           prior;              // prior of each particle [ns x 1]
-    vector<float>           posterior;          // poserior of each particle [ns x 1]
-    vector<float>           likelihood;         // likelihood of each particle [ns x 1]
-    
-    // estimations
+    GVFParticles            particleStore;      // particle state: classes, alignment, dynamics [ns x 2], scalings [ns x D], rotations [ns x A], offsets [ns x D] and posterior (weight) [ns x 1]
+    vector<float>           prior;              // prior of each particle [ns x 1] (log prior in the log domain)
+    vector<float>           likelihood;         // likelihood of each particle [ns x 1] (log-likelihood in the log domain)
+    vector<float>           logPosterior;       // normalised log posterior of each particle in the log domain [ns x 1]
+    vector<int>             frameIndices;       // position in the vocabulary of the template frame of each particle [ns x 1]
+    
+    // gesture templates packed in one buffer, rebuilt by train() and when templates are replaced or removed
+    vector<float>           vocabularyFrames;       // packed frames of every template, template after template
+    const float             *vocabulary;            // frames followed by the kernels: vocabularyFrames or the payload of templateFile
+    GVFTemplateFile         templateFile;           // binary vocabulary mapped by loadTemplatesBinary(), until the templates are edited
+    vector<int>             vocabularyOffsets;      // position of the first frame of each template [G x 1]
+    vector<int>             vocabularyLengths;      // number of frames of each template [G x 1]
+    int                     vocabularyFrameStride;  // floats per packed frame
+    vector<float>           noiseBuffer;        // random draws for one transition of the state, one column per state component [(3+D+A) x stride]
+    
+    // scratch buffers sized in train() so that following does not allocate
+    vector<float>           lastObservation;            // current observation [D]
+    vector<float>           batchObservation;           // frame of updateBatch() being followed [D]
+    GVFParticles            resamplingParticles;        // back buffer of the particles, swapped with particleStore on resampling
+    vector<float>           cumulativeWeights;          // cumulative distribution of the weights [ns x 1]
+    vector<int>             ancestors;                  // index of the particle each resampled particle comes from [ns x 1]
+    vector<float>           resamplingScratch;          // uniforms, residuals or alias probabilities [ns x 1]
+    vector<int>             aliasIndices;               // alias table of the multinomial scheme [ns x 1]
+    vector<int>             aliasWork;                  // work list used to build the alias table [ns x 1]
+    int                     metropolisSteps;            // chain length of the Metropolis scheme for the current frame
+    
+    // estimations: weighted sums of the state of each gesture, accumulated per chunk [chunks x G x K]
+    // with K = 4 (weights, non-NaN weights, alignment, likelihood) + dynamics + scalings + rotations
+    vector<float>           estimateAccumulators;
+    int                     estimateStride;             // floats per gesture [K]
     vector<float>           estimatedGesture;           // ..
-    vector<float>           estimatedAlignment;         // ..
-    vector<vector<float> >  estimatedDynamics;          // ..
-    vector<vector<float> >  estimatedScalings;          // ..
-    vector<vector<float> >  estimatedRotations;         // ..
-    vector<float>           estimatedProbabilities;     // ..
-    vector<float>           estimatedLikelihoods;       // ..
     vector<float>           absoluteLikelihoods;        // ..
+    int                     particlesPerFilter;         // particles of one filter: all of them, or one session of a GVFBank
+    int                     trainedParticles;           // number of particles set by the user, the resampling threshold is relative to it
+    vector<float>           binMasses;                  // posterior mass of each (gesture, alignment) bin of the adaptation [G x B]
+    vector<float>           occupiedMasses;             // masses of the non-empty bins
+    vector<float>           classMasses;                // posterior mass of each gesture [G x 1]
+    vector<int>             classCounts;                // particles of each gesture, then draws of each gesture when resampling [G x 1]
+    vector<float>           classShares;                // share of the resampled particles of each gesture when pruning [G x 1]
+    vector<float>           classWeights;               // weight of the resampled particles of each gesture when pruning [G x 1]
+    vector<float>           prunedWeights;              // weights scaled by the share of their gesture, drawn from when pruning [ns x 1]
+    int                     numberPruned;               // gestures below the pruning floor in the current frame
+    bool                    prunedResampling;           // the resampling in progress draws from prunedWeights
+    GVFDeadlineStatus       deadlineStatus;             // state of the deadline mode
+    float                   deadlineUnitCost;           // smoothed duration of update() per particle and prediction step [us]
+    int                     livePredictionSteps;        // prediction steps of the current frame (fewer under a time budget)
 
     bool tolerancesetmanually;
     
-
-    vector<vector<float> >  offsets;                    // translation offset
-    
     vector<int> activeGestures;
 
     vector<float> gestureProbabilities;
-    vector< vector<float> > particles;
+    vector< vector<float> > particles;          // built by getParticlesPositions()
 
 private:
 
     // random number generator
     std::random_device                      rd;
-    std::mt19937                            normgen;
-    std::normal_distribution<float>         *rndnorm;
-    std::default_random_engine              unifgen;
-    std::uniform_real_distribution<float>   *rndunif;
+    GVFRandom                               rng;
+    uint64_t                                seed;           // seed of the random streams of the chunks
+    
+    // particles are propagated by chunks, possibly on several threads
+    GVFThreadPool                           *threadPool;    // worker pool, NULL when running on the calling thread only
+    int                                     numberChunks;
+    vector<GVFRandom>                       chunkRng;       // random stream of each chunk
+    vector<float>                           chunkSums;      // partial sums of each chunk, reduced in chunk order
+    vector<float>                           *currentObservation;
+    float                                   sumWeights;
+    
+    // batched likelihood kernel selected for the running CPU
+    GVFLikelihoodKernel                     likelihoodKernel;
+    
+    // exponential of shifted log-weights, with their sum (log domain)
+    GVFExpSumKernel                         expSumKernel;
+    float                                   maxLogWeight;   // largest log posterior of the current frame
+    
+    // rotation terms (cos/sin or rotation matrix) computed from the rotation angles
+    GVFRotationKernel                       rotationKernel;
+    bool                                    rotationIsIdentity; // true while every particle has a zero rotation
+    
+    // stage timings and counters (only fed when built with GVF_PROFILING)
+    GVFProfiler                             profiler;
 
 #pragma mark - Private methods for model mechanics
     void initPrior();
+    void initPrior(int begin, int end, GVFRandom & random);
     void initNoiseParameters();
-    void updateLikelihood(vector<float> obs, int n);
-    void updatePrior(int n);
-    void updatePosterior(int n);
-    void resampleAccordingToWeights(vector<float> obs);
+    int updateLikelihood(vector<float> & obs, int begin, int end, GVFRandom & random);
+    void updatePrior(int begin, int end, GVFRandom & random);
+    void updatePosterior(int begin, int end);
+    void propagateChunk(int chunk);
+    void normaliseChunk(int chunk);
+    void metropolisChunk(int chunk);
+    void gatherChunk(int chunk);
+    void estimateChunk(int chunk);
+    void estimateRange(int begin, int end, float * sums);
+    void expSumChunk(int chunk);
+    void runChunks(GVFTask task);
+    static void propagateTask(void * gvf, int chunk);
+    static void normaliseTask(void * gvf, int chunk);
+    static void metropolisTask(void * gvf, int chunk);
+    static void gatherTask(void * gvf, int chunk);
+    static void estimateTask(void * gvf, int chunk);
+    static void expSumTask(void * gvf, int chunk);
+    float partialWeights(int begin, int end);
+    float scaleWeights(int begin, int end, float sum, float shift);
+    float normaliseRange(int begin, int end);
+    void resampleAccordingToWeights(int count);
+    void drawAncestors(const float * weights, int n, int count, GVFResamplingScheme scheme, GVFRandom & random, int offset);
+    void resampleRange(int begin, int end, GVFRandom & random);
+    void uniformWeights(GVFParticles & particles, int begin, int end, int count);
+    int adaptedNumberOfParticles();
+    void setLiveParticles(int count);
+    int prunedParticles(int count);
+    void scalePrunedWeights();
+    void weighPrunedDraws(int count);
+    void updateDeadline(float duration, int units);
     void estimates();       // update estimated outcome
+    float * estimateSums();
+    void fillOutcomes(const float * sums, GVFOutcomes & result);
+    void initOutcomes(GVFOutcomes & result);
+    void writeOutcomes(const float * sums, GVFOutcomeSink & sink, size_t frame);
+    void filterFrame(vector<float> & obs);
     void train();
+    void packVocabulary();
+    void materializeTemplates();
+    void updateRanges();
+    bool templatesError(string * error, const string & filename, int lineNumber, const string & message);
+    void copyVocabulary(GVF & model);
     
     
 };
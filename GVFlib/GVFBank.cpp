@@ -0,0 +1,196 @@
+/**
+ * Bank of independent Gesture Variation Follower sessions sharing one vocabulary
+ *
+ * Copyright (C) 2015 Baptiste Caramiaux, Nicola Montecchio
+ * STMS lab Ircam-CRNS-UPMC, University of Padova, Goldsmiths College University of London
+ *
+ * The library is under the GNU Lesser General Public License (LGPL v3)
+ */
+
+#include "GVFBank.h"
+
+using namespace std;
+
+//--------------------------------------------------------------
+GVFBank::GVFBank(GVF & model, int numberOfSessions, int particlesPerSession)
+{
+    assert(model.getNumberOfGestureTemplates() > 0);
+    assert(numberOfSessions > 0);
+
+    numberSessions = numberOfSessions;
+    sessionSize    = (particlesPerSession > 0) ? max(particlesPerSession, 4) : model.parameters.numberParticles;
+
+    // sessions start on a column alignment boundary, like the columns themselves
+    const int floatsPerLine = GVF_ALIGNMENT / sizeof(float);
+    sessionStride = ((sessionSize + floatsPerLine - 1) / floatsPerLine) * floatsPerLine;
+
+    // the threshold of the model is relative to its own number of particles
+    resamplingThreshold = model.parameters.resamplingThreshold * sessionSize / (float)model.parameters.numberParticles;
+
+    // the engine is trained once on the whole arena, the vocabulary being shared by every session
+    engine.config               = model.config;
+    engine.parameters           = model.parameters;
+    engine.copyVocabulary(model);
+    engine.activeGestures       = model.activeGestures;
+    engine.tolerancesetmanually = model.tolerancesetmanually;
+    engine.parameters.numberParticles = numberSessions * sessionStride;
+    engine.parameters.adaptiveParticles = false;    // sessions have a fixed size in the arena
+    engine.parameters.classPruning      = false;    // sessions are resampled on their own
+    engine.parameters.timeBudget        = 0.0f;     // the sweep is timed by the caller
+    engine.train();
+    engine.particlesPerFilter   = sessionSize;
+    engine.state                = GVF::STATE_FOLLOWING;
+
+    int numberOfGestures = engine.getNumberOfGestureTemplates();
+    sessionRng.resize(numberSessions);
+    origins.assign(numberSessions, vector<float>(engine.config.inputDimensions, 0.0f));
+    originSet.assign(numberSessions, 0);
+    translatedObservations.assign(numberSessions, vector<float>(engine.config.inputDimensions, 0.0f));
+    estimateSums.assign(numberSessions * numberOfGestures * engine.estimateStride, 0.0f);
+    sessionOutcomes.resize(numberSessions);
+    for (int s = 0; s < numberSessions; s++)
+    {
+        sessionRng[s].setSeed(engine.seed + s);
+        engine.initOutcomes(sessionOutcomes[s]);
+        restart(s);
+    }
+
+    sweepSessions     = NULL;
+    sweepObservations = NULL;
+}
+
+//--------------------------------------------------------------
+GVFBank::~GVFBank()
+{
+}
+
+#pragma mark - Following
+
+//--------------------------------------------------------------
+void GVFBank::restart(int session)
+{
+    assert(session >= 0 && session < numberSessions);
+    int begin = session * sessionStride;
+    engine.initPrior(begin, begin + sessionSize, sessionRng[session]);
+    originSet[session] = 0;
+}
+
+//--------------------------------------------------------------
+void GVFBank::restartAll()
+{
+    for (int s = 0; s < numberSessions; s++)
+        restart(s);
+}
+
+//--------------------------------------------------------------
+GVFOutcomes & GVFBank::update(int session, const vector<float> & observation)
+{
+    assert(session >= 0 && session < numberSessions);
+    updateSession(session, observation);
+    return sessionOutcomes[session];
+}
+
+//--------------------------------------------------------------
+void GVFBank::updateMany(const vector<int> & sessionIds, const vector< vector<float> > & observations)
+{
+    assert(sessionIds.size() == observations.size());
+
+    sweepSessions     = &sessionIds;
+    sweepObservations = &observations;
+    int numberOfUpdates = (int)sessionIds.size();
+    if (engine.threadPool != NULL && numberOfUpdates > 1)
+        engine.threadPool->run(&GVFBank::sweepTask, this, numberOfUpdates);
+    else
+        for (int k = 0; k < numberOfUpdates; k++)
+            sweepChunk(k);
+    sweepSessions     = NULL;
+    sweepObservations = NULL;
+}
+
+//--------------------------------------------------------------
+GVFOutcomes & GVFBank::getOutcomes(int session)
+{
+    assert(session >= 0 && session < numberSessions);
+    return sessionOutcomes[session];
+}
+
+//--------------------------------------------------------------
+// one session of the running sweep
+void GVFBank::sweepChunk(int chunk)
+{
+    int session = (*sweepSessions)[chunk];
+    assert(session >= 0 && session < numberSessions);
+    updateSession(session, (*sweepObservations)[chunk]);
+}
+
+//--------------------------------------------------------------
+void GVFBank::sweepTask(void * bank, int chunk)
+{
+    ((GVFBank *)bank)->sweepChunk(chunk);
+}
+
+//--------------------------------------------------------------
+// same steps as GVF::update() on the particle range of the session, which only touches the
+// state of that session and can therefore run concurrently with the other sessions
+void GVFBank::updateSession(int session, const vector<float> & observation)
+{
+    int begin = session * sessionStride;
+    int end   = begin + sessionSize;
+    GVFRandom & random = sessionRng[session];
+
+    // observations are translated to the origin of the gesture, like GVFGesture does
+    vector<float> & origin = origins[session];
+    vector<float> & obs    = translatedObservations[session];
+    assert(observation.size() == obs.size());
+    if (!originSet[session])
+    {
+        copy(observation.begin(), observation.end(), origin.begin());
+        originSet[session] = 1;
+    }
+    for (int d = 0; d < (int)obs.size(); d++)
+        obs[d] = observation[d] - origin[d];
+
+    for (int m = 0; m < engine.parameters.predictionSteps; m++)
+    {
+        engine.updatePrior(begin, end, random);
+        engine.updateLikelihood(obs, begin, end, random);
+        engine.updatePosterior(begin, end);
+    }
+
+    // normalize the weights of the session and avoid degeneracy (no particles active, i.e. weight = 0)
+    // by resampling, the same steps as GVF::update() on the range of the session
+    float dotProdw = engine.normaliseRange(begin, end);
+    if ((1./dotProdw) < resamplingThreshold)
+        engine.resampleRange(begin, end, random);
+
+    // estimate outcomes
+    float *sums = &estimateSums[session * engine.getNumberOfGestureTemplates() * engine.estimateStride];
+    engine.estimateRange(begin, end, sums);
+    engine.fillOutcomes(sums, sessionOutcomes[session]);
+}
+
+#pragma mark - Accessors
+
+//--------------------------------------------------------------
+int GVFBank::getNumberOfSessions()
+{
+    return numberSessions;
+}
+
+//--------------------------------------------------------------
+int GVFBank::getNumberOfParticlesPerSession()
+{
+    return sessionSize;
+}
+
+//--------------------------------------------------------------
+void GVFBank::setNumberOfThreads(int numberOfThreads)
+{
+    engine.setNumberOfThreads(numberOfThreads);
+}
+
+//--------------------------------------------------------------
+int GVFBank::getNumberOfThreads()
+{
+    return engine.getNumberOfThreads();
+}
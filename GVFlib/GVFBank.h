@@ -0,0 +1,135 @@
+/**
+ * Bank of independent Gesture Variation Follower sessions sharing one vocabulary
+ *
+ * @details A GVFBank follows many gestures at once (one per session: a user, a device, a
+ * performer...) with the templates, configuration and parameters of a trained GVF. The particles of
+ * every session live side by side in the columns of one particle store, session s owning the range
+ * [s * stride, s * stride + particlesPerSession), and the template vocabulary is packed once for all
+ * the sessions. updateMany() advances a set of sessions in one sweep, the sessions being spread over
+ * the worker threads; each session has its own random stream so that its results do not depend on
+ * the other sessions nor on the number of threads.
+ *
+ * Copyright (C) 2015 Baptiste Caramiaux, Nicola Montecchio
+ * STMS lab Ircam-CRNS-UPMC, University of Padova, Goldsmiths College University of London
+ *
+ * The library is under the GNU Lesser General Public License (LGPL v3)
+ */
+
+#ifndef _H_GVFBANK
+#define _H_GVFBANK
+
+#include "GVF.h"
+
+using namespace std;
+
+class GVFBank
+{
+
+public:
+
+#pragma mark - Constructors
+
+    /**
+     * Create a bank of sessions following the gestures of a GVF
+     * @details the vocabulary, configuration and parameters of the model are copied once, later
+     * changes of the model are not seen by the bank. Every session starts from the initial prior.
+     * @param model GVF holding at least one gesture template
+     * @param numberOfSessions number of independent sessions
+     * @param particlesPerSession number of particles of each session (default is the number of particles of the model)
+     */
+    GVFBank(GVF & model, int numberOfSessions, int particlesPerSession = 0);
+
+    /**
+     * GVFBank destructor
+     */
+    ~GVFBank();
+
+#pragma mark - Following
+
+    /**
+     * Start a new gesture in a session
+     * @details re-sample the particles of the session at the origin (initial prior), the next
+     * observation of the session being the origin of the gesture
+     * @param session session index
+     */
+    void restart(int session);
+
+    /**
+     * Start a new gesture in every session
+     */
+    void restartAll();
+
+    /**
+     * Follow one observation in one session
+     * @param session session index
+     * @param observation observation of the session
+     * @return the outcomes of the session
+     */
+    GVFOutcomes & update(int session, const vector<float> & observation);
+
+    /**
+     * Follow one observation in each of a set of sessions
+     * @details the sessions are processed in a single sweep over the worker threads, the
+     * outcomes being read with getOutcomes() afterwards
+     * @param sessionIds indices of the sessions to update, each session at most once
+     * @param observations observation of each listed session (same size as sessionIds)
+     */
+    void updateMany(const vector<int> & sessionIds, const vector< vector<float> > & observations);
+
+    /**
+     * Get the outcomes of a session after its last update
+     * @param session session index
+     * @return the outcomes of the session
+     */
+    GVFOutcomes & getOutcomes(int session);
+
+#pragma mark - Accessors
+
+    /**
+     * Get the number of sessions
+     */
+    int getNumberOfSessions();
+
+    /**
+     * Get the number of particles of each session
+     */
+    int getNumberOfParticlesPerSession();
+
+    /**
+     * Set the number of threads the sessions are spread over
+     * @param numberOfThreads number of threads including the calling thread
+     */
+    void setNumberOfThreads(int numberOfThreads);
+
+    /**
+     * Get the number of threads the sessions are spread over
+     */
+    int getNumberOfThreads();
+
+private:
+
+    GVF                         engine;                 // holds the vocabulary and the particles of every session
+    int                         numberSessions;
+    int                         sessionSize;            // particles per session
+    int                         sessionStride;          // distance between two sessions in the particle columns
+    float                       resamplingThreshold;    // per session
+
+    vector<GVFRandom>           sessionRng;             // random stream of each session
+    vector< vector<float> >     origins;                // first observation of the current gesture of each session [S x D]
+    vector<char>                originSet;              // the current gesture of a session has started (one byte per session: written concurrently)
+    vector< vector<float> >     translatedObservations; // observation of each session relative to its origin [S x D]
+    vector<float>               estimateSums;           // weighted sums of the state of each session [S x G x K]
+    vector<GVFOutcomes>         sessionOutcomes;
+
+    // sessions of the running sweep
+    const vector<int>               *sweepSessions;
+    const vector< vector<float> >   *sweepObservations;
+
+#pragma mark - Private methods
+    void updateSession(int session, const vector<float> & observation);
+    void sweepChunk(int chunk);
+    static void sweepTask(void * bank, int chunk);
+
+};
+
+#endif
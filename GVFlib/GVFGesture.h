@@ -9,6 +9,9 @@
 #ifndef GVFGesture_h
 #define GVFGesture_h
 
+#include <vector>
+#include <algorithm>
+
 #ifndef MAX
 #define MAX(a,b) (((a) > (b)) ? (a) : (b))
 #endif
@@ -25,6 +28,7 @@ public:
     GVFGesture()
     {
         inputDimensions = 2;
+        historyLength = 0;
         setAutoAdjustRanges(true);
         templatesRaw    = vector<vector<vector<float > > >();
         templatesNormal = vector<vector<vector<float > > >();
@@ -33,6 +37,7 @@ public:
     
     GVFGesture(int inputDimension){
         inputDimensions = inputDimension;
+        historyLength = 0;
         setAutoAdjustRanges(true);
         templatesRaw    = vector<vector<vector<float > > >();
         templatesNormal = vector<vector<vector<float > > >();
@@ -43,6 +48,12 @@ public:
         clear();
     }
     
+    // copies are deep, moves hand the frames over (the vocabulary grows without copying the templates)
+    GVFGesture(const GVFGesture &) = default;
+    GVFGesture(GVFGesture &&) = default;
+    GVFGesture & operator=(const GVFGesture &) = default;
+    GVFGesture & operator=(GVFGesture &&) = default;
+    
     void setNumberDimensions(int dimensions){
         assert(dimensions > 0);
         inputDimensions = dimensions;
@@ -84,13 +95,13 @@ public:
     void setMaxRange(vector<float> observationRangeMax){
         this->observationRangeMax = observationRangeMax;
         //        bIsRangeMaxSet = true;
-        normalise();
+        bRangeChanged = true;       // normalised on next read
     }
     
     void setMinRange(vector<float> observationRangeMin){
         this->observationRangeMin = observationRangeMin;
         //        bIsRangeMinSet = true;
-        normalise();
+        bRangeChanged = true;       // normalised on next read
     }
     
     vector<float>& getMaxRange(){
@@ -107,78 +118,196 @@ public:
             observationRangeMin.assign(inputDimensions,  INFINITY);
         }
         for(int i = 0; i < inputDimensions; i++){
+            if (observation[i] > observationRangeMax[i] || observation[i] < observationRangeMin[i])
+                bRangeChanged = true;
             observationRangeMax[i] = MAX(observationRangeMax[i], observation[i]);
             observationRangeMin[i] = MIN(observationRangeMin[i], observation[i]);
         }
     }
     
-    void addObservation(vector<float> observation, int templateIndex = 0){
+    void addObservation(const vector<float> & observation, int templateIndex = 0){
         if (observation.size() != inputDimensions)
             inputDimensions = observation.size();
         
         // check we have a valid templateIndex and correct number of input dimensions
-        assert(templateIndex <= templatesRaw.size());
+        assert(templateIndex <= numberTemplates);
         assert(observation.size() == inputDimensions);
         
         // if the template index is same as the number of temlates make a new template
-        if(templateIndex == templatesRaw.size()){ // make a new template
+        if(templateIndex == numberTemplates){ // make a new template
             
-            // reserve space in raw and normal template storage
-            templatesRaw.resize(templatesRaw.size() + 1);
-            templatesNormal.resize(templatesNormal.size() + 1);
+            // reserve space in raw and normal template storage (unless kept by clear())
+            if (numberTemplates == (int)templatesRaw.size())
+            {
+                templatesRaw.resize(templatesRaw.size() + 1);
+                templatesNormal.resize(templatesNormal.size() + 1);
+                templatesPacked.resize(templatesPacked.size() + 1);
+                ringHeads.resize(ringHeads.size() + 1, 0);
+                templateLengths.resize(templateLengths.size() + 1, 0);
+            }
+            numberTemplates++;
             
         }
         
-        if(templatesRaw[templateIndex].size() == 0)
+        if(templateLengths[templateIndex] == 0)
         {
             templateInitialObservation = observation;
             templateInitialNormal = observation;
         }
         
+        translatedObservation.resize(observation.size());
         for(int j = 0; j < observation.size(); j++)
-            observation[j] = observation[j] - templateInitialObservation[j];
+            translatedObservation[j] = observation[j] - templateInitialObservation[j];
         
-        // store the raw observation
-        templatesRaw[templateIndex].push_back(observation);
+        autoAdjustMinMax(translatedObservation);
         
-        autoAdjustMinMax(observation);
+        vector< vector<float> > & frames = templatesRaw[templateIndex];
+        int frameStride = getFrameStride();
+        vector<float> & packed = templatesPacked[templateIndex];
+        int length = templateLengths[templateIndex];
         
-        normalise();
+        if (historyLength > 0 && length >= historyLength)
+        {
+            // bounded history: overwrite the oldest frame in place
+            int position = ringHeads[templateIndex];
+            frames[position] = translatedObservation;
+            std::copy(translatedObservation.begin(), translatedObservation.end(), packed.begin() + position * frameStride);
+            vector< vector<float> > & normal = templatesNormal[templateIndex];
+            if (!bRangeChanged && position < (int)normal.size())
+                for(int d = 0; d < inputDimensions; d++)
+                    normal[position][d] = translatedObservation[d] / (observationRangeMax[d] - observationRangeMin[d]);
+            ringHeads[templateIndex] = (position + 1) % length;
+            return;
+        }
+        
+        // store the raw observation, in a frame kept by clear() if there is one (same size: no allocation)
+        if (length < (int)frames.size())
+            frames[length] = translatedObservation;
+        else
+            frames.push_back(translatedObservation);
+        templateLengths[templateIndex] = ++length;
+        
+        // and append it to the packed frames
+        if ((int)packed.size() != (length - 1) * frameStride)
+            pack(templateIndex);
+        else
+        {
+            packed.resize(packed.size() + frameStride, 0.0f);
+            std::copy(translatedObservation.begin(), translatedObservation.end(), packed.end() - frameStride);
+        }
+        
+        // normalised frames are computed lazily, see normalise()
     }
     
+    /**
+     * Bound the number of frames kept for each template
+     * @details once a template holds historyLength frames, every new observation overwrites the oldest
+     * one (a ring buffer). The storage of the ring is allocated here, historyLength frames of the
+     * current input dimension for every template (and for a first template if there is none yet), so
+     * that recording then costs O(1) and does not allocate, from the first frame on. Frames are stored
+     * in ring order: getFrame() and getLastObservation() give them in chronological order. The frames
+     * already recorded are kept (the latest ones if there are more than historyLength), and so is the
+     * origin used to translate the observations.
+     * @param historyLength maximum number of frames, 0 for no bound (default)
+     */
+    void setHistoryLength(int _historyLength){
+        historyLength = MAX(_historyLength, 0);
+        if (historyLength > 0 && templatesRaw.empty())
+        {
+            // storage of the first template, kept spare until it is recorded (see clear)
+            templatesRaw.resize(1);
+            templatesNormal.resize(1);
+            templatesPacked.resize(1);
+            ringHeads.resize(1, 0);
+            templateLengths.resize(1, 0);
+        }
+        for(int t = 0; t < (int)templatesRaw.size(); t++)
+        {
+            vector< vector<float> > & frames = templatesRaw[t];
+            int length = (t < numberTemplates) ? templateLengths[t] : 0;
+            bool tooLong = (historyLength > 0 && length > historyLength);
+            if (ringHeads[t] != 0 || tooLong)
+            {
+                // chronological order, the oldest frames moved past the end when they are dropped
+                std::rotate(frames.begin(), frames.begin() + ringHeads[t], frames.begin() + length);
+                ringHeads[t] = 0;
+                if (tooLong)
+                {
+                    std::rotate(frames.begin(), frames.begin() + (length - historyLength), frames.begin() + length);
+                    templateLengths[t] = historyLength;
+                }
+                pack(t);
+                templatesNormal[t].clear();
+            }
+            if (historyLength > 0)
+            {
+                if ((int)frames.size() < historyLength)
+                    frames.resize(historyLength);
+                for(int o = templateLengths[t]; o < historyLength; o++)
+                    frames[o].resize(inputDimensions);
+                templatesPacked[t].reserve(historyLength * getFrameStride());
+            }
+        }
+    }
     
+    int getHistoryLength(){
+        return historyLength;
+    }
     
+    /**
+     * Bring the normalised templates up to date with the raw templates
+     * @details only the frames added since the last call are normalised, unless the range has changed
+     * in between (observations widening it, or setMinRange/setMaxRange) in which case every frame is.
+     * Recording therefore costs O(1) per frame and the normalised templates are computed on first read.
+     */
     void normalise()
     {
+        if ((int)observationRangeMax.size() < inputDimensions || (int)observationRangeMin.size() < inputDimensions)
+            return;
         templatesNormal.resize(templatesRaw.size());
-        for(int t = 0; t < templatesRaw.size(); t++)
+        if (bRangeChanged)
+        {
+            for(int t = 0; t < (int)templatesNormal.size(); t++)
+                templatesNormal[t].clear();
+            bRangeChanged = false;
+        }
+        templateInitialNormal.resize(templateInitialObservation.size());
+        for(int d = 0; d < (int)templateInitialObservation.size() && d < inputDimensions; d++)
+            templateInitialNormal[d] = templateInitialObservation[d] / (observationRangeMax[d] - observationRangeMin[d]);
+        for(int t = 0; t < numberTemplates; t++)
         {
-            templatesNormal[t].resize(templatesRaw[t].size());
-            for(int o = 0; o < templatesRaw[t].size(); o++)
+            int o = templatesNormal[t].size();
+            templatesNormal[t].resize(templateLengths[t]);
+            for(; o < templateLengths[t]; o++)
             {
                 templatesNormal[t][o].resize(inputDimensions);
                 for(int d = 0; d < inputDimensions; d++)
-                {
                     templatesNormal[t][o][d] = templatesRaw[t][o][d] / (observationRangeMax[d] - observationRangeMin[d]);
-                    templateInitialNormal[d] = templateInitialObservation[d] / (observationRangeMax[d] - observationRangeMin[d]);
-                }
             }
         }
     }
     
+    vector< vector<float> > & getNormalisedTemplate(int templateIndex = 0){
+        normalise();
+        assert(templateIndex < numberTemplates);
+        return templatesNormal[templateIndex];
+    }
+    
     void setTemplate(vector< vector<float> > & observations, int templateIndex = 0){
         for(int i = 0; i < observations.size(); i++){
             addObservation(observations[i], templateIndex);
         }
     }
     
+    // (releases the frames kept by clear() for reuse)
     vector< vector<float> > & getTemplate(int templateIndex = 0){
-        assert(templateIndex < templatesRaw.size());
+        assert(templateIndex < numberTemplates);
+        templatesRaw[templateIndex].resize(templateLengths[templateIndex]);
         return templatesRaw[templateIndex];
     }
     
     int getNumberOfTemplates(){
-        return templatesRaw.size();
+        return numberTemplates;
     }
     
     int getNumberDimensions(){
@@ -186,7 +315,7 @@ public:
     }
     
     int getTemplateLength(int templateIndex = 0){
-        return templatesRaw[templateIndex].size();
+        return templateLengths[templateIndex];
     }
     
     int getTemplateDimension(int templateIndex = 0){
@@ -194,36 +323,92 @@ public:
     }
     
     vector<float>& getLastObservation(int templateIndex = 0){
-        return templatesRaw[templateIndex][templatesRaw[templateIndex].size() - 1];
+        return getFrame(getTemplateLength(templateIndex) - 1, templateIndex);
     }
     
+    /**
+     * Frame i of a template in chronological order (differs from getTemplate()[i] once a bounded history wraps around)
+     */
+    vector<float>& getFrame(int i, int templateIndex = 0){
+        return templatesRaw[templateIndex][(ringHeads[templateIndex] + i) % templateLengths[templateIndex]];
+    }
+    
+    // (releases the storage kept by clear() for reuse)
     vector< vector< vector<float> > >& getTemplates(){
+        templatesRaw.resize(numberTemplates);
+        for(int t = 0; t < numberTemplates; t++)
+            templatesRaw[t].resize(templateLengths[t]);
         return templatesRaw;
     }
     
+    /**
+     * Packed raw frames of a template
+     * @details the frames are stored one after the other in a contiguous buffer, each frame taking
+     * getFrameStride() floats (the dimensions padded with zeros), frame i starting at i * getFrameStride()
+     * (in ring order if the history is bounded, see setHistoryLength)
+     */
+    const float * getFrames(int templateIndex = 0){
+        assert(templateIndex < numberTemplates);
+        return templatesPacked[templateIndex].data();
+    }
+    
+    /**
+     * Distance in floats between two packed frames: the input dimension, rounded up to a multiple of 4
+     * above 2 dimensions so that frames do not straddle 16-byte boundaries
+     */
+    int getFrameStride(){
+        return (inputDimensions <= 2) ? inputDimensions : (inputDimensions + 3) & ~3;
+    }
+    
     vector<float>& getInitialObservation(){
         return templateInitialObservation;
     }
     
     void deleteTemplate(int templateIndex = 0)
     {
-        assert(templateIndex < templatesRaw.size());
+        assert(templateIndex < numberTemplates);
         templatesRaw[templateIndex].clear();
         templatesNormal[templateIndex].clear();
+        templatesPacked[templateIndex].clear();
+        ringHeads[templateIndex] = 0;
+        templateLengths[templateIndex] = 0;
     }
     
+    /**
+     * Remove every template
+     * @details the raw and packed frames are kept and overwritten by the next observations, so that
+     * recording a gesture again (e.g. the live gesture after GVF::startGesture()) does not allocate
+     */
     void clear()
     {
-        templatesRaw.clear();
-        templatesNormal.clear();
+        numberTemplates = 0;
+        for(int t = 0; t < (int)templatesRaw.size(); t++)
+        {
+            templatesNormal[t].clear();
+            templatesPacked[t].clear();
+            ringHeads[t] = 0;
+            templateLengths[t] = 0;
+        }
         observationRangeMax.assign(inputDimensions, -INFINITY);
         observationRangeMin.assign(inputDimensions,  INFINITY);
+        bRangeChanged = true;
     }
     
 private:
     
+    // rebuild the packed frames of a template from the raw frames
+    void pack(int templateIndex){
+        int frameStride = getFrameStride();
+        vector< vector<float> > & frames = templatesRaw[templateIndex];
+        vector<float> & packed = templatesPacked[templateIndex];
+        packed.assign(templateLengths[templateIndex] * frameStride, 0.0f);
+        for (int o = 0; o < templateLengths[templateIndex]; o++)
+            std::copy(frames[o].begin(), frames[o].end(), packed.begin() + o * frameStride);
+    }
+    
     int inputDimensions;
     bool bAutoAdjustNormalRange;
+    bool bRangeChanged;         // the normalised templates must be recomputed entirely
     
     vector<float> observationRangeMax;
     vector<float> observationRangeMin;
@@ -231,8 +416,15 @@ private:
     vector<float> templateInitialObservation;
     vector<float> templateInitialNormal;
     
+    int numberTemplates;
+    vector<int> templateLengths;    // frames of each template, templatesRaw may hold more for reuse (see clear)
     vector< vector< vector<float> > > templatesRaw;
     vector< vector< vector<float> > > templatesNormal;
+    vector< vector<float> > templatesPacked;    // raw frames of each template, packed (see getFrames)
+    
+    int historyLength;          // maximum number of frames per template, 0 if unbounded
+    vector<int> ringHeads;      // position of the oldest frame of each template once its history wraps around
+    vector<float> translatedObservation;
     
     vector<vector<float> > gestureDataFromFile;
 };
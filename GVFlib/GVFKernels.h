@@ -0,0 +1,683 @@
+/**
+ * Batched kernels used by the Gesture Variation Follower
+ *
+ * @details The likelihood of a block of particles is evaluated in one call: the template frame of each
+ * particle is gathered from the packed vocabulary (one load per dimension, a hardware gather on SIMD
+ * units), scaled, rotated, compared to the observation with a weighted euclidean distance
+ * and turned into a likelihood. Rotations are applied through per-particle rotation terms (cos and sin in 2-d,
+ * the rotation matrix in 3-d) that are only recomputed when the rotation angles change. On x86 the kernel is selected at runtime between an AVX-512 version
+ * (16 particles per instruction), an AVX2/FMA version (8 particles per instruction) and the scalar
+ * fallback, which is also the one used on every other architecture. The likelihood kernels are instantiated
+ * for 2-d and 3-d inputs, with the dimension known at compile time, and for any dimension (see GVFKernel).
+ *
+ * Copyright (C) 2015 Baptiste Caramiaux, Nicola Montecchio
+ * STMS lab Ircam-CRNS-UPMC, University of Padova, Goldsmiths College University of London
+ *
+ * The library is under the GNU Lesser General Public License (LGPL v3)
+ */
+
+#ifndef _H_GVFKERNELS
+#define _H_GVFKERNELS
+
+#include <math.h>
+#include <stddef.h>
+
+// define GVF_DISABLE_SIMD to only build the scalar kernels
+#if !defined(GVF_DISABLE_SIMD) && (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define GVF_X86_KERNELS
+#include <immintrin.h>
+#define GVF_TARGET_AVX2     __attribute__((target("avx2,fma")))
+#define GVF_TARGET_AVX512   __attribute__((target("avx512f")))
+#endif
+
+/**
+ * Inputs and output of the batched likelihood kernel
+ * @details every per-particle array is a set of columns separated by 'stride' floats,
+ * i.e. the value of dimension d for particle n is at [d * stride + n]
+ */
+typedef struct
+{
+    int             dimensions;     /**< input dimension [D] */
+    int             rotationsDim;   /**< 1 for 2-d inputs, 3 for 3-d inputs, 0 otherwise or when every rotation is the identity */
+    int             stride;         /**< distance between two columns */
+    const float*    vocabulary;     /**< template frames of every gesture, packed frame after frame */
+    const int*      frameIndices;   /**< position in the vocabulary of the template frame of each particle [ns] */
+    const float*    scalings;       /**< scalings of each particle [D x stride] */
+    const float*    rotationTerms;  /**< rotation terms of each particle [R x stride], see gvfRotationTermsDim, unused if rotationsDim is 0 */
+    const float*    offsets;        /**< translation offsets of each particle [D x stride], NULL if not translated */
+    const float*    observation;    /**< current observation [D] */
+    const float*    dimWeights;     /**< weights of each dimension in the distance [D] */
+    float           tolerance;      /**< tolerance of the gaussian distribution */
+    float           distribution;   /**< 0 for a gaussian distribution, otherwise the degrees of freedom of a Student's distribution */
+    bool            logDomain;      /**< output log-likelihoods instead of likelihoods */
+    float*          likelihood;     /**< likelihood (or log-likelihood) of each particle [ns] (output) */
+} GVFLikelihoodBatch;
+
+typedef void (*GVFLikelihoodKernel)(const GVFLikelihoodBatch & batch, int begin, int end);
+typedef float (*GVFExpSumKernel)(const float * x, float shift, float * out, int begin, int end);
+typedef void (*GVFRotationKernel)(const float * rotations, float * terms, int rotationsDim, int stride, int begin, int end);
+
+//--------------------------------------------------------------
+// number of rotation terms cached per particle: cos and sin of the angle in 2-d,
+// the row-major rotation matrix in 3-d
+inline int gvfRotationTermsDim(int rotationsDim)
+{
+    return (rotationsDim == 1) ? 2 : (rotationsDim == 3) ? 9 : 0;
+}
+
+//--------------------------------------------------------------
+// compute the rotation terms of the particles in [begin, end) from their angles
+inline void gvfRotationTermsScalar(const float * rotations, float * terms, int rotationsDim, int stride, int begin, int end)
+{
+    const int S = stride;
+    for (int n = begin; n < end; n++)
+    {
+        if (rotationsDim == 1)
+        {
+            terms[n]     = cos(rotations[n]);
+            terms[S + n] = sin(rotations[n]);
+        }
+        else if (rotationsDim == 3)
+        {
+            float phi = rotations[n], theta = rotations[S + n], psi = rotations[2 * S + n];
+            float cf = cos(phi), sf = sin(phi), ct = cos(theta), st = sin(theta), cp = cos(psi), sp = sin(psi);
+            terms[n]         = ct*cp;  terms[S + n]     = -cf*sp + sf*st*cp;  terms[2 * S + n] =  sf*sp + cf*st*cp;
+            terms[3 * S + n] = ct*sp;  terms[4 * S + n] =  cf*cp + sf*st*sp;  terms[5 * S + n] = -sf*cp + cf*st*sp;
+            terms[6 * S + n] = -st;    terms[7 * S + n] =  sf*ct;             terms[8 * S + n] =  cf*ct;
+        }
+    }
+}
+
+//--------------------------------------------------------------
+// convert a weighted squared distance into a likelihood
+inline float gvfDistanceToLikelihood(float dist, float tolerance, float distribution)
+{
+    if (distribution == 0.0f)   // Gaussian distribution
+        return exp(- dist * 1 / (tolerance * tolerance));
+    else                        // Student's distribution
+        return pow(dist / distribution + 1, -distribution / 2 - 1);
+}
+
+//--------------------------------------------------------------
+// convert a weighted squared distance into a log-likelihood
+inline float gvfDistanceToLogLikelihood(float dist, float tolerance, float distribution)
+{
+    if (distribution == 0.0f)   // Gaussian distribution
+        return - dist * 1 / (tolerance * tolerance);
+    else                        // Student's distribution
+        return (-distribution / 2 - 1) * log(dist / distribution + 1);
+}
+
+//--------------------------------------------------------------
+// out[n] = exp(x[n] - shift) for n in [begin, end), returns the sum of the outputs
+// with shift = max(x) this is the stable part of a log-sum-exp
+inline float gvfExpSumScalar(const float * x, float shift, float * out, int begin, int end)
+{
+    float sum = 0.0f;
+    for (int n = begin; n < end; n++)
+    {
+        out[n] = exp(x[n] - shift);
+        sum += out[n];
+    }
+    return sum;
+}
+
+//--------------------------------------------------------------
+// Scalar kernel: reference implementation, used for block tails and when no SIMD unit is available
+// (DIM is the input dimension when it is known at compile time, see GVFKernel)
+template <int DIM>
+inline void gvfLikelihoodScalar(const GVFLikelihoodBatch & b, int begin, int end)
+{
+    const int D = DIM ? DIM : b.dimensions;
+    const int S = b.stride;
+    const bool rotate = (b.rotationsDim == 1 || b.rotationsDim == 3);
+    const bool planar = (DIM == 2) || (DIM == 0 && b.rotationsDim == 1);
+
+    for (int n = begin; n < end; n++)
+    {
+        float vref[3];
+        float dist = 0.0f;
+
+        if (rotate)
+        {
+            for (int d = 0; d < D; d++)
+                vref[d] = b.vocabulary[b.frameIndices[n] + d] * b.scalings[d * S + n];
+
+            const float * m = b.rotationTerms + n;
+            if (planar)
+            {
+                float c = m[0], s = m[S];
+                float tmp0 = vref[0], tmp1 = vref[1];
+                vref[0] = c * tmp0 - s * tmp1;
+                vref[1] = s * tmp0 + c * tmp1;
+            }
+            else
+            {
+                float tmp0 = vref[0], tmp1 = vref[1], tmp2 = vref[2];
+                vref[0] = m[0]     * tmp0 + m[S]     * tmp1 + m[2 * S] * tmp2;
+                vref[1] = m[3 * S] * tmp0 + m[4 * S] * tmp1 + m[5 * S] * tmp2;
+                vref[2] = m[6 * S] * tmp0 + m[7 * S] * tmp1 + m[8 * S] * tmp2;
+            }
+
+            for (int d = 0; d < D; d++)
+            {
+                float vobs = b.observation[d] - (b.offsets ? b.offsets[d * S + n] : 0.0f);
+                float diff = vref[d] - vobs;
+                dist += b.dimWeights[d] * diff * diff;
+            }
+        }
+        else
+        {
+            for (int d = 0; d < D; d++)
+            {
+                float vobs = b.observation[d] - (b.offsets ? b.offsets[d * S + n] : 0.0f);
+                float diff = b.vocabulary[b.frameIndices[n] + d] * b.scalings[d * S + n] - vobs;
+                dist += b.dimWeights[d] * diff * diff;
+            }
+        }
+
+        b.likelihood[n] = b.logDomain ? gvfDistanceToLogLikelihood(dist, b.tolerance, b.distribution)
+                                    : gvfDistanceToLikelihood(dist, b.tolerance, b.distribution);
+    }
+}
+
+#ifdef GVF_X86_KERNELS
+
+#pragma mark - AVX2
+
+//--------------------------------------------------------------
+// exp for 8 floats (cephes polynomial), flushes to zero where expf underflows
+GVF_TARGET_AVX2 static inline __m256 gvfExp8(__m256 x)
+{
+    const __m256 lo = _mm256_set1_ps(-87.3365447f);
+    __m256 underflow = _mm256_cmp_ps(x, lo, _CMP_LT_OQ);
+    x = _mm256_max_ps(_mm256_min_ps(x, _mm256_set1_ps(88.3762626f)), lo);
+
+    __m256 fx = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(1.44269504088896341f)),
+                                _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    x = _mm256_fnmadd_ps(fx, _mm256_set1_ps(0.693359375f), x);
+    x = _mm256_fnmadd_ps(fx, _mm256_set1_ps(-2.12194440e-4f), x);
+
+    __m256 y = _mm256_set1_ps(1.9875691500e-4f);
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(1.3981999507e-3f));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(8.3334519073e-3f));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(4.1665795894e-2f));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(1.6666665459e-1f));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(5.0000001201e-1f));
+    y = _mm256_fmadd_ps(y, _mm256_mul_ps(x, x), _mm256_add_ps(x, _mm256_set1_ps(1.0f)));
+
+    __m256i e = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(fx), _mm256_set1_epi32(127)), 23);
+    return _mm256_andnot_ps(underflow, _mm256_mul_ps(y, _mm256_castsi256_ps(e)));
+}
+
+//--------------------------------------------------------------
+// natural logarithm of 8 positive floats (cephes polynomial)
+GVF_TARGET_AVX2 static inline __m256 gvfLog8(__m256 x)
+{
+    x = _mm256_max_ps(x, _mm256_castsi256_ps(_mm256_set1_epi32(0x00800000)));   // smallest normalized float
+    __m256i exponent = _mm256_srli_epi32(_mm256_castps_si256(x), 23);
+    x = _mm256_and_ps(x, _mm256_castsi256_ps(_mm256_set1_epi32(~0x7f800000)));
+    x = _mm256_or_ps(x, _mm256_set1_ps(0.5f));
+    __m256 e = _mm256_add_ps(_mm256_cvtepi32_ps(_mm256_sub_epi32(exponent, _mm256_set1_epi32(127))), _mm256_set1_ps(1.0f));
+
+    __m256 mask = _mm256_cmp_ps(x, _mm256_set1_ps(0.707106781186547524f), _CMP_LT_OQ);
+    __m256 tmp = _mm256_and_ps(x, mask);
+    x = _mm256_sub_ps(x, _mm256_set1_ps(1.0f));
+    e = _mm256_sub_ps(e, _mm256_and_ps(_mm256_set1_ps(1.0f), mask));
+    x = _mm256_add_ps(x, tmp);
+    __m256 z = _mm256_mul_ps(x, x);
+
+    __m256 y = _mm256_set1_ps(7.0376836292e-2f);
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(-1.1514610310e-1f));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(1.1676998740e-1f));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(-1.2420140846e-1f));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(1.4249322787e-1f));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(-1.6668057665e-1f));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(2.0000714765e-1f));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(-2.4999993993e-1f));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(3.3333331174e-1f));
+    y = _mm256_mul_ps(_mm256_mul_ps(y, x), z);
+    y = _mm256_fmadd_ps(e, _mm256_set1_ps(-2.12194440e-4f), y);
+    y = _mm256_fnmadd_ps(_mm256_set1_ps(0.5f), z, y);
+    x = _mm256_add_ps(x, y);
+    return _mm256_fmadd_ps(e, _mm256_set1_ps(0.693359375f), x);
+}
+
+//--------------------------------------------------------------
+// sin and cos of 8 floats (cephes polynomials with octant range reduction)
+GVF_TARGET_AVX2 static inline void gvfSinCos8(__m256 x, __m256 & s, __m256 & c)
+{
+    const __m256 signMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x80000000));
+    __m256 signSin = _mm256_and_ps(x, signMask);
+    x = _mm256_andnot_ps(signMask, x);
+
+    __m256i j = _mm256_cvttps_epi32(_mm256_mul_ps(x, _mm256_set1_ps(1.27323954473516f)));  // 4/pi
+    j = _mm256_and_si256(_mm256_add_epi32(j, _mm256_set1_epi32(1)), _mm256_set1_epi32(~1));
+    __m256 y = _mm256_cvtepi32_ps(j);
+
+    __m256 swapSignSin = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_and_si256(j, _mm256_set1_epi32(4)), 29));
+    __m256 polyMask = _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(j, _mm256_set1_epi32(2)), _mm256_setzero_si256()));
+    __m256 signCos = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_andnot_si256(_mm256_sub_epi32(j, _mm256_set1_epi32(2)),
+                                                                               _mm256_set1_epi32(4)), 29));
+    signSin = _mm256_xor_ps(signSin, swapSignSin);
+
+    x = _mm256_fmadd_ps(y, _mm256_set1_ps(-0.78515625f), x);
+    x = _mm256_fmadd_ps(y, _mm256_set1_ps(-2.4187564849853515625e-4f), x);
+    x = _mm256_fmadd_ps(y, _mm256_set1_ps(-3.77489497744594108e-8f), x);
+    __m256 z = _mm256_mul_ps(x, x);
+
+    __m256 yc = _mm256_set1_ps(2.443315711809948e-5f);
+    yc = _mm256_fmadd_ps(yc, z, _mm256_set1_ps(-1.388731625493765e-3f));
+    yc = _mm256_fmadd_ps(yc, z, _mm256_set1_ps(4.166664568298827e-2f));
+    yc = _mm256_mul_ps(_mm256_mul_ps(yc, z), z);
+    yc = _mm256_fnmadd_ps(_mm256_set1_ps(0.5f), z, yc);
+    yc = _mm256_add_ps(yc, _mm256_set1_ps(1.0f));
+
+    __m256 ys = _mm256_set1_ps(-1.9515295891e-4f);
+    ys = _mm256_fmadd_ps(ys, z, _mm256_set1_ps(8.3321608736e-3f));
+    ys = _mm256_fmadd_ps(ys, z, _mm256_set1_ps(-1.6666654611e-1f));
+    ys = _mm256_fmadd_ps(_mm256_mul_ps(ys, z), x, x);
+
+    s = _mm256_xor_ps(_mm256_blendv_ps(yc, ys, polyMask), signSin);
+    c = _mm256_xor_ps(_mm256_blendv_ps(ys, yc, polyMask), signCos);
+}
+
+//--------------------------------------------------------------
+GVF_TARGET_AVX2 inline float gvfExpSumAVX2(const float * x, float shift, float * out, int begin, int end)
+{
+    const __m256 vshift = _mm256_set1_ps(shift);
+    __m256 acc = _mm256_setzero_ps();
+    int n = begin;
+    for (; n + 8 <= end; n += 8)
+    {
+        __m256 e = gvfExp8(_mm256_sub_ps(_mm256_loadu_ps(x + n), vshift));
+        _mm256_storeu_ps(out + n, e);
+        acc = _mm256_add_ps(acc, e);
+    }
+    float tmp[8];
+    _mm256_storeu_ps(tmp, acc);
+    float sum = tmp[0] + tmp[1] + tmp[2] + tmp[3] + tmp[4] + tmp[5] + tmp[6] + tmp[7];
+    return sum + gvfExpSumScalar(x, shift, out, n, end);
+}
+
+//--------------------------------------------------------------
+GVF_TARGET_AVX2 inline void gvfRotationTermsAVX2(const float * rotations, float * terms, int rotationsDim, int stride, int begin, int end)
+{
+    const int S = stride;
+    int n = begin;
+    for (; n + 8 <= end; n += 8)
+    {
+        if (rotationsDim == 1)
+        {
+            __m256 s, c;
+            gvfSinCos8(_mm256_loadu_ps(rotations + n), s, c);
+            _mm256_storeu_ps(terms + n, c);
+            _mm256_storeu_ps(terms + S + n, s);
+        }
+        else if (rotationsDim == 3)
+        {
+            __m256 sf, cf, st, ct, sp, cp;
+            gvfSinCos8(_mm256_loadu_ps(rotations + n), sf, cf);
+            gvfSinCos8(_mm256_loadu_ps(rotations + S + n), st, ct);
+            gvfSinCos8(_mm256_loadu_ps(rotations + 2 * S + n), sp, cp);
+            __m256 sfst = _mm256_mul_ps(sf, st), cfst = _mm256_mul_ps(cf, st);
+            _mm256_storeu_ps(terms + n,         _mm256_mul_ps(ct, cp));
+            _mm256_storeu_ps(terms + S + n,     _mm256_fmsub_ps(sfst, cp, _mm256_mul_ps(cf, sp)));
+            _mm256_storeu_ps(terms + 2 * S + n, _mm256_fmadd_ps(cfst, cp, _mm256_mul_ps(sf, sp)));
+            _mm256_storeu_ps(terms + 3 * S + n, _mm256_mul_ps(ct, sp));
+            _mm256_storeu_ps(terms + 4 * S + n, _mm256_fmadd_ps(sfst, sp, _mm256_mul_ps(cf, cp)));
+            _mm256_storeu_ps(terms + 5 * S + n, _mm256_fmsub_ps(cfst, sp, _mm256_mul_ps(sf, cp)));
+            _mm256_storeu_ps(terms + 6 * S + n, _mm256_sub_ps(_mm256_setzero_ps(), st));
+            _mm256_storeu_ps(terms + 7 * S + n, _mm256_mul_ps(sf, ct));
+            _mm256_storeu_ps(terms + 8 * S + n, _mm256_mul_ps(cf, ct));
+        }
+    }
+    gvfRotationTermsScalar(rotations, terms, rotationsDim, stride, n, end);
+}
+
+//--------------------------------------------------------------
+template <int DIM>
+GVF_TARGET_AVX2 inline void gvfLikelihoodAVX2(const GVFLikelihoodBatch & b, int begin, int end)
+{
+    const int D = DIM ? DIM : b.dimensions;
+    const int S = b.stride;
+    const bool rotate = (b.rotationsDim == 1 || b.rotationsDim == 3);
+    const bool planar = (DIM == 2) || (DIM == 0 && b.rotationsDim == 1);
+    const __m256 negInvTol2 = _mm256_set1_ps(-1.0f / (b.tolerance * b.tolerance));
+
+    int n = begin;
+    for (; n + 8 <= end; n += 8)
+    {
+        __m256 dist = _mm256_setzero_ps();
+        __m256i frame = _mm256_loadu_si256((const __m256i *)(b.frameIndices + n));
+
+        if (rotate)
+        {
+            __m256 vref[3];
+            for (int d = 0; d < D; d++)
+                vref[d] = _mm256_mul_ps(_mm256_i32gather_ps(b.vocabulary + d, frame, 4), _mm256_loadu_ps(b.scalings + d * S + n));
+
+            const float * m = b.rotationTerms + n;
+            if (planar)
+            {
+                __m256 c = _mm256_loadu_ps(m), s = _mm256_loadu_ps(m + S);
+                __m256 tmp0 = vref[0], tmp1 = vref[1];
+                vref[0] = _mm256_fmsub_ps(c, tmp0, _mm256_mul_ps(s, tmp1));
+                vref[1] = _mm256_fmadd_ps(s, tmp0, _mm256_mul_ps(c, tmp1));
+            }
+            else
+            {
+                __m256 tmp0 = vref[0], tmp1 = vref[1], tmp2 = vref[2];
+                for (int r = 0; r < 3; r++)
+                    vref[r] = _mm256_fmadd_ps(_mm256_loadu_ps(m + (3 * r) * S), tmp0,
+                              _mm256_fmadd_ps(_mm256_loadu_ps(m + (3 * r + 1) * S), tmp1,
+                                              _mm256_mul_ps(_mm256_loadu_ps(m + (3 * r + 2) * S), tmp2)));
+            }
+
+            for (int d = 0; d < D; d++)
+            {
+                __m256 vobs = _mm256_set1_ps(b.observation[d]);
+                if (b.offsets) vobs = _mm256_sub_ps(vobs, _mm256_loadu_ps(b.offsets + d * S + n));
+                __m256 diff = _mm256_sub_ps(vref[d], vobs);
+                dist = _mm256_fmadd_ps(_mm256_mul_ps(_mm256_set1_ps(b.dimWeights[d]), diff), diff, dist);
+            }
+        }
+        else
+        {
+            for (int d = 0; d < D; d++)
+            {
+                __m256 vobs = _mm256_set1_ps(b.observation[d]);
+                if (b.offsets) vobs = _mm256_sub_ps(vobs, _mm256_loadu_ps(b.offsets + d * S + n));
+                __m256 diff = _mm256_fmsub_ps(_mm256_i32gather_ps(b.vocabulary + d, frame, 4), _mm256_loadu_ps(b.scalings + d * S + n), vobs);
+                dist = _mm256_fmadd_ps(_mm256_mul_ps(_mm256_set1_ps(b.dimWeights[d]), diff), diff, dist);
+            }
+        }
+
+        if (b.distribution == 0.0f && b.logDomain)
+            _mm256_storeu_ps(b.likelihood + n, _mm256_mul_ps(dist, negInvTol2));
+        else if (b.distribution == 0.0f)
+            _mm256_storeu_ps(b.likelihood + n, gvfExp8(_mm256_mul_ps(dist, negInvTol2)));
+        else
+        {
+            float tmp[8];
+            _mm256_storeu_ps(tmp, dist);
+            for (int k = 0; k < 8; k++)
+                b.likelihood[n + k] = b.logDomain ? gvfDistanceToLogLikelihood(tmp[k], b.tolerance, b.distribution)
+                                                : gvfDistanceToLikelihood(tmp[k], b.tolerance, b.distribution);
+        }
+    }
+
+    gvfLikelihoodScalar<DIM>(b, n, end);
+}
+
+#pragma mark - AVX-512
+
+// the AVX-512 intrinsics of gcc start some of their results from an undefined register, which -Wall
+// reports as uninitialized once they are inlined here
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+//--------------------------------------------------------------
+// exp for 16 floats, see gvfExp8
+GVF_TARGET_AVX512 static inline __m512 gvfExp16(__m512 x)
+{
+    const __m512 lo = _mm512_set1_ps(-87.3365447f);
+    __mmask16 valid = _mm512_cmp_ps_mask(x, lo, _CMP_GE_OQ);
+    x = _mm512_max_ps(_mm512_min_ps(x, _mm512_set1_ps(88.3762626f)), lo);
+
+    __m512 fx = _mm512_roundscale_ps(_mm512_mul_ps(x, _mm512_set1_ps(1.44269504088896341f)),
+                                     _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    x = _mm512_fnmadd_ps(fx, _mm512_set1_ps(0.693359375f), x);
+    x = _mm512_fnmadd_ps(fx, _mm512_set1_ps(-2.12194440e-4f), x);
+
+    __m512 y = _mm512_set1_ps(1.9875691500e-4f);
+    y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(1.3981999507e-3f));
+    y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(8.3334519073e-3f));
+    y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(4.1665795894e-2f));
+    y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(1.6666665459e-1f));
+    y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(5.0000001201e-1f));
+    y = _mm512_fmadd_ps(y, _mm512_mul_ps(x, x), _mm512_add_ps(x, _mm512_set1_ps(1.0f)));
+
+    __m512i e = _mm512_slli_epi32(_mm512_add_epi32(_mm512_cvtps_epi32(fx), _mm512_set1_epi32(127)), 23);
+    return _mm512_maskz_mul_ps(valid, y, _mm512_castsi512_ps(e));
+}
+
+//--------------------------------------------------------------
+// sin and cos of 16 floats, see gvfSinCos8
+GVF_TARGET_AVX512 static inline void gvfSinCos16(__m512 x, __m512 & s, __m512 & c)
+{
+    const __m512i signMask = _mm512_set1_epi32(0x80000000);
+    __m512i xi = _mm512_castps_si512(x);
+    __m512i signSin = _mm512_and_si512(xi, signMask);
+    x = _mm512_castsi512_ps(_mm512_andnot_si512(signMask, xi));
+
+    __m512i j = _mm512_cvttps_epi32(_mm512_mul_ps(x, _mm512_set1_ps(1.27323954473516f)));  // 4/pi
+    j = _mm512_and_si512(_mm512_add_epi32(j, _mm512_set1_epi32(1)), _mm512_set1_epi32(~1));
+    __m512 y = _mm512_cvtepi32_ps(j);
+
+    __m512i swapSignSin = _mm512_slli_epi32(_mm512_and_si512(j, _mm512_set1_epi32(4)), 29);
+    __mmask16 polyMask = _mm512_testn_epi32_mask(j, _mm512_set1_epi32(2));
+    __m512i signCos = _mm512_slli_epi32(_mm512_andnot_si512(_mm512_sub_epi32(j, _mm512_set1_epi32(2)),
+                                                            _mm512_set1_epi32(4)), 29);
+    signSin = _mm512_xor_si512(signSin, swapSignSin);
+
+    x = _mm512_fmadd_ps(y, _mm512_set1_ps(-0.78515625f), x);
+    x = _mm512_fmadd_ps(y, _mm512_set1_ps(-2.4187564849853515625e-4f), x);
+    x = _mm512_fmadd_ps(y, _mm512_set1_ps(-3.77489497744594108e-8f), x);
+    __m512 z = _mm512_mul_ps(x, x);
+
+    __m512 yc = _mm512_set1_ps(2.443315711809948e-5f);
+    yc = _mm512_fmadd_ps(yc, z, _mm512_set1_ps(-1.388731625493765e-3f));
+    yc = _mm512_fmadd_ps(yc, z, _mm512_set1_ps(4.166664568298827e-2f));
+    yc = _mm512_mul_ps(_mm512_mul_ps(yc, z), z);
+    yc = _mm512_fnmadd_ps(_mm512_set1_ps(0.5f), z, yc);
+    yc = _mm512_add_ps(yc, _mm512_set1_ps(1.0f));
+
+    __m512 ys = _mm512_set1_ps(-1.9515295891e-4f);
+    ys = _mm512_fmadd_ps(ys, z, _mm512_set1_ps(8.3321608736e-3f));
+    ys = _mm512_fmadd_ps(ys, z, _mm512_set1_ps(-1.6666654611e-1f));
+    ys = _mm512_fmadd_ps(_mm512_mul_ps(ys, z), x, x);
+
+    s = _mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(_mm512_mask_blend_ps(polyMask, yc, ys)), signSin));
+    c = _mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(_mm512_mask_blend_ps(polyMask, ys, yc)), signCos));
+}
+
+//--------------------------------------------------------------
+GVF_TARGET_AVX512 inline float gvfExpSumAVX512(const float * x, float shift, float * out, int begin, int end)
+{
+    const __m512 vshift = _mm512_set1_ps(shift);
+    __m512 acc = _mm512_setzero_ps();
+    int n = begin;
+    for (; n + 16 <= end; n += 16)
+    {
+        __m512 e = gvfExp16(_mm512_sub_ps(_mm512_loadu_ps(x + n), vshift));
+        _mm512_storeu_ps(out + n, e);
+        acc = _mm512_add_ps(acc, e);
+    }
+    float sum = _mm512_reduce_add_ps(acc);
+    return sum + gvfExpSumScalar(x, shift, out, n, end);
+}
+
+//--------------------------------------------------------------
+GVF_TARGET_AVX512 inline void gvfRotationTermsAVX512(const float * rotations, float * terms, int rotationsDim, int stride, int begin, int end)
+{
+    const int S = stride;
+    int n = begin;
+    for (; n + 16 <= end; n += 16)
+    {
+        if (rotationsDim == 1)
+        {
+            __m512 s, c;
+            gvfSinCos16(_mm512_loadu_ps(rotations + n), s, c);
+            _mm512_storeu_ps(terms + n, c);
+            _mm512_storeu_ps(terms + S + n, s);
+        }
+        else if (rotationsDim == 3)
+        {
+            __m512 sf, cf, st, ct, sp, cp;
+            gvfSinCos16(_mm512_loadu_ps(rotations + n), sf, cf);
+            gvfSinCos16(_mm512_loadu_ps(rotations + S + n), st, ct);
+            gvfSinCos16(_mm512_loadu_ps(rotations + 2 * S + n), sp, cp);
+            __m512 sfst = _mm512_mul_ps(sf, st), cfst = _mm512_mul_ps(cf, st);
+            _mm512_storeu_ps(terms + n,         _mm512_mul_ps(ct, cp));
+            _mm512_storeu_ps(terms + S + n,     _mm512_fmsub_ps(sfst, cp, _mm512_mul_ps(cf, sp)));
+            _mm512_storeu_ps(terms + 2 * S + n, _mm512_fmadd_ps(cfst, cp, _mm512_mul_ps(sf, sp)));
+            _mm512_storeu_ps(terms + 3 * S + n, _mm512_mul_ps(ct, sp));
+            _mm512_storeu_ps(terms + 4 * S + n, _mm512_fmadd_ps(sfst, sp, _mm512_mul_ps(cf, cp)));
+            _mm512_storeu_ps(terms + 5 * S + n, _mm512_fmsub_ps(cfst, sp, _mm512_mul_ps(sf, cp)));
+            _mm512_storeu_ps(terms + 6 * S + n, _mm512_sub_ps(_mm512_setzero_ps(), st));
+            _mm512_storeu_ps(terms + 7 * S + n, _mm512_mul_ps(sf, ct));
+            _mm512_storeu_ps(terms + 8 * S + n, _mm512_mul_ps(cf, ct));
+        }
+    }
+    gvfRotationTermsScalar(rotations, terms, rotationsDim, stride, n, end);
+}
+
+//--------------------------------------------------------------
+template <int DIM>
+GVF_TARGET_AVX512 inline void gvfLikelihoodAVX512(const GVFLikelihoodBatch & b, int begin, int end)
+{
+    const int D = DIM ? DIM : b.dimensions;
+    const int S = b.stride;
+    const bool rotate = (b.rotationsDim == 1 || b.rotationsDim == 3);
+    const bool planar = (DIM == 2) || (DIM == 0 && b.rotationsDim == 1);
+    const __m512 negInvTol2 = _mm512_set1_ps(-1.0f / (b.tolerance * b.tolerance));
+
+    int n = begin;
+    for (; n + 16 <= end; n += 16)
+    {
+        __m512 dist = _mm512_setzero_ps();
+        __m512i frame = _mm512_loadu_si512(b.frameIndices + n);
+
+        if (rotate)
+        {
+            __m512 vref[3];
+            for (int d = 0; d < D; d++)
+                vref[d] = _mm512_mul_ps(_mm512_i32gather_ps(frame, b.vocabulary + d, 4), _mm512_loadu_ps(b.scalings + d * S + n));
+
+            const float * m = b.rotationTerms + n;
+            if (planar)
+            {
+                __m512 c = _mm512_loadu_ps(m), s = _mm512_loadu_ps(m + S);
+                __m512 tmp0 = vref[0], tmp1 = vref[1];
+                vref[0] = _mm512_fmsub_ps(c, tmp0, _mm512_mul_ps(s, tmp1));
+                vref[1] = _mm512_fmadd_ps(s, tmp0, _mm512_mul_ps(c, tmp1));
+            }
+            else
+            {
+                __m512 tmp0 = vref[0], tmp1 = vref[1], tmp2 = vref[2];
+                for (int r = 0; r < 3; r++)
+                    vref[r] = _mm512_fmadd_ps(_mm512_loadu_ps(m + (3 * r) * S), tmp0,
+                              _mm512_fmadd_ps(_mm512_loadu_ps(m + (3 * r + 1) * S), tmp1,
+                                              _mm512_mul_ps(_mm512_loadu_ps(m + (3 * r + 2) * S), tmp2)));
+            }
+
+            for (int d = 0; d < D; d++)
+            {
+                __m512 vobs = _mm512_set1_ps(b.observation[d]);
+                if (b.offsets) vobs = _mm512_sub_ps(vobs, _mm512_loadu_ps(b.offsets + d * S + n));
+                __m512 diff = _mm512_sub_ps(vref[d], vobs);
+                dist = _mm512_fmadd_ps(_mm512_mul_ps(_mm512_set1_ps(b.dimWeights[d]), diff), diff, dist);
+            }
+        }
+        else
+        {
+            for (int d = 0; d < D; d++)
+            {
+                __m512 vobs = _mm512_set1_ps(b.observation[d]);
+                if (b.offsets) vobs = _mm512_sub_ps(vobs, _mm512_loadu_ps(b.offsets + d * S + n));
+                __m512 diff = _mm512_fmsub_ps(_mm512_i32gather_ps(frame, b.vocabulary + d, 4), _mm512_loadu_ps(b.scalings + d * S + n), vobs);
+                dist = _mm512_fmadd_ps(_mm512_mul_ps(_mm512_set1_ps(b.dimWeights[d]), diff), diff, dist);
+            }
+        }
+
+        if (b.distribution == 0.0f && b.logDomain)
+            _mm512_storeu_ps(b.likelihood + n, _mm512_mul_ps(dist, negInvTol2));
+        else if (b.distribution == 0.0f)
+            _mm512_storeu_ps(b.likelihood + n, gvfExp16(_mm512_mul_ps(dist, negInvTol2)));
+        else
+        {
+            float tmp[16];
+            _mm512_storeu_ps(tmp, dist);
+            for (int k = 0; k < 16; k++)
+                b.likelihood[n + k] = b.logDomain ? gvfDistanceToLogLikelihood(tmp[k], b.tolerance, b.distribution)
+                                                : gvfDistanceToLikelihood(tmp[k], b.tolerance, b.distribution);
+        }
+    }
+
+    gvfLikelihoodScalar<DIM>(b, n, end);
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+#endif
+
+/**
+ * Likelihood kernels of an input dimension known at compile time
+ * @details GVFKernel<2> (2-d inputs, one rotation angle) and GVFKernel<3> (3-d inputs, three rotation
+ * angles) have their loops over the dimensions fully unrolled and the kind of rotation fixed;
+ * GVFKernel<0> is the generic kernel, for any dimension.
+ */
+template <int DIM>
+struct GVFKernel
+{
+    // widest likelihood kernel of the dimension supported by the running CPU
+    static GVFLikelihoodKernel likelihood()
+    {
+#ifdef GVF_X86_KERNELS
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f"))
+            return gvfLikelihoodAVX512<DIM>;
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+            return gvfLikelihoodAVX2<DIM>;
+#endif
+        return gvfLikelihoodScalar<DIM>;
+    }
+};
+
+//--------------------------------------------------------------
+// pick the likelihood kernel of an input dimension, specialised for 2-d and 3-d inputs
+inline GVFLikelihoodKernel gvfSelectLikelihoodKernel(int dimensions)
+{
+    switch (dimensions)
+    {
+        case 2:  return GVFKernel<2>::likelihood();
+        case 3:  return GVFKernel<3>::likelihood();
+        default: return GVFKernel<0>::likelihood();
+    }
+}
+
+//--------------------------------------------------------------
+// pick the widest exp-sum kernel supported by the running CPU
+inline GVFExpSumKernel gvfSelectExpSumKernel()
+{
+#ifdef GVF_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return gvfExpSumAVX512;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return gvfExpSumAVX2;
+#endif
+    return gvfExpSumScalar;
+}
+
+//--------------------------------------------------------------
+// pick the widest rotation-terms kernel supported by the running CPU
+inline GVFRotationKernel gvfSelectRotationKernel()
+{
+#ifdef GVF_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return gvfRotationTermsAVX512;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return gvfRotationTermsAVX2;
+#endif
+    return gvfRotationTermsScalar;
+}
+
+#endif
@@ -0,0 +1,214 @@
+/**
+ * Particle store used by the Gesture Variation Follower
+ *
+ * @details Structure-of-arrays storage of the particle state: every component of the state
+ * (alignment, speed, acceleration, scalings, rotations, offsets, weight) lives in its own contiguous
+ * column, and every column starts on a 64-byte boundary so that loops over the particles stream
+ * through memory and can be vectorized. The rotation terms derived from the rotation angles (see
+ * gvfRotationTermsDim) are stored as extra columns so that they follow the particles when resampling.
+ *
+ * Copyright (C) 2015 Baptiste Caramiaux, Nicola Montecchio
+ * STMS lab Ircam-CRNS-UPMC, University of Padova, Goldsmiths College University of London
+ *
+ * The library is under the GNU Lesser General Public License (LGPL v3)
+ */
+
+#ifndef _H_GVFPARTICLES
+#define _H_GVFPARTICLES
+
+#include "GVFKernels.h"
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+#include <assert.h>
+
+using namespace std;
+
+#define GVF_ALIGNMENT 64    // column alignment in bytes (one cache line, one AVX-512 register)
+
+class GVFParticles
+{
+public:
+
+    GVFParticles()
+    {
+        numberParticles = 0;
+        stride          = 0;
+        scalingsDim     = 0;
+        rotationsDim    = 0;
+        offsetsDim      = 0;
+        rotationTermsDim = 0;
+    }
+
+    GVFParticles(const GVFParticles & other)
+    {
+        *this = other;
+    }
+    
+    GVFParticles & operator=(const GVFParticles & other)
+    {
+        if (this == &other)
+            return *this;
+        resize(other.numberParticles, other.scalingsDim, other.rotationsDim, other.offsetsDim, other.stride);
+        const int numberColumns = getNumberOfColumns();
+        std::copy(other.column(0), other.column(0) + numberColumns * stride, column(0));
+        std::copy(other.classes(), other.classes() + stride, classes());
+        return *this;
+    }
+
+    /**
+     * Allocate the columns for a given number of particles and state dimensions
+     * @details every column is reset to zero
+     * @param capacity number of particles the columns can hold (at least the number of particles)
+     */
+    void resize(int _numberParticles, int _scalingsDim, int _rotationsDim, int _offsetsDim, int capacity = 0)
+    {
+        numberParticles = _numberParticles;
+        scalingsDim     = _scalingsDim;
+        rotationsDim    = _rotationsDim;
+        offsetsDim      = _offsetsDim;
+        rotationTermsDim = gvfRotationTermsDim(rotationsDim);
+
+        // pad each column to a multiple of the alignment so that every column is aligned
+        const int floatsPerLine = GVF_ALIGNMENT / sizeof(float);
+        stride = ((max(numberParticles, capacity) + floatsPerLine - 1) / floatsPerLine) * floatsPerLine;
+
+        int numberColumns = getNumberOfColumns();
+        floatStorage.assign(numberColumns * stride + floatsPerLine, 0.0f);
+        classStorage.assign(stride + floatsPerLine, 0);
+    }
+
+    /**
+     * Change the number of particles within the capacity of the columns, without allocating
+     * @details the state of the particles is kept, new particles are left as they were
+     */
+    void setSize(int _numberParticles)
+    {
+        assert(_numberParticles <= stride);
+        numberParticles = _numberParticles;
+    }
+
+    /**
+     * Copy every particle of a store of the same dimensions, keeping the capacity of this store
+     */
+    void copyParticles(const GVFParticles & source)
+    {
+        assert(source.scalingsDim == scalingsDim && source.rotationsDim == rotationsDim && source.offsetsDim == offsetsDim);
+        setSize(source.numberParticles);
+        copyRange(source, 0, numberParticles);
+    }
+
+    /**
+     * Fill this store with the particles of another store of the same shape
+     * @details particle j in [begin, end) receives the state of particle indices[j] of the source, column
+     * by column; the two stores can hold different numbers of particles
+     */
+    void gather(const GVFParticles & source, const int * indices, int begin, int end)
+    {
+        assert(source.stride == stride && end <= numberParticles);
+        const int numberColumns = getNumberOfColumns();
+        for (int c = 0; c < numberColumns; c++)
+        {
+            const float * src = source.column(c);
+            float * dst = column(c);
+            for (int j = begin; j < end; j++)
+                dst[j] = src[indices[j]];
+        }
+        const int * srcClasses = source.classes();
+        int * dstClasses = classes();
+        for (int j = begin; j < end; j++)
+            dstClasses[j] = srcClasses[indices[j]];
+    }
+
+    /**
+     * Copy the particles in [begin, end) of another store of the same shape
+     */
+    void copyRange(const GVFParticles & source, int begin, int end)
+    {
+        assert(end <= source.numberParticles && end <= numberParticles);
+        const int numberColumns = getNumberOfColumns();
+        for (int c = 0; c < numberColumns; c++)
+            std::copy(source.column(c) + begin, source.column(c) + end, column(c) + begin);
+        std::copy(source.classes() + begin, source.classes() + end, classes() + begin);
+    }
+
+    /**
+     * Exchange the contents of two stores without copying the particles
+     */
+    void swap(GVFParticles & other)
+    {
+        std::swap(numberParticles, other.numberParticles);
+        std::swap(stride, other.stride);
+        std::swap(scalingsDim, other.scalingsDim);
+        std::swap(rotationsDim, other.rotationsDim);
+        std::swap(offsetsDim, other.offsetsDim);
+        std::swap(rotationTermsDim, other.rotationTermsDim);
+        floatStorage.swap(other.floatStorage);     // the buffers move with their alignment offset
+        classStorage.swap(other.classStorage);
+    }
+
+    int size() const            { return numberParticles; }
+    int getStride() const       { return stride; }
+    int getCapacity() const     { return stride; }
+    int getScalingsDim() const  { return scalingsDim; }
+    int getRotationsDim() const { return rotationsDim; }
+    int getOffsetsDim() const   { return offsetsDim; }
+
+    // columns [ns x 1]
+    int*   classes()            { return alignedBase(classStorage); }
+    float* alignment()          { return column(0); }
+    float* speed()              { return column(1); }
+    float* accel()              { return column(2); }
+    float* weight()             { return column(3); }
+
+    // columns [ns x 1] for each dimension of the state vectors
+    float* scaling(int d)       { assert(d < scalingsDim);  return column(4 + d); }
+    float* rotation(int a)      { assert(a < rotationsDim); return column(4 + scalingsDim + a); }
+    float* offset(int d)        { assert(d < offsetsDim);   return column(4 + scalingsDim + rotationsDim + d); }
+    float* rotationTerm(int k)  { assert(k < rotationTermsDim); return column(4 + scalingsDim + rotationsDim + offsetsDim + k); }
+
+    const int*   classes() const        { return alignedBase(classStorage); }
+    const float* alignment() const      { return column(0); }
+    const float* speed() const          { return column(1); }
+    const float* accel() const          { return column(2); }
+    const float* weight() const         { return column(3); }
+    const float* scaling(int d) const   { assert(d < scalingsDim);  return column(4 + d); }
+    const float* rotation(int a) const  { assert(a < rotationsDim); return column(4 + scalingsDim + a); }
+    const float* offset(int d) const    { assert(d < offsetsDim);   return column(4 + scalingsDim + rotationsDim + d); }
+    const float* rotationTerm(int k) const { assert(k < rotationTermsDim); return column(4 + scalingsDim + rotationsDim + offsetsDim + k); }
+
+    // every float column in storage order: alignment, speed, accel, weight + state vectors + rotation terms
+    int getNumberOfColumns() const      { return 4 + scalingsDim + rotationsDim + offsetsDim + rotationTermsDim; }
+    float* column(int c)                { return alignedBase(floatStorage) + c * stride; }
+    const float* column(int c) const    { return alignedBase(floatStorage) + c * stride; }
+
+private:
+
+    // the vectors are over-allocated by one cache line and the columns start at the first aligned
+    // address, which is why copies go through the aligned bases rather than copying the vectors
+    template <typename T>
+    static T* alignedBase(vector<T> & storage)
+    {
+        uintptr_t p = reinterpret_cast<uintptr_t>(storage.data());
+        return reinterpret_cast<T*>((p + GVF_ALIGNMENT - 1) & ~(uintptr_t)(GVF_ALIGNMENT - 1));
+    }
+
+    template <typename T>
+    static const T* alignedBase(const vector<T> & storage)
+    {
+        uintptr_t p = reinterpret_cast<uintptr_t>(storage.data());
+        return reinterpret_cast<const T*>((p + GVF_ALIGNMENT - 1) & ~(uintptr_t)(GVF_ALIGNMENT - 1));
+    }
+
+    int numberParticles;    // number of particles [ns]
+    int stride;             // distance in floats between two columns (capacity rounded up to the alignment)
+    int scalingsDim;        // scalings state dimension [D]
+    int rotationsDim;       // rotations state dimension [A]
+    int offsetsDim;         // translation offsets dimension [D]
+    int rotationTermsDim;   // rotation terms cached per particle [R]
+
+    vector<float> floatStorage;
+    vector<int>   classStorage;
+};
+
+#endif
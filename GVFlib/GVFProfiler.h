@@ -0,0 +1,191 @@
+/**
+ * Per-stage timing of the Gesture Variation Follower
+ *
+ * @details Compiled in with -DGVF_PROFILING only: without it GVF_PROFILE() expands to nothing and
+ * update() carries no timing code at all. Each frame, the wall time of the sequential stages is taken
+ * with lap(), while the stages run chunk by chunk (prior, likelihood) accumulate in one slot per chunk,
+ * each slot a cache line wide, and are summed when the frame ends: on several threads they are
+ * thread time rather than wall time. The durations of the last GVF_PROFILING_WINDOW frames are kept
+ * in a ring, from which getStats() computes the percentiles.
+ *
+ * Copyright (C) 2015 Baptiste Caramiaux, Nicola Montecchio
+ * STMS lab Ircam-CRNS-UPMC, University of Padova, Goldsmiths College University of London
+ *
+ * The library is under the GNU Lesser General Public License (LGPL v3)
+ */
+
+#ifndef _H_GVFPROFILER
+#define _H_GVFPROFILER
+
+#include "GVFUtils.h"
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <string.h>
+
+using namespace std;
+
+#ifdef GVF_PROFILING
+#define GVF_PROFILE(statement) statement
+#else
+#define GVF_PROFILE(statement)
+#endif
+
+#define GVF_PROFILING_WINDOW    1024    // frames the percentiles are computed over
+#define GVF_PROFILING_SLOT      8       // doubles per chunk slot (a cache line wide)
+
+// counters of a chunk slot, after the two timed stages
+#define GVF_PROFILING_RESPAWNS  2
+#define GVF_PROFILING_NANS      3
+
+class GVFProfiler
+{
+public:
+
+    GVFProfiler()
+    {
+        reset();
+    }
+
+    /**
+     * Forget the timings and the counters
+     */
+    void reset()
+    {
+        history.clear();    // allocated by the first frame, never in builds without profiling
+        frames = 0;
+        memset(frame, 0, sizeof(frame));
+        updates = resamples = respawns = nanPosteriors = 0;
+        fill(chunkSlots.begin(), chunkSlots.end(), 0.0);
+    }
+
+    /**
+     * Size the chunk slots (does not allocate when the number of chunks is unchanged)
+     */
+    void setNumberOfChunks(int numberOfChunks)
+    {
+        chunkSlots.assign(numberOfChunks * GVF_PROFILING_SLOT, 0.0);
+    }
+
+    static double now()
+    {
+        return chrono::duration<double, micro>(chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    void beginFrame()
+    {
+        memset(frame, 0, sizeof(frame));
+        frameStart = last = now();
+    }
+
+    // time since the last lap, added to a stage
+    void lap(GVFStage stage)
+    {
+        double t = now();
+        frame[stage] += t - last;
+        last = t;
+    }
+
+    // time since the last lap, not attributed (stages timed by the chunks)
+    void skip()
+    {
+        last = now();
+    }
+
+    void addChunkTime(int chunk, GVFStage stage, double microseconds)
+    {
+        chunkSlots[chunk * GVF_PROFILING_SLOT + stage] += microseconds;
+    }
+
+    void addChunkCount(int chunk, int counter, int count)
+    {
+        chunkSlots[chunk * GVF_PROFILING_SLOT + counter] += count;
+    }
+
+    void countResample()
+    {
+        resamples++;
+    }
+
+    // collect the chunk slots and push the durations of the frame into the window
+    void endFrame()
+    {
+        for (int s = 0; s < (int)chunkSlots.size(); s += GVF_PROFILING_SLOT)
+        {
+            frame[STAGE_PRIOR]      += chunkSlots[s + STAGE_PRIOR];
+            frame[STAGE_LIKELIHOOD] += chunkSlots[s + STAGE_LIKELIHOOD];
+            respawns                += (uint64_t)chunkSlots[s + GVF_PROFILING_RESPAWNS];
+            nanPosteriors           += (uint64_t)chunkSlots[s + GVF_PROFILING_NANS];
+        }
+        fill(chunkSlots.begin(), chunkSlots.end(), 0.0);
+        frame[STAGE_UPDATE] = now() - frameStart;
+
+        if (history.empty())
+            history.assign(GVF_PROFILING_WINDOW * NUMBER_OF_STAGES, 0.0f);
+        float *row = &history[(updates % GVF_PROFILING_WINDOW) * NUMBER_OF_STAGES];
+        for (int k = 0; k < NUMBER_OF_STAGES; k++)
+            row[k] = (float)frame[k];
+        updates++;
+        frames = (int)min<uint64_t>(updates, GVF_PROFILING_WINDOW);
+    }
+
+    /**
+     * Percentiles of every stage over the window, and the counters
+     */
+    void getStats(GVFPerformanceStats & stats)
+    {
+        memset(&stats, 0, sizeof(stats));
+#ifdef GVF_PROFILING
+        stats.enabled = true;
+#endif
+        stats.frames        = frames;
+        stats.updates       = updates;
+        stats.resamples     = resamples;
+        stats.respawns      = respawns;
+        stats.nanPosteriors = nanPosteriors;
+        if (frames == 0)
+            return;
+
+        sorted.resize(frames);
+        for (int k = 0; k < NUMBER_OF_STAGES; k++)
+        {
+            double sum = 0.0;
+            for (int f = 0; f < frames; f++)
+            {
+                sorted[f] = history[f * NUMBER_OF_STAGES + k];
+                sum      += sorted[f];
+            }
+            sort(sorted.begin(), sorted.end());
+            GVFStageStats & stage = stats.stages[k];
+            stage.mean = (float)(sum / frames);
+            stage.p50  = percentile(0.50f);
+            stage.p90  = percentile(0.90f);
+            stage.p99  = percentile(0.99f);
+            stage.max  = sorted[frames - 1];
+        }
+    }
+
+private:
+
+    // nearest rank in the sorted durations
+    float percentile(float p) const
+    {
+        int rank = (int)ceil(p * sorted.size()) - 1;
+        return sorted[max(0, min(rank, (int)sorted.size() - 1))];
+    }
+
+    vector<float>   history;        // durations of the last frames [window x stages]
+    int             frames;         // frames in the window
+    double          frame[NUMBER_OF_STAGES];
+    double          frameStart;
+    double          last;
+    vector<double>  chunkSlots;     // per chunk: prior and likelihood times, respawns, NaN weights
+    vector<float>   sorted;         // scratch of getStats()
+
+    uint64_t        updates;
+    uint64_t        resamples;
+    uint64_t        respawns;
+    uint64_t        nanPosteriors;
+};
+
+#endif
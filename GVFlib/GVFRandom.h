@@ -0,0 +1,227 @@
+/**
+ * Random number generation used by the Gesture Variation Follower
+ *
+ * @details GVFRandom runs 8 interleaved xoshiro128+ generators whose states are stored lane by lane,
+ * so that one step of the 8 generators is a handful of vectorizable integer operations. Noise is drawn
+ * in bulk: fillUniform() and fillNormal() fill whole buffers per frame, normal deviates being obtained
+ * from pairs of uniforms with the Box-Muller transform (vectorized with AVX2 when available).
+ *
+ * Copyright (C) 2015 Baptiste Caramiaux, Nicola Montecchio
+ * STMS lab Ircam-CRNS-UPMC, University of Padova, Goldsmiths College University of London
+ *
+ * The library is under the GNU Lesser General Public License (LGPL v3)
+ */
+
+#ifndef _H_GVFRANDOM
+#define _H_GVFRANDOM
+
+#include "GVFKernels.h"
+#include <stdint.h>
+#include <math.h>
+
+#define GVF_RANDOM_LANES 8
+#define GVF_RANDOM_STATE_WORDS (5 * GVF_RANDOM_LANES + 1)    // generator state, cached step and its read position
+
+typedef void (*GVFBoxMullerKernel)(const float * u1, const float * u2, float * z0, float * z1, int n);
+
+//--------------------------------------------------------------
+// Box-Muller transform: two uniforms in (0,1] give two independent standard normal deviates
+inline void gvfBoxMullerScalar(const float * u1, const float * u2, float * z0, float * z1, int n)
+{
+    for (int k = 0; k < n; k++)
+    {
+        float r     = sqrt(-2.0f * log(u1[k]));
+        float theta = 6.28318530717958647f * u2[k];
+        z0[k] = r * cos(theta);
+        z1[k] = r * sin(theta);
+    }
+}
+
+#ifdef GVF_X86_KERNELS
+//--------------------------------------------------------------
+GVF_TARGET_AVX2 inline void gvfBoxMullerAVX2(const float * u1, const float * u2, float * z0, float * z1, int n)
+{
+    int k = 0;
+    for (; k + 8 <= n; k += 8)
+    {
+        __m256 r = _mm256_sqrt_ps(_mm256_mul_ps(_mm256_set1_ps(-2.0f), gvfLog8(_mm256_loadu_ps(u1 + k))));
+        // sin/cos are evaluated on [-pi, pi) to keep the range reduction exact
+        __m256 theta = _mm256_mul_ps(_mm256_set1_ps(6.28318530717958647f), _mm256_sub_ps(_mm256_loadu_ps(u2 + k), _mm256_set1_ps(0.5f)));
+        __m256 s, c;
+        gvfSinCos8(theta, s, c);
+        _mm256_storeu_ps(z0 + k, _mm256_mul_ps(r, c));
+        _mm256_storeu_ps(z1 + k, _mm256_mul_ps(r, s));
+    }
+    gvfBoxMullerScalar(u1 + k, u2 + k, z0 + k, z1 + k, n - k);
+}
+#endif
+
+//--------------------------------------------------------------
+inline GVFBoxMullerKernel gvfSelectBoxMullerKernel()
+{
+#ifdef GVF_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return gvfBoxMullerAVX2;
+#endif
+    return gvfBoxMullerScalar;
+}
+
+class GVFRandom
+{
+public:
+
+    GVFRandom(uint64_t seed = 0x853c49e6748fea9bULL)
+    {
+        boxMuller = gvfSelectBoxMullerKernel();
+        setSeed(seed);
+    }
+
+    /**
+     * Re-seed the 8 generators
+     * @details the lanes are initialised from a splitmix64 sequence started at the seed
+     */
+    void setSeed(uint64_t seed)
+    {
+        for (int k = 0; k < 4; k++)
+        {
+            for (int l = 0; l < GVF_RANDOM_LANES; l += 2)
+            {
+                uint64_t z = splitmix64(seed);
+                state[k][l]     = (uint32_t)z;
+                state[k][l + 1] = (uint32_t)(z >> 32);
+            }
+        }
+        // an all-zero state would stay zero forever
+        for (int l = 0; l < GVF_RANDOM_LANES; l++)
+            if ((state[0][l] | state[1][l] | state[2][l] | state[3][l]) == 0)
+                state[0][l] = 1;
+        cacheIndex = GVF_RANDOM_LANES;
+    }
+
+    /**
+     * Single uniform draw in [0,1)
+     */
+    float uniform()
+    {
+        if (cacheIndex == GVF_RANDOM_LANES)
+        {
+            next(cache);
+            cacheIndex = 0;
+        }
+        return (cache[cacheIndex++] >> 8) * (1.0f / 16777216.0f);
+    }
+
+    /**
+     * Fill a buffer with uniform draws in [0,1)
+     */
+    void fillUniform(float * out, int n)
+    {
+        uint32_t r[GVF_RANDOM_LANES];
+        int k = 0;
+        for (; k + GVF_RANDOM_LANES <= n; k += GVF_RANDOM_LANES)
+        {
+            next(r);
+            for (int l = 0; l < GVF_RANDOM_LANES; l++)
+                out[k + l] = (r[l] >> 8) * (1.0f / 16777216.0f);
+        }
+        for (; k < n; k++)
+            out[k] = uniform();
+    }
+
+    /**
+     * Fill a buffer with standard normal draws
+     */
+    void fillNormal(float * out, int n)
+    {
+        const int block = 128;
+        float u1[block], u2[block], z[2 * block];
+        while (n > 0)
+        {
+            int pairs = (n + 1) / 2;
+            if (pairs > block) pairs = block;
+            fillOpenUniform(u1, pairs);
+            fillOpenUniform(u2, pairs);
+            boxMuller(u1, u2, z, z + pairs, pairs);
+            int count = (2 * pairs < n) ? 2 * pairs : n;
+            for (int k = 0; k < count; k++)
+                out[k] = z[k];
+            out += count;
+            n   -= count;
+        }
+    }
+
+    /**
+     * Copy the complete state of the generators, so that the sequence can be resumed with setState()
+     * @param words buffer of GVF_RANDOM_STATE_WORDS words
+     */
+    void getState(uint32_t * words) const
+    {
+        for (int k = 0; k < 4; k++)
+            for (int l = 0; l < GVF_RANDOM_LANES; l++)
+                *words++ = state[k][l];
+        for (int l = 0; l < GVF_RANDOM_LANES; l++)
+            *words++ = cache[l];
+        *words = (uint32_t)cacheIndex;
+    }
+
+    /**
+     * Resume the sequence from a state given by getState()
+     */
+    void setState(const uint32_t * words)
+    {
+        for (int k = 0; k < 4; k++)
+            for (int l = 0; l < GVF_RANDOM_LANES; l++)
+                state[k][l] = *words++;
+        for (int l = 0; l < GVF_RANDOM_LANES; l++)
+            cache[l] = *words++;
+        cacheIndex = (words[0] <= GVF_RANDOM_LANES) ? (int)words[0] : GVF_RANDOM_LANES;
+    }
+
+private:
+
+    // fill with uniform draws in (0,1], suitable for the logarithm of the Box-Muller transform
+    void fillOpenUniform(float * out, int n)
+    {
+        uint32_t r[GVF_RANDOM_LANES];
+        for (int k = 0; k < n; k += GVF_RANDOM_LANES)
+        {
+            next(r);
+            for (int l = 0; l < GVF_RANDOM_LANES && k + l < n; l++)
+                out[k + l] = ((r[l] >> 8) + 1) * (1.0f / 16777216.0f);
+        }
+    }
+
+    // one xoshiro128+ step on every lane
+    void next(uint32_t * out)
+    {
+        for (int l = 0; l < GVF_RANDOM_LANES; l++)
+        {
+            uint32_t s0 = state[0][l], s1 = state[1][l], s2 = state[2][l], s3 = state[3][l];
+            out[l] = s0 + s3;
+            uint32_t t = s1 << 9;
+            s2 ^= s0;
+            s3 ^= s1;
+            s1 ^= s2;
+            s0 ^= s3;
+            s2 ^= t;
+            s3 = (s3 << 11) | (s3 >> 21);
+            state[0][l] = s0; state[1][l] = s1; state[2][l] = s2; state[3][l] = s3;
+        }
+    }
+
+    static uint64_t splitmix64(uint64_t & x)
+    {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+
+    uint32_t            state[4][GVF_RANDOM_LANES];     // xoshiro128+ state, one column per lane
+    uint32_t            cache[GVF_RANDOM_LANES];        // last step, consumed by uniform()
+    int                 cacheIndex;
+    GVFBoxMullerKernel  boxMuller;
+};
+
+#endif
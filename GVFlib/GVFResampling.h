@@ -0,0 +1,201 @@
+/**
+ * Resampling schemes used by the Gesture Variation Follower
+ *
+ * @details Each scheme draws, for every new particle, the index of the particle it is copied from
+ * (its ancestor) given normalised weights. The schemes only differ in how the draws are correlated:
+ * systematic and stratified sample the cumulative distribution with one cursor, residual copies the
+ * integer part of n*w deterministically and samples the rest, multinomial draws independently from an
+ * alias table, and the Metropolis scheme runs a short independent chain per particle, which needs no
+ * cumulative sum and can therefore be split over threads.
+ *
+ * Copyright (C) 2015 Baptiste Caramiaux, Nicola Montecchio
+ * STMS lab Ircam-CRNS-UPMC, University of Padova, Goldsmiths College University of London
+ *
+ * The library is under the GNU Lesser General Public License (LGPL v3)
+ */
+
+#ifndef _H_GVFRESAMPLING
+#define _H_GVFRESAMPLING
+
+#include "GVFRandom.h"
+#include <math.h>
+
+#define GVF_METROPOLIS_MAX_STEPS 64     // upper bound of the chain length of the Metropolis scheme
+
+//--------------------------------------------------------------
+// cumulative distribution of the weights
+inline void gvfCumulativeWeights(const float * weights, int n, float * cdf)
+{
+    float sum = 0.0f;
+    for (int i = 0; i < n; i++)
+    {
+        sum += weights[i];
+        cdf[i] = sum;
+    }
+}
+
+//--------------------------------------------------------------
+// walk the cumulative distribution with increasing positions (j + u[j]) / count, u[j] in [0,1)
+// the last ancestor absorbs the rounding of the cumulative sum
+inline void gvfWalkCumulative(const float * cdf, int n, const float * u, bool singleOffset, int count, int * ancestors)
+{
+    const float total = cdf[n - 1];
+    int i = 0;
+    for (int j = 0; j < count; j++)
+    {
+        float uj = total * (j + u[singleOffset ? 0 : j]) / count;
+        while (uj > cdf[i] && i < n - 1)
+            i++;
+        ancestors[j] = i;
+    }
+}
+
+//--------------------------------------------------------------
+// systematic: one uniform offset shared by all the positions
+// @param count number of draws (n by default), ancestors [count]
+inline void gvfResampleSystematic(const float * weights, int n, GVFRandom & random, float * cdf, int * ancestors, int count = 0)
+{
+    gvfCumulativeWeights(weights, n, cdf);
+    float u0 = random.uniform();
+    gvfWalkCumulative(cdf, n, &u0, true, (count > 0) ? count : n, ancestors);
+}
+
+//--------------------------------------------------------------
+// stratified: one uniform offset per position
+// @param u scratch buffer [count]
+// @param count number of draws (n by default), ancestors [count]
+inline void gvfResampleStratified(const float * weights, int n, GVFRandom & random, float * cdf, float * u, int * ancestors, int count = 0)
+{
+    if (count <= 0)
+        count = n;
+    gvfCumulativeWeights(weights, n, cdf);
+    random.fillUniform(u, count);
+    gvfWalkCumulative(cdf, n, u, false, count, ancestors);
+}
+
+//--------------------------------------------------------------
+// residual: floor(n * w) copies of every particle, the remaining draws being made systematically
+// on the residual weights
+// @param residuals scratch buffer [n]
+inline void gvfResampleResidual(const float * weights, int n, GVFRandom & random, float * cdf, float * residuals, int * ancestors)
+{
+    int j = 0;
+    for (int i = 0; i < n; i++)
+    {
+        float expected = n * weights[i];
+        int copies = (int)expected;
+        if (copies > n - j)
+            copies = n - j;
+        for (int k = 0; k < copies; k++)
+            ancestors[j++] = i;
+        residuals[i] = expected - copies;
+    }
+    int remaining = n - j;
+    if (remaining == 0)
+        return;
+    gvfCumulativeWeights(residuals, n, cdf);
+    if (cdf[n - 1] <= 0.0f)     // rounding only: spread the remaining draws uniformly
+    {
+        for (; j < n; j++)
+            ancestors[j] = j;
+        return;
+    }
+    float u0 = random.uniform();
+    gvfWalkCumulative(cdf, n, &u0, true, remaining, ancestors + j);
+}
+
+//--------------------------------------------------------------
+// build a Walker alias table (Vose's method): drawing index k uniformly and keeping it with probability
+// probabilities[k] or taking aliases[k] otherwise samples the weights in constant time
+// @param work scratch buffer [n]
+inline void gvfBuildAliasTable(const float * weights, int n, float * probabilities, int * aliases, int * work)
+{
+    // small entries are stacked from the front of work, large ones from the back
+    int numberSmall = 0, numberLarge = 0;
+    float total = 0.0f;
+    for (int i = 0; i < n; i++)
+        total += weights[i];
+    for (int i = 0; i < n; i++)
+    {
+        probabilities[i] = (total > 0.0f) ? weights[i] * n / total : 1.0f;
+        aliases[i] = i;
+        if (probabilities[i] < 1.0f)
+            work[numberSmall++] = i;
+        else
+            work[n - 1 - numberLarge++] = i;
+    }
+    while (numberSmall > 0 && numberLarge > 0)
+    {
+        int s = work[--numberSmall];
+        int l = work[n - numberLarge];
+        aliases[s] = l;
+        probabilities[l] -= 1.0f - probabilities[s];
+        if (probabilities[l] < 1.0f)
+        {
+            numberLarge--;
+            work[numberSmall++] = l;
+        }
+    }
+    // leftovers are only due to rounding
+    for (int k = 0; k < numberSmall; k++)
+        probabilities[work[k]] = 1.0f;
+    for (int k = 0; k < numberLarge; k++)
+        probabilities[work[n - 1 - k]] = 1.0f;
+}
+
+//--------------------------------------------------------------
+// multinomial: n independent draws from the alias table
+// @param probabilities, aliases, work scratch buffers [n]
+inline void gvfResampleMultinomial(const float * weights, int n, GVFRandom & random, float * probabilities, int * aliases, int * work, int * ancestors)
+{
+    gvfBuildAliasTable(weights, n, probabilities, aliases, work);
+    for (int j = 0; j < n; j++)
+    {
+        int k = (int)(random.uniform() * n);
+        if (k >= n) k = n - 1;
+        ancestors[j] = (random.uniform() < probabilities[k]) ? k : aliases[k];
+    }
+}
+
+//--------------------------------------------------------------
+// length of the Metropolis chains: with beta = mean(w) / max(w), a chain of B steps has moved away
+// from its start with probability at least 1 - (1 - beta)^B, B is chosen so that this is 99%
+inline int gvfMetropolisSteps(const float * weights, int n)
+{
+    float maxWeight = 0.0f, total = 0.0f;
+    for (int i = 0; i < n; i++)
+    {
+        total += weights[i];
+        if (weights[i] > maxWeight)
+            maxWeight = weights[i];
+    }
+    if (maxWeight <= 0.0f)
+        return 1;
+    double beta = (total / n) / maxWeight;
+    if (beta >= 1.0)
+        return 1;
+    double steps = ceil(log(0.01) / log(1.0 - beta));
+    return (steps > GVF_METROPOLIS_MAX_STEPS) ? GVF_METROPOLIS_MAX_STEPS : (int)steps;
+}
+
+//--------------------------------------------------------------
+// Metropolis: the ancestors of the particles in [begin, end) are drawn independently of the other
+// particles, which is what makes the scheme parallel (the weights do not need to be normalised)
+// a chain never moves to a zero weight, and one still on a zero weight after its steps is extended
+inline void gvfResampleMetropolis(const float * weights, int n, int steps, GVFRandom & random, int begin, int end, int * ancestors)
+{
+    for (int j = begin; j < end; j++)
+    {
+        int k = j;
+        for (int b = 0; b < steps || (weights[k] <= 0.0f && b < steps + GVF_METROPOLIS_MAX_STEPS); b++)
+        {
+            int l = (int)(random.uniform() * n);
+            if (l >= n) l = n - 1;
+            if (random.uniform() * weights[k] < weights[l])
+                k = l;
+        }
+        ancestors[j] = k;
+    }
+}
+
+#endif
@@ -0,0 +1,313 @@
+/**
+ * Binary template vocabulary of the Gesture Variation Follower
+ *
+ * @details The file holds the vocabulary exactly as GVF packs it for following, so that it can be
+ * memory-mapped and used in place: a fixed header, the position and length of every template, the
+ * observation ranges, then (from a 64-byte aligned offset) the packed frames of every template,
+ * template after template, each frame padded to the frame stride.
+ *
+ *     header      GVFTemplateFileHeader
+ *     offsets     uint64_t [G]    position of the first frame of each template in the payload (floats)
+ *     lengths     uint32_t [G]    number of frames of each template
+ *     minRange    float [D]
+ *     maxRange    float [D]
+ *     padding     up to header.payloadOffset (multiple of GVF_TEMPLATE_FILE_ALIGNMENT)
+ *     payload     float [header.payloadSize]
+ *
+ * Values are stored in the byte order of the machine that wrote the file; files of the other byte
+ * order are rejected.
+ *
+ * Copyright (C) 2015 Baptiste Caramiaux, Nicola Montecchio
+ * STMS lab Ircam-CRNS-UPMC, University of Padova, Goldsmiths College University of London
+ *
+ * The library is under the GNU Lesser General Public License (LGPL v3)
+ */
+
+#ifndef _H_GVFTEMPLATEFILE
+#define _H_GVFTEMPLATEFILE
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+using namespace std;
+
+#define GVF_TEMPLATE_FILE_MAGIC      "GVFT"
+#define GVF_TEMPLATE_FILE_VERSION    1
+#define GVF_TEMPLATE_FILE_BYTE_ORDER 0x01020304
+#define GVF_TEMPLATE_FILE_ALIGNMENT  64
+
+typedef struct
+{
+    char        magic[4];           // GVF_TEMPLATE_FILE_MAGIC
+    uint32_t    version;            // GVF_TEMPLATE_FILE_VERSION
+    uint32_t    byteOrder;          // GVF_TEMPLATE_FILE_BYTE_ORDER as written by the machine
+    uint32_t    dimensions;         // input dimension [D]
+    uint32_t    frameStride;        // floats per packed frame
+    uint32_t    numberOfTemplates;  // [G]
+    uint64_t    payloadOffset;      // position of the payload in the file (bytes)
+    uint64_t    payloadSize;        // size of the payload (floats)
+} GVFTemplateFileHeader;
+
+class GVFTemplateFile
+{
+public:
+
+    GVFTemplateFile()
+    {
+        mapping     = NULL;
+        mappingSize = 0;
+        frames      = NULL;
+        dimensions  = 0;
+        frameStride = 0;
+        payloadSize = 0;
+    }
+
+    ~GVFTemplateFile()
+    {
+        close();
+    }
+
+    /**
+     * Write a packed vocabulary
+     * @return false if the file could not be written
+     */
+    static bool write(const string & filename, int dimensions, int frameStride,
+                      const vector<int> & offsets, const vector<int> & lengths,
+                      const vector<float> & minRange, const vector<float> & maxRange,
+                      const float * frames, size_t numberOfFloats)
+    {
+        GVFTemplateFileHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, GVF_TEMPLATE_FILE_MAGIC, 4);
+        header.version           = GVF_TEMPLATE_FILE_VERSION;
+        header.byteOrder         = GVF_TEMPLATE_FILE_BYTE_ORDER;
+        header.dimensions        = dimensions;
+        header.frameStride       = frameStride;
+        header.numberOfTemplates = (uint32_t)offsets.size();
+        header.payloadSize       = numberOfFloats;
+        size_t tableSize = offsets.size() * (sizeof(uint64_t) + sizeof(uint32_t)) + 2 * dimensions * sizeof(float);
+        header.payloadOffset = align(sizeof(header) + tableSize);
+
+        FILE *file = fopen(filename.c_str(), "wb");
+        if (file == NULL)
+            return false;
+        vector<char> table(header.payloadOffset - sizeof(header), 0);
+        char *p = &table[0];
+        for (int g = 0; g < (int)offsets.size(); g++, p += sizeof(uint64_t))
+        {
+            uint64_t offset = offsets[g];
+            memcpy(p, &offset, sizeof(offset));
+        }
+        for (int g = 0; g < (int)lengths.size(); g++, p += sizeof(uint32_t))
+        {
+            uint32_t length = lengths[g];
+            memcpy(p, &length, sizeof(length));
+        }
+        for (int d = 0; d < dimensions; d++, p += sizeof(float))
+            memcpy(p, &minRange[d], sizeof(float));
+        for (int d = 0; d < dimensions; d++, p += sizeof(float))
+            memcpy(p, &maxRange[d], sizeof(float));
+
+        bool written = fwrite(&header, sizeof(header), 1, file) == 1
+                    && fwrite(&table[0], 1, table.size(), file) == table.size()
+                    && (numberOfFloats == 0 || fwrite(frames, sizeof(float), numberOfFloats, file) == numberOfFloats);
+        return (fclose(file) == 0) && written;
+    }
+
+    /**
+     * Map a vocabulary file, replacing the one currently open
+     * @return false if the file cannot be read or is not a valid template file
+     */
+    bool open(const string & filename)
+    {
+        close();
+        if (!map(filename))
+            return false;
+        if (!parse())
+        {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * Release the mapping
+     */
+    void close()
+    {
+#if !defined(_WIN32)
+        if (mapping != NULL)
+            munmap(mapping, mappingSize);
+#endif
+        mapping     = NULL;
+        mappingSize = 0;
+        buffer.clear();
+        frames      = NULL;
+        offsets.clear();
+        lengths.clear();
+        minRange.clear();
+        maxRange.clear();
+    }
+
+    /**
+     * Exchange the mappings of two files
+     */
+    void swap(GVFTemplateFile & other)
+    {
+        std::swap(mapping, other.mapping);
+        std::swap(mappingSize, other.mappingSize);
+        buffer.swap(other.buffer);
+        std::swap(frames, other.frames);
+        std::swap(dimensions, other.dimensions);
+        std::swap(frameStride, other.frameStride);
+        std::swap(payloadSize, other.payloadSize);
+        offsets.swap(other.offsets);
+        lengths.swap(other.lengths);
+        minRange.swap(other.minRange);
+        maxRange.swap(other.maxRange);
+    }
+
+    bool isOpen() const                         { return frames != NULL; }
+    int getDimensions() const                   { return dimensions; }
+    int getFrameStride() const                  { return frameStride; }
+    int getNumberOfTemplates() const            { return (int)lengths.size(); }
+    const vector<int> & getOffsets() const      { return offsets; }
+    const vector<int> & getLengths() const      { return lengths; }
+    const vector<float> & getMinRange() const   { return minRange; }
+    const vector<float> & getMaxRange() const   { return maxRange; }
+    const float * getFrames() const             { return frames; }     // payload, used in place
+    size_t getPayloadSize() const               { return payloadSize; }
+
+private:
+
+    GVFTemplateFile(const GVFTemplateFile &);               // the mapping is not shared
+    GVFTemplateFile & operator=(const GVFTemplateFile &);
+
+    static size_t align(size_t size)
+    {
+        return ((size + GVF_TEMPLATE_FILE_ALIGNMENT - 1) / GVF_TEMPLATE_FILE_ALIGNMENT) * GVF_TEMPLATE_FILE_ALIGNMENT;
+    }
+
+    // map the file read-only, or read it into an aligned buffer where mapping is not available
+    bool map(const string & filename)
+    {
+#if !defined(_WIN32)
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size < (off_t)sizeof(GVFTemplateFileHeader))
+        {
+            ::close(fd);
+            return false;
+        }
+        void *address = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);    // the mapping keeps the file alive
+        if (address == MAP_FAILED)
+            return false;
+        mapping     = address;
+        mappingSize = info.st_size;
+        return true;
+#else
+        FILE *file = fopen(filename.c_str(), "rb");
+        if (file == NULL)
+            return false;
+        fseek(file, 0, SEEK_END);
+        long size = ftell(file);
+        fseek(file, 0, SEEK_SET);
+        if (size < (long)sizeof(GVFTemplateFileHeader))
+        {
+            fclose(file);
+            return false;
+        }
+        buffer.resize(size / sizeof(float) + 2 * GVF_TEMPLATE_FILE_ALIGNMENT);
+        uintptr_t base = ((uintptr_t)&buffer[0] + GVF_TEMPLATE_FILE_ALIGNMENT - 1) & ~(uintptr_t)(GVF_TEMPLATE_FILE_ALIGNMENT - 1);
+        bool read = fread((void *)base, 1, size, file) == (size_t)size;
+        fclose(file);
+        if (!read)
+            return false;
+        mappingSize = size;
+        mapping     = (void *)base;
+        return true;
+#endif
+    }
+
+    // check the header and read the tables, the payload staying in the mapping
+    bool parse()
+    {
+        const char *bytes = (const char *)mapping;
+        GVFTemplateFileHeader header;
+        memcpy(&header, bytes, sizeof(header));
+        if (memcmp(header.magic, GVF_TEMPLATE_FILE_MAGIC, 4) != 0
+            || header.version != GVF_TEMPLATE_FILE_VERSION
+            || header.byteOrder != GVF_TEMPLATE_FILE_BYTE_ORDER
+            || header.dimensions == 0 || header.frameStride < header.dimensions
+            || header.payloadOffset % GVF_TEMPLATE_FILE_ALIGNMENT != 0)
+            return false;
+
+        size_t tableSize = header.numberOfTemplates * (sizeof(uint64_t) + sizeof(uint32_t)) + 2 * header.dimensions * sizeof(float);
+        if (sizeof(header) + tableSize > header.payloadOffset
+            || header.payloadOffset + header.payloadSize * sizeof(float) > mappingSize)
+            return false;
+
+        dimensions  = header.dimensions;
+        frameStride = header.frameStride;
+        payloadSize = header.payloadSize;
+        offsets.resize(header.numberOfTemplates);
+        lengths.resize(header.numberOfTemplates);
+        minRange.resize(dimensions);
+        maxRange.resize(dimensions);
+
+        const char *p = bytes + sizeof(header);
+        for (int g = 0; g < (int)offsets.size(); g++, p += sizeof(uint64_t))
+        {
+            uint64_t offset;
+            memcpy(&offset, p, sizeof(offset));
+            if (offset > 0x7fffffff)       // positions in the vocabulary are int
+                return false;
+            offsets[g] = (int)offset;
+        }
+        for (int g = 0; g < (int)lengths.size(); g++, p += sizeof(uint32_t))
+        {
+            uint32_t length;
+            memcpy(&length, p, sizeof(length));
+            lengths[g] = (int)length;
+            if (length == 0 || offsets[g] + (uint64_t)length * frameStride > payloadSize)
+                return false;
+        }
+        for (int d = 0; d < dimensions; d++, p += sizeof(float))
+            memcpy(&minRange[d], p, sizeof(float));
+        for (int d = 0; d < dimensions; d++, p += sizeof(float))
+            memcpy(&maxRange[d], p, sizeof(float));
+
+        frames = (const float *)(bytes + header.payloadOffset);
+        return true;
+    }
+
+    void            *mapping;       // start of the file in memory
+    size_t          mappingSize;    // size of the file (bytes)
+    vector<float>   buffer;         // file contents where it cannot be mapped
+
+    const float     *frames;
+    int             dimensions;
+    int             frameStride;
+    size_t          payloadSize;
+    vector<int>     offsets;
+    vector<int>     lengths;
+    vector<float>   minRange;
+    vector<float>   maxRange;
+};
+
+#endif
@@ -0,0 +1,133 @@
+/**
+ * Persistent worker pool used by the Gesture Variation Follower
+ *
+ * @details The workers are created once and sleep between two calls to run(). A call splits the work
+ * into chunks which are claimed by the workers and by the calling thread; run() returns when every
+ * chunk has been processed. Tasks are plain function pointers so that dispatching does not allocate.
+ *
+ * Copyright (C) 2015 Baptiste Caramiaux, Nicola Montecchio
+ * STMS lab Ircam-CRNS-UPMC, University of Padova, Goldsmiths College University of London
+ *
+ * The library is under the GNU Lesser General Public License (LGPL v3)
+ */
+
+#ifndef _H_GVFTHREADPOOL
+#define _H_GVFTHREADPOOL
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+using namespace std;
+
+typedef void (*GVFTask)(void * context, int chunk);
+
+class GVFThreadPool
+{
+public:
+
+    /**
+     * Create the pool
+     * @param numberOfThreads total number of threads working on a task, including the calling thread
+     */
+    GVFThreadPool(int numberOfThreads)
+    {
+        task        = NULL;
+        context     = NULL;
+        numberChunks = 0;
+        generation  = 0;
+        busyWorkers = 0;
+        stopping    = false;
+        for (int k = 1; k < numberOfThreads; k++)
+            workers.push_back(std::thread(&GVFThreadPool::workerLoop, this));
+    }
+
+    ~GVFThreadPool()
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wakeUp.notify_all();
+        for (int k = 0; k < (int)workers.size(); k++)
+            workers[k].join();
+    }
+
+    int getNumberOfThreads()
+    {
+        return (int)workers.size() + 1;
+    }
+
+    /**
+     * Run task(context, chunk) for every chunk in [0, numberOfChunks) and wait for completion
+     */
+    void run(GVFTask _task, void * _context, int numberOfChunks)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            task         = _task;
+            context      = _context;
+            numberChunks = numberOfChunks;
+            nextChunk.store(0);
+            busyWorkers  = (int)workers.size();
+            generation++;
+        }
+        wakeUp.notify_all();
+
+        processChunks();
+
+        std::unique_lock<std::mutex> lock(mutex);
+        while (busyWorkers > 0)
+            finished.wait(lock);
+    }
+
+private:
+
+    void processChunks()
+    {
+        int chunk;
+        while ((chunk = nextChunk.fetch_add(1)) < numberChunks)
+            task(context, chunk);
+    }
+
+    void workerLoop()
+    {
+        unsigned long seenGeneration = 0;
+        while (true)
+        {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                while (!stopping && generation == seenGeneration)
+                    wakeUp.wait(lock);
+                if (stopping)
+                    return;
+                seenGeneration = generation;
+            }
+
+            processChunks();
+
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                busyWorkers--;
+            }
+            finished.notify_one();
+        }
+    }
+
+    vector<std::thread>         workers;
+    std::mutex                  mutex;
+    std::condition_variable     wakeUp;         // signals a new task to the workers
+    std::condition_variable     finished;       // signals the caller that a worker is done
+
+    GVFTask                     task;
+    void                        *context;
+    int                         numberChunks;
+    std::atomic<int>            nextChunk;
+    unsigned long               generation;     // incremented for every task
+    int                         busyWorkers;    // workers that have not finished the current task
+    bool                        stopping;
+};
+
+#endif
@@ -14,6 +14,7 @@
 #include <iostream>
 #include <math.h>
 #include <assert.h>
+#include <stdint.h>
 
 using namespace std;
 
@@ -25,8 +26,21 @@ typedef struct
     int     inputDimensions;    /**< input dimesnion */
     bool    translate;          /**< translate flag */
     bool    segmentation;       /**< segmentation flag */
+    bool    logDomain;          /**< log-domain weights flag */
 } GVFConfig;
 
+/**
+ * Resampling schemes
+ */
+enum GVFResamplingScheme
+{
+    RESAMPLING_SYSTEMATIC = 0,  /**< one uniform offset shared by all the draws (default) */
+    RESAMPLING_STRATIFIED,      /**< one uniform offset per draw */
+    RESAMPLING_RESIDUAL,        /**< deterministic copies of n*w, systematic draws on the residuals */
+    RESAMPLING_MULTINOMIAL,     /**< independent draws from an alias table */
+    RESAMPLING_METROPOLIS       /**< independent Metropolis chains, computed in parallel */
+};
+
 /**
  * Parameters structure
  */
@@ -36,6 +50,7 @@ typedef struct
     float           distribution;
     int             numberParticles;
     int             resamplingThreshold;
+    GVFResamplingScheme resamplingScheme;
     float           alignmentVariance;
     float           speedVariance;
     vector<float>   scaleVariance;
@@ -53,6 +68,23 @@ typedef struct
     float           rotationsSpreadingRange;
     
     int             predictionSteps;
+    int             liveHistoryLength;      // frames of the live gesture kept in following mode, 0 for all
+    
+    // KLD-adaptive number of particles (see GVF::setAdaptiveParticles)
+    bool            adaptiveParticles;
+    int             minimumParticles;
+    int             maximumParticles;
+    float           kldError;               // bound on the KL divergence of the particle approximation
+    float           kldQuantile;            // upper standard normal quantile of the confidence of the bound
+    
+    // pruning of the improbable gestures (see GVF::setClassPruning)
+    bool            classPruning;
+    float           pruningFloor;           // probability below which a gesture is pruned
+    int             explorationParticles;   // particles kept on each pruned gesture
+    
+    // deadline mode (see GVF::setTimeBudget)
+    float           timeBudget;             // time budget of update() [us], 0 for none
+    int             budgetMinimumParticles; // fewest particles the budget can leave
     vector<float>   dimWeights;
 } GVFParameters;
 
@@ -67,6 +99,68 @@ typedef struct
     vector<vector<float> > rotations;
 } GVFOutcomes;
 
+// Columnar outcomes of a batch of frames, in buffers owned by the caller (see GVF::updateBatch)
+// every column is indexed by frame first; a NULL column is not written
+typedef struct
+{
+    size_t  capacity;               // number of frames the buffers can hold
+    int     numberOfGestures;       // gestures per frame [G], checked against the model
+    int     *likeliestGestures;     // [frames]
+    float   *likelihoods;           // [frames x G]
+    float   *alignments;            // [frames x G]
+    float   *dynamics;              // [frames x G x 2]
+    float   *scalings;              // [frames x G x D]
+    float   *rotations;             // [frames x G x A], A = 1 in 2-d, 3 in 3-d, 0 otherwise
+} GVFOutcomeSink;
+
+/**
+ * Stages of GVF::update() timed by the profiling layer (see GVF::getPerformanceStats)
+ */
+enum GVFStage
+{
+    STAGE_PRIOR = 0,            /**< prior propagation, summed over the chunks */
+    STAGE_LIKELIHOOD,           /**< likelihood and posterior, summed over the chunks */
+    STAGE_NORMALISATION,        /**< normalisation of the weights (log-sum-exp in the log domain) */
+    STAGE_ESS,                  /**< effective sample size and resampling decision */
+    STAGE_RESAMPLING,           /**< resampling, 0 on the frames that do not resample */
+    STAGE_ESTIMATES,            /**< estimation of the outcomes */
+    STAGE_UPDATE,               /**< whole update() */
+    NUMBER_OF_STAGES
+};
+
+// Distribution of the duration of a stage over the last frames (microseconds)
+typedef struct
+{
+    float   mean;
+    float   p50;
+    float   p90;
+    float   p99;
+    float   max;
+} GVFStageStats;
+
+// Timings and counters of the profiling layer
+typedef struct
+{
+    bool            enabled;                    // false when built without GVF_PROFILING
+    int             frames;                     // frames the timings are taken over (rolling window)
+    GVFStageStats   stages[NUMBER_OF_STAGES];   // indexed by GVFStage
+    uint64_t        updates;                    // counters since the last reset
+    uint64_t        resamples;
+    uint64_t        respawns;                   // particles respawned by segmentation
+    uint64_t        nanPosteriors;              // particles with a NaN weight after normalisation
+} GVFPerformanceStats;
+
+// State of the deadline mode (see GVF::getDeadlineStatus)
+typedef struct
+{
+    float           budget;                     // time budget of update() [us], 0 when the mode is off
+    float           cost;                       // smoothed duration of update() [us]
+    int             numberParticles;            // particles the budget affords
+    int             predictionSteps;            // prediction steps the budget affords
+    bool            degraded;                   // fewer particles or prediction steps than without the budget
+    uint64_t        overruns;                   // frames longer than the budget since it was set
+} GVFDeadlineStatus;
+
 
 //--------------------------------------------------------------
 // init matrix by allocating memory
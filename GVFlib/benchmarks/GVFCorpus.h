@@ -0,0 +1,393 @@
+/**
+ * Synthetic gesture corpus for the Gesture Variation Follower
+ *
+ * @details Generates gesture templates and performances of them without recording anybody. Each
+ * class is a continuous trajectory drawn from the seed and the class index: parametric curves
+ * (circle, Lissajous, rose, spiral, helix) or random splines through a few control points, extended
+ * with sinusoids beyond 3 dimensions. A performance plays a class with a given speed and a smooth
+ * time warp, scaled and rotated (in the plane of the first two dimensions) about its first point,
+ * translated, and corrupted by gaussian noise. Performances concatenated into a continuous stream come
+ * with the ground truth of every frame: class, alignment in the class (phase in [0,1]), speed, scaling
+ * and rotation.
+ *
+ * The same seed gives the same corpus on every machine with IEEE floats.
+ *
+ * Copyright (C) 2015 Baptiste Caramiaux, Nicola Montecchio
+ * STMS lab Ircam-CRNS-UPMC, University of Padova, Goldsmiths College University of London
+ *
+ * The library is under the GNU Lesser General Public License (LGPL v3)
+ */
+
+#ifndef _H_GVFCORPUS
+#define _H_GVFCORPUS
+
+#include "GVFUtils.h"
+#include "GVFGesture.h"
+#include "GVFRandom.h"
+
+#include <vector>
+#include <string>
+#include <math.h>
+#include <stdio.h>
+
+using namespace std;
+
+#define GVF_CORPUS_TWO_PI 6.2831853f
+
+enum GVFCorpusShape
+{
+    GVF_CORPUS_CIRCLE = 0,
+    GVF_CORPUS_LISSAJOUS,
+    GVF_CORPUS_ROSE,
+    GVF_CORPUS_SPIRAL,
+    GVF_CORPUS_HELIX,
+    GVF_CORPUS_SPLINE,
+    GVF_CORPUS_NUMBER_OF_SHAPES
+};
+
+// variations applied to the performances, every value being drawn uniformly within its range
+typedef struct
+{
+    float   minSpeed, maxSpeed;     // performance length = template length / speed
+    float   warp;                   // amplitude of the smooth time warp, in [0,1)
+    float   minScale, maxScale;
+    float   rotation;               // largest rotation angle (radians), either direction
+    float   offset;                 // largest translation of the performance, per dimension
+    float   noise;                  // standard deviation of the observation noise
+    int     minGap, maxGap;         // frames of rest before each performance of a stream
+} GVFCorpusVariations;
+
+// ground truth of a frame of a stream
+typedef struct
+{
+    int     label;                  // class performed, -1 for rest frames
+    float   alignment;              // position in the class, in [0,1]
+    float   speed;
+    float   scaling;
+    float   rotation;
+} GVFCorpusTruth;
+
+class GVFCorpus
+{
+public:
+
+    /**
+     * Create a corpus of classes
+     * @param dimensions input dimension of the gestures
+     * @param numberOfClasses number of classes (templates)
+     * @param seed seed of every random draw of the corpus
+     */
+    GVFCorpus(int dimensions, int numberOfClasses, uint64_t seed)
+    {
+        inputDimensions = dimensions;
+        corpusSeed      = seed;
+        classes.resize(numberOfClasses);
+        for (int g = 0; g < numberOfClasses; g++)
+            drawClass(g);
+        random.setSeed(seed ^ 0x9e3779b97f4a7c15ULL);
+        last.assign(dimensions, 0.0f);
+        noiseDraws.resize(dimensions);
+    }
+
+    /**
+     * Default variations: moderate speed, warp, scaling and rotation changes with a little noise
+     */
+    static GVFCorpusVariations defaultVariations()
+    {
+        GVFCorpusVariations variations;
+        variations.minSpeed = 0.8f;
+        variations.maxSpeed = 1.25f;
+        variations.warp     = 0.3f;
+        variations.minScale = 0.8f;
+        variations.maxScale = 1.25f;
+        variations.rotation = 0.3f;
+        variations.offset   = 1.0f;
+        variations.noise    = 0.01f;
+        variations.minGap   = 0;
+        variations.maxGap   = 0;
+        return variations;
+    }
+
+    int getInputDimensions() const      { return inputDimensions; }
+    int getNumberOfClasses() const      { return (int)classes.size(); }
+
+    /**
+     * Position of a class at a given phase
+     * @param label class index
+     * @param phase position in the class, from 0 (start) to 1 (end)
+     * @param point output, inputDimensions values
+     */
+    void evaluate(int label, float phase, float * point) const
+    {
+        const GVFCorpusClass & c = classes[label];
+        float a = GVF_CORPUS_TWO_PI * phase;
+        float xyz[3] = { 0.0f, 0.0f, 0.0f };
+        switch (c.shape)
+        {
+            case GVF_CORPUS_CIRCLE:
+                xyz[0] = cos(c.direction * a + c.phase);
+                xyz[1] = sin(c.direction * a + c.phase);
+                xyz[2] = 0.3f * sin(a);
+                break;
+            case GVF_CORPUS_LISSAJOUS:
+                xyz[0] = sin(c.frequencies[0] * a + c.phase);
+                xyz[1] = sin(c.frequencies[1] * a);
+                xyz[2] = sin(c.frequencies[2] * a + 2.0f * c.phase);
+                break;
+            case GVF_CORPUS_ROSE:
+            {
+                float r = cos(c.frequencies[0] * 0.5f * a);
+                xyz[0] = r * cos(c.direction * 0.5f * a + c.phase);
+                xyz[1] = r * sin(c.direction * 0.5f * a + c.phase);
+                xyz[2] = 0.5f * phase;
+                break;
+            }
+            case GVF_CORPUS_SPIRAL:
+            case GVF_CORPUS_HELIX:
+            {
+                float r = (c.shape == GVF_CORPUS_SPIRAL) ? 0.2f + 0.8f * phase : 1.0f;
+                xyz[0] = r * cos(c.direction * c.frequencies[0] * a + c.phase);
+                xyz[1] = r * sin(c.direction * c.frequencies[0] * a + c.phase);
+                xyz[2] = (c.shape == GVF_CORPUS_HELIX) ? 2.0f * phase - 1.0f : 0.0f;
+                break;
+            }
+            case GVF_CORPUS_SPLINE:
+            default:
+                spline(c, phase, xyz);
+                break;
+        }
+
+        for (int d = 0; d < inputDimensions && d < 3; d++)
+            point[d] = c.amplitude * xyz[d];
+        for (int d = 3; d < inputDimensions; d++)
+        {
+            const float *s = &c.sinusoids[3 * (d - 3)];
+            point[d] = s[0] * sin(s[1] * a + s[2]);
+        }
+    }
+
+    /**
+     * Template of a class, sampled at regular phases
+     * @param label class index
+     * @param length number of frames
+     */
+    GVFGesture makeTemplate(int label, int length) const
+    {
+        GVFGesture gesture(inputDimensions);
+        vector<float> observation(inputDimensions);
+        for (int t = 0; t < length; t++)
+        {
+            evaluate(label, t / (float)(length - 1), &observation[0]);
+            gesture.addObservation(observation);
+        }
+        return gesture;
+    }
+
+    /**
+     * Templates of every class
+     * @param length number of frames of each template
+     */
+    vector<GVFGesture> makeTemplates(int length) const
+    {
+        vector<GVFGesture> templates;
+        templates.reserve(classes.size());
+        for (int g = 0; g < (int)classes.size(); g++)
+            templates.push_back(makeTemplate(g, length));
+        return templates;
+    }
+
+    /**
+     * Append one performance of a class to a stream, preceded by the rest frames of the variations
+     * @param label class index, -1 for a class drawn at random
+     * @param length number of frames of the class at speed 1
+     * @param variations ranges of the variations of the performance
+     * @param frames output, the observations are appended
+     * @param truth output, the ground truth of each observation is appended (can be NULL)
+     */
+    void perform(int label, int length, const GVFCorpusVariations & variations,
+                 vector< vector<float> > & frames, vector<GVFCorpusTruth> * truth = NULL)
+    {
+        if (label < 0)
+            label = min((int)(random.uniform() * classes.size()), (int)classes.size() - 1);
+
+        GVFCorpusTruth state;
+        state.label     = label;
+        state.speed     = draw(variations.minSpeed, variations.maxSpeed);
+        state.scaling   = draw(variations.minScale, variations.maxScale);
+        state.rotation  = draw(-variations.rotation, variations.rotation);
+        float warpPhase = GVF_CORPUS_TWO_PI * random.uniform();
+        int frameCount  = max(2, (int)(length / state.speed + 0.5f));
+        int gap         = variations.minGap + (int)(random.uniform() * (variations.maxGap - variations.minGap + 1));
+        gap             = min(gap, variations.maxGap);
+
+        vector<float> offset(inputDimensions);
+        for (int d = 0; d < inputDimensions; d++)
+            offset[d] = draw(-variations.offset, variations.offset);
+
+        // rest at the last position of the stream
+        GVFCorpusTruth rest = { -1, 0.0f, 0.0f, 0.0f, 0.0f };
+        for (int t = 0; t < gap; t++)
+        {
+            frames.push_back(last);
+            addNoise(frames.back(), variations.noise);
+            if (truth != NULL)
+                truth->push_back(rest);
+        }
+
+        float cosine = cos(state.rotation), sine = sin(state.rotation);
+        vector<float> origin(inputDimensions), point(inputDimensions);
+        evaluate(label, 0.0f, &origin[0]);
+        for (int t = 0; t < frameCount; t++)
+        {
+            // monotonic warp of the time line, fixed at both ends
+            float u = t / (float)(frameCount - 1);
+            float phase = u + variations.warp * (sin(GVF_CORPUS_TWO_PI * u + warpPhase) - sin(warpPhase)) / GVF_CORPUS_TWO_PI;
+            phase = min(max(phase, 0.0f), 1.0f);
+            evaluate(label, phase, &point[0]);
+
+            // scaling and rotation about the first point of the class, then translation
+            for (int d = 0; d < inputDimensions; d++)
+                point[d] = state.scaling * (point[d] - origin[d]);
+            if (inputDimensions >= 2)
+            {
+                float x = point[0], y = point[1];
+                point[0] = cosine * x - sine * y;
+                point[1] = sine * x + cosine * y;
+            }
+            for (int d = 0; d < inputDimensions; d++)
+                point[d] += origin[d] + offset[d];
+
+            frames.push_back(point);
+            addNoise(frames.back(), variations.noise);
+            if (truth != NULL)
+            {
+                state.alignment = phase;
+                truth->push_back(state);
+            }
+        }
+        last = point;
+    }
+
+    /**
+     * Continuous stream of performances of classes drawn at random
+     * @param numberOfFrames number of frames of the stream (the last performance is cut)
+     * @param length number of frames of a class at speed 1
+     */
+    void makeStream(int numberOfFrames, int length, const GVFCorpusVariations & variations,
+                    vector< vector<float> > & frames, vector<GVFCorpusTruth> * truth = NULL)
+    {
+        frames.clear();
+        if (truth != NULL)
+            truth->clear();
+        while ((int)frames.size() < numberOfFrames)
+            perform(-1, length, variations, frames, truth);
+        frames.resize(numberOfFrames);
+        if (truth != NULL)
+            truth->resize(numberOfFrames);
+    }
+
+    /**
+     * Write the templates of every class in the text format of GVF::saveTemplates()
+     * @return false if the file could not be written
+     */
+    bool writeTemplates(const string & filename, int length) const
+    {
+        FILE *file = fopen(filename.c_str(), "w");
+        if (file == NULL)
+            return false;
+        vector<float> observation(inputDimensions);
+        for (int g = 0; g < (int)classes.size(); g++)
+        {
+            fprintf(file, "template %d %d\n", g, inputDimensions);
+            for (int t = 0; t < length; t++)
+            {
+                evaluate(g, t / (float)(length - 1), &observation[0]);
+                for (int d = 0; d < inputDimensions; d++)
+                    fprintf(file, "%g ", observation[d]);
+                fprintf(file, "\n");
+            }
+        }
+        return (fclose(file) == 0);
+    }
+
+private:
+
+    typedef struct
+    {
+        GVFCorpusShape  shape;
+        float           amplitude;
+        float           phase;
+        float           direction;          // +1 or -1
+        float           frequencies[3];
+        vector<float>   controlPoints;      // [K x 3] for splines
+        vector<float>   sinusoids;          // amplitude, frequency, phase of dimensions 4 and above
+    } GVFCorpusClass;
+
+    // shape and parameters of a class, from the seed and the class index only
+    void drawClass(int label)
+    {
+        GVFRandom r;
+        r.setSeed(corpusSeed * 7919 + label);
+        GVFCorpusClass & c = classes[label];
+        c.shape     = (GVFCorpusShape)(label % GVF_CORPUS_NUMBER_OF_SHAPES);
+        c.amplitude = 0.5f + r.uniform();
+        c.phase     = GVF_CORPUS_TWO_PI * r.uniform();
+        c.direction = (r.uniform() < 0.5f) ? -1.0f : 1.0f;
+        for (int k = 0; k < 3; k++)
+            c.frequencies[k] = (float)(1 + (int)(4 * r.uniform()));
+        if (c.shape == GVF_CORPUS_ROSE || c.shape == GVF_CORPUS_SPIRAL)
+            c.frequencies[0] += 1.0f;
+        int numberOfPoints = 4 + (int)(5 * r.uniform());
+        c.controlPoints.resize(3 * numberOfPoints);
+        for (int k = 0; k < 3 * numberOfPoints; k++)
+            c.controlPoints[k] = 2.0f * r.uniform() - 1.0f;
+        c.sinusoids.resize(3 * max(inputDimensions - 3, 0));
+        for (int k = 0; k < (int)c.sinusoids.size(); k += 3)
+        {
+            c.sinusoids[k]     = 0.2f + r.uniform();
+            c.sinusoids[k + 1] = 0.5f + 2.5f * r.uniform();
+            c.sinusoids[k + 2] = GVF_CORPUS_TWO_PI * r.uniform();
+        }
+    }
+
+    // Catmull-Rom spline through the control points of a class
+    static void spline(const GVFCorpusClass & c, float phase, float * xyz)
+    {
+        int n = (int)c.controlPoints.size() / 3;
+        float position = phase * (n - 1);
+        int k = min((int)position, n - 2);
+        float u = position - k;
+        const float *p0 = &c.controlPoints[3 * max(k - 1, 0)];
+        const float *p1 = &c.controlPoints[3 * k];
+        const float *p2 = &c.controlPoints[3 * (k + 1)];
+        const float *p3 = &c.controlPoints[3 * min(k + 2, n - 1)];
+        float u2 = u * u, u3 = u2 * u;
+        for (int d = 0; d < 3; d++)
+            xyz[d] = 0.5f * (2.0f * p1[d] + (p2[d] - p0[d]) * u
+                             + (2.0f * p0[d] - 5.0f * p1[d] + 4.0f * p2[d] - p3[d]) * u2
+                             + (3.0f * p1[d] - p0[d] - 3.0f * p2[d] + p3[d]) * u3);
+    }
+
+    float draw(float low, float high)
+    {
+        return low + (high - low) * random.uniform();
+    }
+
+    void addNoise(vector<float> & observation, float noise)
+    {
+        if (noise <= 0.0f)
+            return;
+        random.fillNormal(&noiseDraws[0], inputDimensions);
+        for (int d = 0; d < inputDimensions; d++)
+            observation[d] += noise * noiseDraws[d];
+    }
+
+    int                     inputDimensions;
+    uint64_t                corpusSeed;
+    vector<GVFCorpusClass>  classes;
+    GVFRandom               random;         // draws of the performances
+    vector<float>           last;           // last observation of the stream
+    vector<float>           noiseDraws;
+};
+
+#endif
@@ -0,0 +1,505 @@
+/**
+ * Benchmarks of the Gesture Variation Follower
+ *
+ * @details Times GVF::update() over a sweep of particle counts, input dimensions, vocabulary sizes,
+ * prediction steps and segmentation, GVFBank::updateMany() over numbers of sessions, as well as
+ * loadTemplates(), addGestureTemplate() + train() and GVFGesture::addObservation(). The workload is a GVFCorpus fully determined by the seed, so two
+ * runs on the same machine follow exactly the same gestures. Results are written as JSON: time per
+ * frame (ns), frames per second and heap allocations per frame for every case.
+ *
+ *     gvfbench [--quick] [--grid] [--threads N] [--seed S] [--min-time SECONDS] [--output FILE]
+ *
+ * Copyright (C) 2015 Baptiste Caramiaux, Nicola Montecchio
+ * STMS lab Ircam-CRNS-UPMC, University of Padova, Goldsmiths College University of London
+ *
+ * The library is under the GNU Lesser General Public License (LGPL v3)
+ */
+
+#include "GVF.h"
+#include "GVFBank.h"
+#include "GVFCorpus.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+using namespace std;
+
+#pragma mark - Allocation counting
+
+// every operator new of the process goes through here: the count is read around the timed loops
+static atomic<size_t> allocationCount(0);
+
+void * operator new(size_t size)
+{
+    allocationCount.fetch_add(1, memory_order_relaxed);
+    void *p = malloc(size > 0 ? size : 1);
+    if (p == NULL)
+        throw bad_alloc();
+    return p;
+}
+
+void * operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void * p) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void * p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void * p, size_t) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void * p, size_t) noexcept
+{
+    free(p);
+}
+
+#pragma mark - Workload
+
+typedef struct
+{
+    int     particles;
+    int     dimensions;
+    int     templates;
+    int     predictionSteps;
+    bool    segmentation;
+    bool    adaptiveParticles;  // KLD-adaptive number of particles, from 100 up to twice the particles of the case
+} BenchCase;
+
+typedef struct
+{
+    int     threads;
+    double  minTime;        // seconds spent on each case at least
+    int     minFrames;      // frames timed for each case at least
+    int     templateLength; // frames of each synthetic template
+    uint64_t seed;
+} BenchSettings;
+
+//--------------------------------------------------------------
+static void addTemplates(GVF & gvf, const vector<GVFGesture> & templates)
+{
+    for (int g = 0; g < (int)templates.size(); g++)
+    {
+        GVFGesture gesture = templates[g];
+        gvf.addGestureTemplate(gesture);
+    }
+}
+
+static double now()
+{
+    return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+#pragma mark - Results
+
+typedef struct
+{
+    string  name;
+    string  parameters;     // JSON members describing the case
+    double  seconds;
+    size_t  iterations;
+    size_t  allocations;
+    string  unit;           // what an iteration is
+    string  details;        // further JSON members of the result, if any
+} BenchResult;
+
+static vector<BenchResult> results;
+
+//--------------------------------------------------------------
+static void report(const string & name, const string & parameters, double seconds, size_t iterations, size_t allocations,
+                   const string & unit, const string & details = "")
+{
+    BenchResult result = { name, parameters, seconds, iterations, allocations, unit, details };
+    results.push_back(result);
+    fprintf(stderr, "%-16s %-64s %12.1f ns/%s %10.3f allocs/%s\n", name.c_str(), parameters.c_str(),
+            1e9 * seconds / iterations, unit.c_str(), allocations / (double)iterations, unit.c_str());
+}
+
+//--------------------------------------------------------------
+static void writeJson(FILE * file, const BenchSettings & settings)
+{
+    fprintf(file, "{\n  \"benchmark\": \"gvfbench\",\n  \"seed\": %llu,\n  \"threads\": %d,\n  \"results\": [\n",
+            (unsigned long long)settings.seed, settings.threads);
+    for (int k = 0; k < (int)results.size(); k++)
+    {
+        const BenchResult & r = results[k];
+        double perIteration = r.seconds / r.iterations;
+        fprintf(file, "    { \"name\": \"%s\", %s, \"unit\": \"%s\", \"iterations\": %zu, "
+                "\"ns_per_%s\": %.1f, \"%ss_per_s\": %.1f, \"allocations_per_%s\": %.4f%s }%s\n",
+                r.name.c_str(), r.parameters.c_str(), r.unit.c_str(), r.iterations,
+                r.unit.c_str(), 1e9 * perIteration, r.unit.c_str(), 1.0 / perIteration,
+                r.unit.c_str(), r.allocations / (double)r.iterations, r.details.c_str(), (k + 1 < (int)results.size()) ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+}
+
+#pragma mark - Benchmarks
+
+//--------------------------------------------------------------
+static void benchUpdate(const BenchCase & c, const BenchSettings & settings)
+{
+    GVFCorpus corpus(c.dimensions, c.templates, settings.seed);
+    vector<GVFGesture> templates = corpus.makeTemplates(settings.templateLength);
+    vector< vector<float> > stream;
+    corpus.makeStream(4 * settings.templateLength, settings.templateLength, GVFCorpus::defaultVariations(), stream);
+
+    GVF gvf;
+    gvf.setState(GVF::STATE_LEARNING);
+    addTemplates(gvf, templates);
+    gvf.setNumberOfParticles(c.particles);
+    gvf.setPredictionSteps(c.predictionSteps);
+    gvf.segmentation(c.segmentation);
+    if (c.adaptiveParticles)
+        gvf.setAdaptiveParticles(true, 100, 2 * c.particles);
+    gvf.setNumberOfThreads(settings.threads);
+    gvf.setState(GVF::STATE_FOLLOWING);
+
+    // warm up: the first frames start the workers (the buffers are sized by train())
+    gvf.startGesture();
+    for (int t = 0; t < 10; t++)
+        gvf.update(stream[t % stream.size()]);
+
+    size_t frames = 0;
+    double particles = 0.0;
+    size_t allocations = allocationCount.load();
+    double start = now(), elapsed = 0.0;
+    while (frames < (size_t)settings.minFrames || elapsed < settings.minTime)
+    {
+        for (int t = 0; t < 10; t++, frames++)
+        {
+            // without segmentation, a new gesture starts with each pass over the stream
+            if (frames % stream.size() == 0 && !c.segmentation)
+                gvf.startGesture();
+            gvf.update(stream[frames % stream.size()]);
+            particles += gvf.getNumberOfParticles();
+        }
+        elapsed = now() - start;
+    }
+    allocations = allocationCount.load() - allocations;
+
+    char parameters[256];
+    snprintf(parameters, sizeof(parameters),
+             "\"particles\": %d, \"dimensions\": %d, \"templates\": %d, \"predictionSteps\": %d, \"segmentation\": %s, \"adaptiveParticles\": %s",
+             c.particles, c.dimensions, c.templates, c.predictionSteps, c.segmentation ? "true" : "false",
+             c.adaptiveParticles ? "true" : "false");
+
+    // stage timings when the library is built with GVF_PROFILING
+    char meanParticles[64];
+    snprintf(meanParticles, sizeof(meanParticles), ", \"mean_particles\": %.1f", particles / frames);
+    string details = meanParticles;
+    GVFPerformanceStats stats = gvf.getPerformanceStats();
+    if (stats.enabled)
+    {
+        const char *stageNames[NUMBER_OF_STAGES] = { "prior", "likelihood", "normalisation", "ess", "resampling", "estimates", "update" };
+        details += ", \"stages_us\": {";
+        for (int k = 0; k < NUMBER_OF_STAGES; k++)
+        {
+            char stage[160];
+            snprintf(stage, sizeof(stage), "%s\"%s\": { \"mean\": %.2f, \"p50\": %.2f, \"p99\": %.2f }", (k > 0) ? ", " : " ",
+                     stageNames[k], stats.stages[k].mean, stats.stages[k].p50, stats.stages[k].p99);
+            details += stage;
+        }
+        char counters[160];
+        snprintf(counters, sizeof(counters), " }, \"resamples\": %llu, \"respawns\": %llu, \"nan_posteriors\": %llu",
+                 (unsigned long long)stats.resamples, (unsigned long long)stats.respawns, (unsigned long long)stats.nanPosteriors);
+        details += counters;
+    }
+    report("update", parameters, elapsed, frames, allocations, "frame", details);
+}
+
+//--------------------------------------------------------------
+// one sweep updates every session of a bank with its next frame, the sessions following the stream
+// from different positions
+static void benchBank(int numberOfSessions, int particlesPerSession, const BenchSettings & settings)
+{
+    const int dimensions = 2, numberOfTemplates = 10;
+    GVFCorpus corpus(dimensions, numberOfTemplates, settings.seed);
+    vector<GVFGesture> templates = corpus.makeTemplates(settings.templateLength);
+    vector< vector<float> > stream;
+    corpus.makeStream(4 * settings.templateLength, settings.templateLength, GVFCorpus::defaultVariations(), stream);
+
+    GVF gvf;
+    gvf.setState(GVF::STATE_LEARNING);
+    addTemplates(gvf, templates);
+    gvf.setState(GVF::STATE_FOLLOWING);
+    GVFBank bank(gvf, numberOfSessions, particlesPerSession);
+    bank.setNumberOfThreads(settings.threads);
+
+    vector<int> sessionIds(numberOfSessions);
+    vector< vector<float> > observations(numberOfSessions);
+    for (int s = 0; s < numberOfSessions; s++)
+        sessionIds[s] = s;
+
+    // warm up: the first sweeps start the workers
+    size_t sweeps = 0;
+    for (; sweeps < 10; sweeps++)
+    {
+        for (int s = 0; s < numberOfSessions; s++)
+            observations[s] = stream[(sweeps + 7 * s) % stream.size()];
+        bank.updateMany(sessionIds, observations);
+    }
+
+    size_t timedSweeps = 0;
+    size_t allocations = allocationCount.load();
+    double start = now(), elapsed = 0.0;
+    while (timedSweeps < (size_t)settings.minFrames || elapsed < settings.minTime)
+    {
+        for (int t = 0; t < 10; t++, sweeps++, timedSweeps++)
+        {
+            // a new gesture starts with each pass over the stream
+            if (sweeps % stream.size() == 0)
+                bank.restartAll();
+            for (int s = 0; s < numberOfSessions; s++)
+                copy(stream[(sweeps + 7 * s) % stream.size()].begin(), stream[(sweeps + 7 * s) % stream.size()].end(),
+                     observations[s].begin());
+            bank.updateMany(sessionIds, observations);
+        }
+        elapsed = now() - start;
+    }
+    allocations = allocationCount.load() - allocations;
+
+    char parameters[256];
+    snprintf(parameters, sizeof(parameters), "\"sessions\": %d, \"particlesPerSession\": %d, \"dimensions\": %d, \"templates\": %d",
+             numberOfSessions, particlesPerSession, dimensions, numberOfTemplates);
+    char details[64];
+    snprintf(details, sizeof(details), ", \"ns_per_session_frame\": %.1f", 1e9 * elapsed / (timedSweeps * numberOfSessions));
+    report("bank.updateMany", parameters, elapsed, timedSweeps, allocations, "sweep", details);
+}
+
+//--------------------------------------------------------------
+static void benchLoadTemplates(int numberOfTemplates, int dimensions, const BenchSettings & settings)
+{
+    string filename = "gvfbench-templates.txt";
+    GVFCorpus corpus(dimensions, numberOfTemplates, settings.seed);
+    corpus.writeTemplates(filename, settings.templateLength);
+
+    size_t loads = 0;
+    size_t allocations = allocationCount.load();
+    double start = now(), elapsed = 0.0;
+    while (loads < 3 || elapsed < settings.minTime)
+    {
+        GVF gvf;
+        if (!gvf.loadTemplates(filename))
+        {
+            fprintf(stderr, "gvfbench: cannot load %s\n", filename.c_str());
+            break;
+        }
+        loads++;
+        elapsed = now() - start;
+    }
+    allocations = allocationCount.load() - allocations;
+    remove(filename.c_str());
+
+    char parameters[256];
+    snprintf(parameters, sizeof(parameters), "\"dimensions\": %d, \"templates\": %d, \"frames\": %d",
+             dimensions, numberOfTemplates, numberOfTemplates * settings.templateLength);
+    report("loadTemplates", parameters, elapsed, max(loads, (size_t)1), allocations, "load");
+}
+
+//--------------------------------------------------------------
+static void benchTrain(int numberOfTemplates, int dimensions, const BenchSettings & settings)
+{
+    GVFCorpus corpus(dimensions, numberOfTemplates, settings.seed);
+    vector<GVFGesture> templates = corpus.makeTemplates(settings.templateLength);
+
+    size_t trainings = 0;
+    size_t allocations = allocationCount.load();
+    double start = now(), elapsed = 0.0;
+    while (trainings < 3 || elapsed < settings.minTime)
+    {
+        GVF gvf;
+        gvf.setState(GVF::STATE_LEARNING);
+        addTemplates(gvf, templates);
+        gvf.setState(GVF::STATE_FOLLOWING);     // trains
+        trainings++;
+        elapsed = now() - start;
+    }
+    allocations = allocationCount.load() - allocations;
+
+    char parameters[256];
+    snprintf(parameters, sizeof(parameters), "\"dimensions\": %d, \"templates\": %d", dimensions, numberOfTemplates);
+    report("addTemplates+train", parameters, elapsed, trainings, allocations, "training");
+}
+
+//--------------------------------------------------------------
+static void benchAddObservation(int dimensions, const BenchSettings & settings)
+{
+    GVFCorpus corpus(dimensions, 1, settings.seed);
+    GVFGesture source = corpus.makeTemplate(0, settings.templateLength);
+    const vector< vector<float> > & data = source.getTemplate();
+
+    size_t observations = 0;
+    size_t allocations = allocationCount.load();
+    double start = now(), elapsed = 0.0;
+    while (elapsed < settings.minTime)
+    {
+        GVFGesture gesture(dimensions);
+        for (int k = 0; k < 100; k++)
+            for (int t = 0; t < (int)data.size(); t++, observations++)
+                gesture.addObservation(data[t]);
+        elapsed = now() - start;
+    }
+    allocations = allocationCount.load() - allocations;
+
+    char parameters[256];
+    snprintf(parameters, sizeof(parameters), "\"dimensions\": %d, \"frames\": %d", dimensions, 100 * (int)data.size());
+    report("addObservation", parameters, elapsed, observations, allocations, "frame");
+}
+
+#pragma mark - Main
+
+int main(int argc, char ** argv)
+{
+    BenchSettings settings;
+    settings.threads        = 1;
+    settings.minTime        = 0.5;
+    settings.minFrames      = 50;
+    settings.templateLength = 200;
+    settings.seed           = 1;
+    bool quick = false, grid = false;
+    const char *output = NULL;
+
+    for (int k = 1; k < argc; k++)
+    {
+        if (strcmp(argv[k], "--quick") == 0)
+            quick = true;
+        else if (strcmp(argv[k], "--grid") == 0)
+            grid = true;
+        else if (strcmp(argv[k], "--threads") == 0 && k + 1 < argc)
+            settings.threads = atoi(argv[++k]);
+        else if (strcmp(argv[k], "--seed") == 0 && k + 1 < argc)
+            settings.seed = strtoull(argv[++k], NULL, 10);
+        else if (strcmp(argv[k], "--min-time") == 0 && k + 1 < argc)
+            settings.minTime = atof(argv[++k]);
+        else if (strcmp(argv[k], "--output") == 0 && k + 1 < argc)
+            output = argv[++k];
+        else
+        {
+            fprintf(stderr, "usage: %s [--quick] [--grid] [--threads N] [--seed S] [--min-time SECONDS] [--output FILE]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (quick)
+    {
+        settings.minTime   = 0.05;
+        settings.minFrames = 10;
+    }
+
+    vector<int> particleCounts, dimensions, vocabularySizes, predictionSteps, sessionCounts;
+    int p[] = { 100, 1000, 10000, 100000 };
+    int d[] = { 2, 3, 6, 20 };
+    int g[] = { 1, 10, 100, 500 };
+    int s[] = { 1, 2, 4 };
+    int b[] = { 16, 128, 1024 };
+    particleCounts.assign(p, p + (quick ? 3 : 4));
+    dimensions.assign(d, d + 4);
+    vocabularySizes.assign(g, g + (quick ? 3 : 4));
+    predictionSteps.assign(s, s + 3);
+    sessionCounts.assign(b, b + (quick ? 2 : 3));
+
+    // update(): one parameter at a time around a base case, or every combination with --grid
+    BenchCase base;
+    vector<BenchCase> cases;
+    memset(&base, 0, sizeof(base));
+    base.particles = 1000;
+    base.dimensions = 2;
+    base.templates = 10;
+    base.predictionSteps = 1;
+    if (grid)
+    {
+        for (int i = 0; i < (int)particleCounts.size(); i++)
+            for (int j = 0; j < (int)dimensions.size(); j++)
+                for (int k = 0; k < (int)vocabularySizes.size(); k++)
+                    for (int seg = 0; seg < 2; seg++)
+                    {
+                        BenchCase c = base;
+                        c.particles    = particleCounts[i];
+                        c.dimensions   = dimensions[j];
+                        c.templates    = vocabularySizes[k];
+                        c.segmentation = (seg == 1);
+                        cases.push_back(c);
+                    }
+    }
+    else
+    {
+        for (int i = 0; i < (int)particleCounts.size(); i++)
+        {
+            BenchCase c = base;
+            c.particles = particleCounts[i];
+            cases.push_back(c);
+        }
+        for (int j = 0; j < (int)dimensions.size(); j++)
+        {
+            BenchCase c = base;
+            c.dimensions = dimensions[j];
+            cases.push_back(c);
+        }
+        for (int k = 0; k < (int)vocabularySizes.size(); k++)
+        {
+            BenchCase c = base;
+            c.templates = vocabularySizes[k];
+            cases.push_back(c);
+        }
+        for (int m = 0; m < (int)predictionSteps.size(); m++)
+        {
+            BenchCase c = base;
+            c.predictionSteps = predictionSteps[m];
+            cases.push_back(c);
+        }
+    }
+    if (!grid)
+    {
+        BenchCase c = base;
+        c.segmentation = true;
+        cases.push_back(c);
+        c = base;
+        c.adaptiveParticles = true;
+        cases.push_back(c);
+    }
+
+    for (int k = 0; k < (int)cases.size(); k++)
+    {
+        // the base case belongs to every sweep, it is timed once
+        bool seen = false;
+        for (int j = 0; j < k && !seen; j++)
+            seen = memcmp(&cases[j], &cases[k], sizeof(BenchCase)) == 0;
+        if (!seen)
+            benchUpdate(cases[k], settings);
+    }
+
+    // GVFBank::updateMany(): sessions of 500 particles
+    for (int k = 0; k < (int)sessionCounts.size(); k++)
+        benchBank(sessionCounts[k], 500, settings);
+
+    for (int k = 0; k < (int)vocabularySizes.size(); k++)
+    {
+        benchLoadTemplates(vocabularySizes[k], 3, settings);
+        benchTrain(vocabularySizes[k], 3, settings);
+    }
+    for (int j = 0; j < (int)dimensions.size(); j++)
+        benchAddObservation(dimensions[j], settings);
+
+    FILE *file = (output != NULL) ? fopen(output, "w") : stdout;
+    if (file == NULL)
+    {
+        fprintf(stderr, "gvfbench: cannot write %s\n", output);
+        return 1;
+    }
+    writeJson(file, settings);
+    if (file != stdout)
+        fclose(file);
+    return 0;
+}
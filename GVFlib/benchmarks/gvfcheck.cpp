@@ -0,0 +1,849 @@
+/**
+ * Checks of the Gesture Variation Follower
+ *
+ * @details Exercises the parts of GVFlib whose failures are silent: the parsing of template files
+ * (errors and their line numbers, lines longer than the read buffer, unterminated last lines, values
+ * read exactly as strtof() reads them), the binary template files and the filter state files
+ * (round trips, rejection of damaged files or of another vocabulary), the class pruning (the
+ * probabilities estimated after a pruned resampling are those before it), the SIMD kernels
+ * (same results as the scalar ones), the resampling schemes (ancestors drawn with the frequencies
+ * of the weights, residual copies) and the heap allocations of update() once the model is trained
+ * (none). A failed check prints a line (every check with --verbose),
+ * and the program then exits with 1. Temporary files are written in the current directory and removed.
+ *
+ *     gvfcheck [--verbose]
+ *
+ * Copyright (C) 2015 Baptiste Caramiaux, Nicola Montecchio
+ * STMS lab Ircam-CRNS-UPMC, University of Padova, Goldsmiths College University of London
+ *
+ * The library is under the GNU Lesser General Public License (LGPL v3)
+ */
+
+#include "GVF.h"
+#include "GVFCorpus.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <random>
+
+using namespace std;
+
+#pragma mark - Allocation counting
+
+// every operator new of the process goes through here (see gvfbench)
+static atomic<size_t> allocationCount(0);
+
+void * operator new(size_t size)
+{
+    allocationCount.fetch_add(1, memory_order_relaxed);
+    void *p = malloc(size > 0 ? size : 1);
+    if (p == NULL)
+        throw bad_alloc();
+    return p;
+}
+
+void * operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void * p) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void * p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void * p, size_t) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void * p, size_t) noexcept
+{
+    free(p);
+}
+
+#pragma mark - Reporting
+
+static int checksRun = 0;
+static int checksFailed = 0;
+static bool verbose = false;
+
+static void check(bool passed, const string & name, const string & detail = "")
+{
+    checksRun++;
+    if (!passed)
+        checksFailed++;
+    if (!passed || verbose)
+        printf("%s %s%s%s\n", passed ? "ok  " : "FAIL", name.c_str(), detail.empty() ? "" : ": ", detail.c_str());
+}
+
+#pragma mark - Files
+
+static const char * scratchFile = "gvfcheck.tmp";
+
+static void writeFile(const char * filename, const string & contents)
+{
+    FILE *file = fopen(filename, "wb");
+    if (file == NULL)
+    {
+        fprintf(stderr, "cannot write %s\n", filename);
+        exit(1);
+    }
+    fwrite(contents.data(), 1, contents.size(), file);
+    fclose(file);
+}
+
+static string readFile(const char * filename)
+{
+    string contents;
+    FILE *file = fopen(filename, "rb");
+    if (file == NULL)
+        return contents;
+    char block[4096];
+    size_t n;
+    while ((n = fread(block, 1, sizeof(block), file)) > 0)
+        contents.append(block, n);
+    fclose(file);
+    return contents;
+}
+
+// loads the contents as a template file, error receiving what loadTemplates() reported
+static bool loadText(GVF & gvf, const string & contents, string & error)
+{
+    writeFile(scratchFile, contents);
+    error.clear();
+    bool loaded = gvf.loadTemplates(scratchFile, &error);
+    remove(scratchFile);
+    return loaded;
+}
+
+#pragma mark - Vocabulary
+
+// frame at phase t (0..1) of gesture g
+static vector<float> gestureFrame(int g, int dimensions, float t)
+{
+    vector<float> frame(dimensions);
+    float a = 6.2831853f * t;
+    for (int d = 0; d < dimensions; d++)
+    {
+        if (g == 0)
+            frame[d] = (d % 2 == 0) ? cos(a + d) : sin(a + d);
+        else if (g == 1)
+            frame[d] = (2 * t - 1) * (d + 1) * 0.5f;
+        else
+            frame[d] = sin(2 * a + d) * 0.7f;
+    }
+    return frame;
+}
+
+// gestures of different lengths and shapes, recorded in learning mode
+static void recordTemplates(GVF & gvf, int dimensions)
+{
+    gvf.setState(GVF::STATE_LEARNING);
+    for (int g = 0; g < 3; g++)
+    {
+        gvf.startGesture();
+        int length = 80 + 30 * g;
+        for (int i = 0; i < length; i++)
+            gvf.addObservation(gestureFrame(g, dimensions, i / (float)length));
+    }
+    gvf.setState(GVF::STATE_FOLLOWING);     // adds the last gesture
+}
+
+#pragma mark - Text templates
+
+// a file that fails to load reports "file:line: message", and adds nothing
+static void checkTextError(const string & name, const string & contents, int lineNumber, const string & message)
+{
+    GVF gvf;
+    string error;
+    bool loaded = loadText(gvf, contents, error);
+    string expected = string(scratchFile) + ":" + to_string(lineNumber) + ": " + message;
+    check(!loaded && error == expected && gvf.getNumberOfGestureTemplates() == 0,
+          "text error, " + name, loaded ? "loaded" : "'" + error + "'");
+}
+
+static void checkTextTemplates()
+{
+    GVF gvf;
+    string error;
+
+    // error paths
+    check(!gvf.loadTemplates("gvfcheck.missing", &error) && error == "gvfcheck.missing: cannot open the file",
+          "text error, missing file", error);
+    checkTextError("bad header", "template 0\n0 0\n", 1, "expected 'template <id> <dimension>'");
+    checkTextError("value before header", "\n0 0\ntemplate 0 2\n", 2, "value before the first template header");
+    checkTextError("invalid value", "template 0 2\n0 0\n1 abc\n", 3, "invalid value 'abc'");
+    checkTextError("unfinished frame", "template 0 2\n0 0 1\ntemplate 1 2\n0 0\n", 3, "unfinished frame before the template header");
+    checkTextError("unfinished last frame", "template 0 2\n0 0\n1\n", 3, "unfinished frame at the end of the file");
+    checkTextError("templates of different dimensions", "template 0 2\n0 0\n1 1\ntemplate 1 3\n0 0 0\n", 4,
+                   "template of dimension 3 in a vocabulary of dimension 2");
+    checkTextError("templates of different strides", "template 0 3\n0 0 0\ntemplate 1 4\n0 0 0 0\n", 3,
+                   "template of dimension 4 in a vocabulary of dimension 3");
+
+    // the templates of a file must also have the dimension of the vocabulary already loaded
+    GVF loadedVocabulary;
+    recordTemplates(loadedVocabulary, 2);
+    bool added = loadText(loadedVocabulary, "template 0 3\n0 0 0\n1 1 1\n", error);
+    check(!added && error == string(scratchFile) + ":1: template of dimension 3 in a vocabulary of dimension 2"
+          && loadedVocabulary.getNumberOfGestureTemplates() == 3, "text error, dimension of the vocabulary", error);
+    added = loadText(loadedVocabulary, "template 0 2\n0 0\n1 1\n", error);
+    check(added && loadedVocabulary.getNumberOfGestureTemplates() == 4, "text templates added to a vocabulary", error);
+
+    // a line longer than the read buffer (64 KB) is refused, with its number, from whichever read it starts in
+    string longLine;
+    while (longLine.size() < 70000)
+        longLine += "1.5 ";
+    checkTextError("line too long", "template 0 2\n0 0\n" + longLine + "\n", 3, "line too long");
+    string padding;
+    for (int i = 0; i < 5000; i++)
+        padding += "0.25 0.5\n";
+    checkTextError("line too long after a read", "template 0 2\n" + padding + longLine, 5002, "line too long");
+
+    // a last line without a newline is read, and so are the line endings of other platforms
+    bool loaded = loadText(gvf, "template 0 2\r\n0 0\r\n1.5 -2.5", error);
+    check(loaded && gvf.getNumberOfGestureTemplates() == 1 && gvf.getGestureTemplate(0).getTemplateLength() == 2
+          && gvf.getGestureTemplate(0).getTemplate()[1][0] == 1.5f && gvf.getGestureTemplate(0).getTemplate()[1][1] == -2.5f,
+          "text unterminated last line", error);
+    checkTextError("unterminated last line with an error", "template 0 2\n0 0\n1 x", 3, "invalid value 'x'");
+
+    // values written in every form: the frames must hold what strtof() reads (the first frame is zero
+    // so that the translation of the template leaves the values untouched)
+    mt19937 random(1);
+    uniform_real_distribution<double> uniform(-1.0, 1.0);
+    uniform_int_distribution<int> form(0, 7);
+    const int dimensions = 4, frames = 20000;
+    vector<string> values;
+    string contents = "template 0 4\n0 0 0 0\n";
+    char text[64];
+    for (int i = 0; i < frames * dimensions; i++)
+    {
+        double x = uniform(random);
+        switch (form(random))
+        {
+            case 0: snprintf(text, sizeof(text), "%g", x); break;                          // saveTemplates()
+            case 1: snprintf(text, sizeof(text), "%.9g", x * 1000); break;                 // round trip precision
+            case 2: snprintf(text, sizeof(text), "%.3f", x * 100); break;
+            case 3: snprintf(text, sizeof(text), "%e", x * 1e-12); break;                  // exponent out of the fast range
+            case 4: snprintf(text, sizeof(text), "%.17g", x); break;                       // mantissa over 2^24
+            case 5: snprintf(text, sizeof(text), "%d", (int)(x * 20000000)); break;        // integers around 2^24
+            case 6: snprintf(text, sizeof(text), "%+.2E", x * 1e8); break;
+            default: snprintf(text, sizeof(text), "%.1f", x); break;
+        }
+        values.push_back(text);
+        contents += text;
+        contents += ((i + 1) % dimensions == 0) ? "\n" : " ";
+    }
+    GVF parsed;
+    loaded = loadText(parsed, contents, error);
+    int mismatches = 0;
+    string firstMismatch;
+    if (loaded)
+    {
+        vector< vector<float> > & frameValues = parsed.getGestureTemplate(0).getTemplate();
+        for (int i = 0; i < frames * dimensions; i++)
+        {
+            float value = frameValues[1 + i / dimensions][i % dimensions];
+            float expected = strtof(values[i].c_str(), NULL);
+            if (memcmp(&value, &expected, sizeof(float)) != 0)
+            {
+                if (mismatches++ == 0)
+                    firstMismatch = values[i] + " read as " + to_string(value);
+            }
+        }
+    }
+    check(loaded && parsed.getGestureTemplate(0).getTemplateLength() == frames + 1 && mismatches == 0,
+          "text values as strtof", loaded ? to_string(mismatches) + " mismatches " + firstMismatch : error);
+}
+
+#pragma mark - Binary templates
+
+static bool sameTemplates(GVF & a, GVF & b)
+{
+    if (a.getNumberOfGestureTemplates() != b.getNumberOfGestureTemplates())
+        return false;
+    for (int g = 0; g < a.getNumberOfGestureTemplates(); g++)
+        if (a.getGestureTemplate(g).getTemplate() != b.getGestureTemplate(g).getTemplate())
+            return false;
+    return true;
+}
+
+// a damaged file is refused and the templates in place are kept
+static void checkBinaryRejected(const string & name, const string & contents)
+{
+    GVF gvf;
+    recordTemplates(gvf, 2);
+    writeFile(scratchFile, contents);
+    bool loaded = gvf.loadTemplatesBinary(scratchFile);
+    remove(scratchFile);
+    check(!loaded && gvf.getNumberOfGestureTemplates() == 3 && gvf.getGestureTemplate(0).getNumberDimensions() == 2,
+          "binary rejects " + name, loaded ? "loaded" : "");
+}
+
+static void checkBinaryTemplates()
+{
+    for (int dimensions = 2; dimensions <= 5; dimensions += 3)
+    {
+        // round trip: the same frames, and the same model to follow them
+        GVF original;
+        recordTemplates(original, dimensions);
+        bool saved = original.saveTemplatesBinary(scratchFile);
+        GVF loaded;
+        bool read = saved && loaded.loadTemplatesBinary(scratchFile);
+        check(saved && read && sameTemplates(original, loaded)
+              && loaded.getGestureTemplate(0).getNumberDimensions() == dimensions,
+              "binary round trip, " + to_string(dimensions) + " dimensions", read ? "" : "not loaded");
+
+        loaded.setState(GVF::STATE_FOLLOWING);
+        loaded.startGesture();
+        int recognised = -1;
+        for (int i = 0; i < 110; i++)
+        {
+            vector<float> frame = gestureFrame(1, dimensions, i / 110.0f);
+            recognised = loaded.update(frame).likeliestGesture;
+        }
+        check(recognised == 1, "binary templates followed, " + to_string(dimensions) + " dimensions",
+              "recognised " + to_string(recognised));
+    }
+
+    string contents = readFile(scratchFile);
+    remove(scratchFile);
+    string damaged = contents;
+    damaged[0] = 'X';
+    checkBinaryRejected("bad magic", damaged);
+    damaged = contents;
+    damaged[4] ^= 0x7f;
+    checkBinaryRejected("bad version", damaged);
+    checkBinaryRejected("truncated header", contents.substr(0, 10));
+    checkBinaryRejected("truncated tables", contents.substr(0, 80));
+    checkBinaryRejected("truncated frames", contents.substr(0, contents.size() - sizeof(float)));
+    checkBinaryRejected("empty file", "");
+}
+
+#pragma mark - Filter state
+
+// likelihoods and alignments of the next frames of gesture 0, from phase 0.4 on
+static vector<float> followFrames(GVF & gvf, int dimensions, int frames)
+{
+    vector<float> results;
+    for (int i = 0; i < frames; i++)
+    {
+        vector<float> frame = gestureFrame(0, dimensions, 0.4f + i / 100.0f);
+        GVFOutcomes & outcomes = gvf.update(frame);
+        results.insert(results.end(), outcomes.likelihoods.begin(), outcomes.likelihoods.end());
+        results.insert(results.end(), outcomes.alignments.begin(), outcomes.alignments.end());
+    }
+    return results;
+}
+
+static void checkFilterState()
+{
+    const int dimensions = 3;
+    for (int logDomain = 0; logDomain < 2; logDomain++)
+    {
+        string domain = logDomain ? ", log domain" : "";
+
+        // a filter halfway through a gesture, its state saved and captured
+        GVF original;
+        recordTemplates(original, dimensions);
+        original.logDomain(logDomain == 1);
+        original.startGesture();
+        for (int i = 0; i < 40; i++)
+        {
+            vector<float> frame = gestureFrame(0, dimensions, i / 100.0f);
+            original.update(frame);
+        }
+        GVFSnapshot state;
+        original.snapshot(state);
+        bool saved = original.saveState(scratchFile);
+        vector<float> expected = followFrames(original, dimensions, 30);
+
+        // restoring continues exactly as the filter did, in the same filter or in another one
+        bool restored = original.restore(state);
+        check(restored && followFrames(original, dimensions, 30) == expected, "state restore" + domain);
+        GVF loaded;
+        recordTemplates(loaded, dimensions);
+        loaded.logDomain(logDomain == 1);
+        bool read = saved && loaded.loadState(scratchFile);
+        check(read && followFrames(loaded, dimensions, 30) == expected, "state file round trip" + domain,
+              read ? "" : "not loaded");
+    }
+
+    // another vocabulary is refused
+    string contents = readFile(scratchFile);
+    GVFSnapshot state;
+    GVF source;
+    recordTemplates(source, dimensions);
+    source.snapshot(state);
+    GVF otherDimensions;
+    recordTemplates(otherDimensions, 2);
+    check(!otherDimensions.restore(state) && !otherDimensions.loadState(scratchFile), "state rejects other dimensions");
+    GVF otherGestures;
+    otherGestures.setState(GVF::STATE_LEARNING);
+    for (int g = 0; g < 2; g++)
+    {
+        otherGestures.startGesture();
+        for (int i = 0; i < 50; i++)
+            otherGestures.addObservation(gestureFrame(g, dimensions, i / 50.0f));
+    }
+    otherGestures.setState(GVF::STATE_FOLLOWING);
+    check(!otherGestures.restore(state) && !otherGestures.loadState(scratchFile), "state rejects other gestures");
+    GVF noTemplates;
+    check(!noTemplates.loadState(scratchFile), "state rejects a filter without templates");
+
+    // in learning mode, a rejected state leaves the recording alone; an accepted one follows the
+    // vocabulary the gesture being recorded completes
+    GVFSnapshot planarState;
+    GVF planar;
+    recordTemplates(planar, 2);
+    planar.snapshot(planarState);
+    GVF learning;
+    learning.setState(GVF::STATE_LEARNING);
+    for (int g = 0; g < 3; g++)
+    {
+        learning.startGesture();
+        for (int i = 0; i < 50; i++)
+            learning.addObservation(gestureFrame(g, dimensions, i / 50.0f));
+    }
+    bool restored = learning.restore(planarState);
+    for (int i = 50; i < 80; i++)
+        learning.addObservation(gestureFrame(2, dimensions, i / 80.0f));
+    bool untouched = (learning.getState() == GVF::STATE_LEARNING && learning.getNumberOfGestureTemplates() == 2);
+    learning.setState(GVF::STATE_FOLLOWING);
+    check(!restored && untouched && learning.getNumberOfGestureTemplates() == 3
+          && learning.getGestureTemplate(2).getTemplateLength() == 80, "state rejected in learning mode leaves the recording");
+    learning.setState(GVF::STATE_LEARNING);
+    learning.startGesture();
+    for (int i = 0; i < 50; i++)
+        learning.addObservation(gestureFrame(1, dimensions, i / 50.0f));
+    GVFSnapshot fourGestures;
+    learning.setState(GVF::STATE_FOLLOWING);
+    learning.snapshot(fourGestures);
+    GVF pending;
+    pending.setState(GVF::STATE_LEARNING);
+    for (int g = 0; g < 4; g++)
+    {
+        pending.startGesture();
+        for (int i = 0; i < 50; i++)
+            pending.addObservation(gestureFrame(g % 3, dimensions, i / 50.0f));
+    }
+    check(pending.restore(fourGestures) && pending.getState() == GVF::STATE_FOLLOWING
+          && pending.getNumberOfGestureTemplates() == 4, "state restored in learning mode");
+
+    // and so are damaged files
+    GVF target;
+    recordTemplates(target, dimensions);
+    string damaged = contents;
+    damaged[0] = 'X';
+    writeFile(scratchFile, damaged);
+    check(!target.loadState(scratchFile), "state rejects bad magic");
+    damaged = contents;
+    damaged[4] ^= 0x7f;
+    writeFile(scratchFile, damaged);
+    check(!target.loadState(scratchFile), "state rejects bad version");
+    writeFile(scratchFile, contents.substr(0, 16));
+    check(!target.loadState(scratchFile), "state rejects truncated header");
+    writeFile(scratchFile, contents.substr(0, contents.size() - sizeof(float)));
+    check(!target.loadState(scratchFile), "state rejects truncated file");
+    writeFile(scratchFile, contents + string(sizeof(float), '\0'));
+    check(!target.loadState(scratchFile), "state rejects trailing data");
+    remove(scratchFile);
+    check(!target.loadState(scratchFile), "state rejects missing file");
+}
+
+#pragma mark - Class pruning
+
+// Each frame of a pruning filter that resamples is replayed from the state before it by a filter
+// that never resamples: the propagation is the same, so the probabilities must only differ by the
+// resampling. The weights of the particles drawn for a gesture compensate for the share it was
+// given, so a gesture that keeps particles keeps its probability (up to the normalisation over the
+// gestures drawn), and the gestures left without particles held at most the mass of a few of them.
+static void checkClassPruning()
+{
+    const int numberOfGestures = 10, numberOfParticles = 1000;
+    GVFCorpus corpus(2, numberOfGestures, 5);
+    vector<GVFGesture> templates = corpus.makeTemplates(100);
+    GVFCorpusVariations variations = GVFCorpus::defaultVariations();
+    variations.offset = 0;
+
+    for (int logDomain = 0; logDomain < 2; logDomain++)
+        for (int stratified = 0; stratified < 2; stratified++)
+        {
+            GVF pruning, replay;
+            GVF *filters[] = { &pruning, &replay };
+            for (int k = 0; k < 2; k++)
+            {
+                filters[k]->setState(GVF::STATE_LEARNING);
+                for (int g = 0; g < numberOfGestures; g++)
+                    filters[k]->addGestureTemplate(templates[g]);
+                filters[k]->setNumberOfParticles(numberOfParticles);
+                filters[k]->logDomain(logDomain == 1);
+                filters[k]->setState(GVF::STATE_FOLLOWING);
+            }
+            pruning.setClassPruning(true, 0.001f, 10);
+            if (stratified)
+                pruning.setResamplingScheme(RESAMPLING_STRATIFIED);
+            replay.setResamplingThreshold(0);
+
+            GVFSnapshot state;
+            int prunedResamplings = 0;
+            float drawnError = 0.0f, undrawnMass = 0.0f;
+            for (int k = 0; k < 10; k++)
+            {
+                vector< vector<float> > frames;
+                corpus.perform(k, 100, variations, frames, NULL);
+                pruning.startGesture();
+                for (int i = 0; i < (int)frames.size(); i++)
+                {
+                    pruning.snapshot(state);
+                    vector<int> classes = pruning.getGestureClasses();
+                    vector<float> after = pruning.update(frames[i]).likelihoods;
+                    if (pruning.getGestureClasses() == classes)     // not resampled (or not seen to be)
+                        continue;
+                    replay.restore(state);
+                    vector<float> & before = replay.update(frames[i]).likelihoods;
+                    bool pruned = false;
+                    for (int g = 0; g < numberOfGestures; g++)
+                        pruned |= (before[g] < 0.001f);
+                    if (!pruned)
+                        continue;
+                    prunedResamplings++;
+                    vector<int> counts(numberOfGestures, 0);
+                    classes = pruning.getGestureClasses();
+                    for (int n = 0; n < (int)classes.size(); n++)
+                        counts[classes[n]]++;
+                    float lost = 0.0f;
+                    for (int g = 0; g < numberOfGestures; g++)
+                        if (counts[g] == 0)
+                            lost += before[g];
+                    for (int g = 0; g < numberOfGestures; g++)
+                        if (counts[g] > 0)
+                            drawnError = max(drawnError, fabs(after[g] * (1.0f - lost) - before[g]) - 1e-4f * before[g]);
+                    undrawnMass = max(undrawnMass, lost);
+                }
+            }
+            string name = string("pruning keeps the probabilities") + (stratified ? ", stratified" : "") + (logDomain ? ", log domain" : "");
+            check(prunedResamplings > 10 && drawnError < 1e-6f && undrawnMass < 10.0f / numberOfParticles, name,
+                  to_string(prunedResamplings) + " pruned resamplings, error " + to_string(drawnError)
+                  + ", lost mass " + to_string(undrawnMass));
+        }
+}
+
+#pragma mark - Kernels
+
+// kernels of the running CPU besides the scalar one, which they are compared with
+template <int DIM>
+static vector< pair<string, GVFLikelihoodKernel> > simdLikelihoodKernels()
+{
+    vector< pair<string, GVFLikelihoodKernel> > kernels;
+#ifdef GVF_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        kernels.push_back(make_pair(string("AVX2"), &gvfLikelihoodAVX2<DIM>));
+    if (__builtin_cpu_supports("avx512f"))
+        kernels.push_back(make_pair(string("AVX-512"), &gvfLikelihoodAVX512<DIM>));
+#endif
+    return kernels;
+}
+
+// relative difference, down to an absolute floor for the values that underflow
+static float kernelError(float value, float expected)
+{
+    if (std::isnan(value) != std::isnan(expected) || std::isinf(value) != std::isinf(expected))
+        return INFINITY;
+    if (std::isinf(value))
+        return (value == expected) ? 0.0f : INFINITY;
+    return fabs(value - expected) / max(fabs(expected), 1e-30f);
+}
+
+// random particles on a random vocabulary, the kernels running over a range with unaligned ends
+template <int DIM>
+static void checkLikelihoodKernel(int dimensions, int rotationsDim, bool offsets, float distribution, bool logDomain)
+{
+    const int numberOfParticles = 203, stride = 208, numberOfFrames = 50, begin = 3, end = 198;
+    mt19937 random(dimensions * 100 + rotationsDim * 10 + offsets);
+    uniform_real_distribution<float> uniform(-1.0f, 1.0f);
+
+    int frameStride = (dimensions <= 2) ? dimensions : (dimensions + 3) & ~3;
+    vector<float> vocabulary(numberOfFrames * frameStride), observation(dimensions), dimWeights(dimensions);
+    vector<float> scalings(dimensions * stride), rotations(3 * stride), terms(9 * stride), translations(dimensions * stride);
+    vector<int> frameIndices(stride, 0);
+    for (int i = 0; i < (int)vocabulary.size(); i++)
+        vocabulary[i] = uniform(random);
+    for (int d = 0; d < dimensions; d++)
+    {
+        observation[d] = uniform(random);
+        dimWeights[d]  = 0.5f + 0.5f * fabs(uniform(random));
+    }
+    for (int n = 0; n < numberOfParticles; n++)
+    {
+        frameIndices[n] = (int)(fabs(uniform(random)) * (numberOfFrames - 1)) * frameStride;
+        for (int d = 0; d < dimensions; d++)
+        {
+            scalings[d * stride + n]     = 1.0f + 0.3f * uniform(random);
+            translations[d * stride + n] = 0.2f * uniform(random);
+        }
+        for (int r = 0; r < 3; r++)
+            rotations[r * stride + n] = 3.0f * uniform(random);
+    }
+    gvfRotationTermsScalar(&rotations[0], &terms[0], rotationsDim, stride, 0, numberOfParticles);
+
+    GVFLikelihoodBatch batch;
+    batch.dimensions    = dimensions;
+    batch.rotationsDim  = rotationsDim;
+    batch.stride        = stride;
+    batch.vocabulary    = &vocabulary[0];
+    batch.frameIndices  = &frameIndices[0];
+    batch.scalings      = &scalings[0];
+    batch.rotationTerms = &terms[0];
+    batch.offsets       = offsets ? &translations[0] : NULL;
+    batch.observation   = &observation[0];
+    batch.dimWeights    = &dimWeights[0];
+    batch.tolerance     = 0.2f;
+    batch.distribution  = distribution;
+    batch.logDomain     = logDomain;
+
+    vector<float> expected(stride, -1.0f), likelihood(stride);
+    batch.likelihood = &expected[0];
+    gvfLikelihoodScalar<DIM>(batch, begin, end);
+
+    vector< pair<string, GVFLikelihoodKernel> > kernels = simdLikelihoodKernels<DIM>();
+    for (int k = 0; k < (int)kernels.size(); k++)
+    {
+        fill(likelihood.begin(), likelihood.end(), -1.0f);
+        batch.likelihood = &likelihood[0];
+        kernels[k].second(batch, begin, end);
+        float error = 0.0f;
+        bool outside = false;
+        for (int n = 0; n < stride; n++)
+        {
+            if (n < begin || n >= end)
+                outside |= (likelihood[n] != -1.0f);
+            else
+                error = max(error, kernelError(likelihood[n], expected[n]));
+        }
+        string name = kernels[k].first + " likelihood, GVFKernel<" + to_string(DIM) + ">, " + to_string(dimensions) + "-d"
+                    + (rotationsDim ? ", rotated" : "") + (offsets ? ", translated" : "")
+                    + (distribution > 0.0f ? ", Student" : "") + (logDomain ? ", log domain" : "");
+        check(error < 1e-4f && !outside, name, outside ? "wrote outside the range" : "relative error " + to_string(error));
+    }
+}
+
+template <int DIM>
+static void checkLikelihoodKernels(int dimensions, int rotationsDim)
+{
+    for (int rotated = 0; rotated < 2; rotated++)
+        for (int logDomain = 0; logDomain < 2; logDomain++)
+        {
+            checkLikelihoodKernel<DIM>(dimensions, rotated ? rotationsDim : 0, false, 0.0f, logDomain == 1);
+            checkLikelihoodKernel<DIM>(dimensions, rotated ? rotationsDim : 0, true, 0.0f, logDomain == 1);
+            checkLikelihoodKernel<DIM>(dimensions, rotated ? rotationsDim : 0, true, 3.0f, logDomain == 1);
+        }
+}
+
+static void checkKernels()
+{
+    checkLikelihoodKernels<2>(2, 1);
+    checkLikelihoodKernels<3>(3, 3);
+    checkLikelihoodKernels<0>(2, 1);
+    checkLikelihoodKernels<0>(3, 3);
+    checkLikelihoodKernels<0>(5, 0);
+
+    // the selected kernels are the widest ones
+    check(gvfSelectLikelihoodKernel(2) == GVFKernel<2>::likelihood() && gvfSelectLikelihoodKernel(3) == GVFKernel<3>::likelihood()
+          && gvfSelectLikelihoodKernel(7) == GVFKernel<0>::likelihood(), "likelihood kernel selection");
+
+    // exp-sum and rotation terms
+    const int stride = 208, begin = 5, end = 201;
+    mt19937 random(7);
+    uniform_real_distribution<float> uniform(-1.0f, 1.0f);
+    vector<float> x(stride), rotations(3 * stride);
+    for (int n = 0; n < stride; n++)
+    {
+        x[n] = 40.0f * uniform(random) - 60.0f;
+        for (int r = 0; r < 3; r++)
+            rotations[r * stride + n] = 4.0f * uniform(random);
+    }
+    vector<float> expected(9 * stride, 0.0f), value(9 * stride, 0.0f);
+    float expectedSum = gvfExpSumScalar(&x[0], -30.0f, &expected[0], begin, end);
+    float sum = gvfSelectExpSumKernel()(&x[0], -30.0f, &value[0], begin, end);
+    float error = kernelError(sum, expectedSum);
+    for (int n = begin; n < end; n++)
+        error = max(error, kernelError(value[n], expected[n]));
+    check(error < 1e-4f, "exp-sum kernel", "relative error " + to_string(error));
+    for (int rotationsDim = 1; rotationsDim <= 3; rotationsDim += 2)
+    {
+        fill(expected.begin(), expected.end(), 0.0f);
+        fill(value.begin(), value.end(), 0.0f);
+        gvfRotationTermsScalar(&rotations[0], &expected[0], rotationsDim, stride, begin, end);
+        gvfSelectRotationKernel()(&rotations[0], &value[0], rotationsDim, stride, begin, end);
+        error = 0.0f;
+        for (int i = 0; i < (int)value.size(); i++)
+            error = max(error, fabs(value[i] - expected[i]));
+        check(error < 1e-5f, string("rotation terms kernel, ") + (rotationsDim == 1 ? "2-d" : "3-d"), "error " + to_string(error));
+    }
+}
+
+#pragma mark - Resampling
+
+// normalised weights: smooth, decaying (a few large weights, the alias table pairing many small
+// entries with them) and sparse (half of them zero)
+static vector<float> resamplingWeights(int set, int n)
+{
+    vector<float> weights(n);
+    float total = 0.0f;
+    for (int i = 0; i < n; i++)
+    {
+        if (set == 0)
+            weights[i] = 1.0f + 0.5f * sinf((float)i);
+        else if (set == 1)
+            weights[i] = expf(-i / 8.0f);
+        else
+            weights[i] = (i % 2) ? 0.0f : 1.0f + (i % 5);
+        total += weights[i];
+    }
+    for (int i = 0; i < n; i++)
+        weights[i] /= total;
+    return weights;
+}
+
+// frequencies of the ancestors drawn by every scheme over many resamplings of the same weights
+static void checkResampling()
+{
+    const char *sets[] = { "smooth", "decaying", "sparse" };
+    const char *schemes[] = { "systematic", "stratified", "residual", "multinomial", "Metropolis" };
+    const int n = 64, trials = 2000;
+    for (int set = 0; set < 3; set++)
+    {
+        vector<float> weights = resamplingWeights(set, n);
+
+        // the alias table samples the weights exactly
+        vector<float> probabilities(n), cumulative(n), scratch(n);
+        vector<int> aliases(n), work(n), drawn(n);
+        gvfBuildAliasTable(&weights[0], n, &probabilities[0], &aliases[0], &work[0]);
+        vector<float> aliasMass(n, 0.0f);
+        for (int k = 0; k < n; k++)
+        {
+            aliasMass[k] += probabilities[k] / n;
+            aliasMass[aliases[k]] += (1.0f - probabilities[k]) / n;
+        }
+        float error = 0.0f;
+        for (int i = 0; i < n; i++)
+            error = max(error, fabs(aliasMass[i] - weights[i]));
+        check(error < 1e-5f, string("alias table, ") + sets[set], "error " + to_string(error));
+
+        for (int scheme = 0; scheme < 5; scheme++)
+        {
+            GVFRandom random(12345);
+            vector<double> counts(n, 0.0);
+            bool residualCopies = true, zeroWeightDrawn = false;
+            for (int t = 0; t < trials; t++)
+            {
+                if (scheme == 0)
+                    gvfResampleSystematic(&weights[0], n, random, &cumulative[0], &drawn[0]);
+                else if (scheme == 1)
+                    gvfResampleStratified(&weights[0], n, random, &cumulative[0], &scratch[0], &drawn[0]);
+                else if (scheme == 2)
+                    gvfResampleResidual(&weights[0], n, random, &cumulative[0], &scratch[0], &drawn[0]);
+                else if (scheme == 3)
+                    gvfResampleMultinomial(&weights[0], n, random, &scratch[0], &aliases[0], &work[0], &drawn[0]);
+                else
+                    gvfResampleMetropolis(&weights[0], n, gvfMetropolisSteps(&weights[0], n), random, 0, n, &drawn[0]);
+                vector<int> copies(n, 0);
+                for (int j = 0; j < n; j++)
+                {
+                    copies[drawn[j]]++;
+                    zeroWeightDrawn = zeroWeightDrawn || weights[drawn[j]] == 0.0f;
+                }
+                for (int i = 0; i < n; i++)
+                {
+                    counts[i] += copies[i];
+                    if (copies[i] < (int)(n * weights[i]))
+                        residualCopies = false;
+                }
+            }
+            // total variation distance between the frequencies and the weights
+            double distance = 0.0;
+            for (int i = 0; i < n; i++)
+                distance += 0.5 * fabs(counts[i] / ((double)trials * n) - weights[i]);
+            string name = string(schemes[scheme]) + " resampling, " + sets[set];
+            check(distance < 0.02 && !zeroWeightDrawn, name, "distance " + to_string(distance)
+                  + (zeroWeightDrawn ? ", a zero weight drawn" : ""));
+            if (scheme == 2)
+                check(residualCopies, name + ", floor(n*w) copies");
+        }
+    }
+}
+
+#pragma mark - Allocations
+
+// following sessions longer than the live history, from the first frame after train()
+static void checkAllocations()
+{
+    const char *modes[] = { "", ", log domain", ", adaptive particles", ", class pruning", ", time budget" };
+    for (int dimensions = 2; dimensions <= 5; dimensions += (dimensions == 3) ? 2 : 1)
+        for (int mode = 0; mode < 5; mode++)
+        {
+            GVF gvf;
+            recordTemplates(gvf, dimensions);
+            gvf.setState(GVF::STATE_LEARNING);
+            if (mode == 1)
+                gvf.logDomain(true);
+            else if (mode == 2)
+                gvf.setAdaptiveParticles(true, 100, 3000);
+            else if (mode == 3)
+                gvf.setClassPruning(true);
+            else if (mode == 4)
+                gvf.setTimeBudget(50.0f);
+            vector< vector<float> > frames;
+            for (int i = 0; i < 2 * 300; i++)
+                frames.push_back(gestureFrame(1, dimensions, (i % 200) / 200.0f));
+
+            gvf.setState(GVF::STATE_FOLLOWING);     // trains the model
+            size_t before = allocationCount.load();
+            for (int session = 0; session < 2; session++)
+            {
+                gvf.startGesture();
+                for (int i = 0; i < 300; i++)
+                    gvf.update(frames[session * 300 + i]);
+            }
+            size_t allocations = allocationCount.load() - before;
+            check(allocations == 0, "update() allocations after train(), " + to_string(dimensions) + "-d" + modes[mode],
+                  to_string(allocations) + " allocations over 600 frames");
+        }
+}
+
+#pragma mark - Main
+
+int main(int argc, char ** argv)
+{
+    for (int k = 1; k < argc; k++)
+    {
+        if (strcmp(argv[k], "--verbose") == 0)
+            verbose = true;
+        else
+        {
+            fprintf(stderr, "usage: %s [--verbose]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    checkTextTemplates();
+    checkBinaryTemplates();
+    checkFilterState();
+    checkClassPruning();
+    checkKernels();
+    checkResampling();
+    checkAllocations();
+
+    printf("%d checks, %d failed\n", checksRun, checksFailed);
+    return (checksFailed == 0) ? 0 : 1;
+}
@@ -0,0 +1,154 @@
+/**
+ * Synthetic gesture corpus generator
+ *
+ * @details Writes the templates of a GVFCorpus in the text format of GVF::saveTemplates(), and a
+ * continuous stream of performances of them with its ground truth:
+ *
+ *     stream   raw float32 observations [frames x D] in the byte order of the machine, or one
+ *              observation per line with --text
+ *     truth    one line per frame: label (-1 at rest) alignment speed scaling rotation
+ *
+ *     gvfcorpus [--dimensions D] [--classes G] [--length L] [--seed S] [--templates FILE]
+ *               [--stream FILE] [--truth FILE] [--frames N] [--text]
+ *               [--speed MIN MAX] [--warp W] [--scale MIN MAX] [--rotation R] [--offset O]
+ *               [--noise N] [--gap MIN MAX]
+ *
+ * Copyright (C) 2015 Baptiste Caramiaux, Nicola Montecchio
+ * STMS lab Ircam-CRNS-UPMC, University of Padova, Goldsmiths College University of London
+ *
+ * The library is under the GNU Lesser General Public License (LGPL v3)
+ */
+
+#include "GVFCorpus.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+using namespace std;
+
+static int usage(const char * program)
+{
+    fprintf(stderr, "usage: %s [--dimensions D] [--classes G] [--length L] [--seed S] [--templates FILE]\n"
+                    "          [--stream FILE] [--truth FILE] [--frames N] [--text]\n"
+                    "          [--speed MIN MAX] [--warp W] [--scale MIN MAX] [--rotation R] [--offset O]\n"
+                    "          [--noise N] [--gap MIN MAX]\n", program);
+    return 1;
+}
+
+int main(int argc, char ** argv)
+{
+    int dimensions = 2, numberOfClasses = 10, length = 200;
+    long long numberOfFrames = 10000;
+    uint64_t seed = 1;
+    bool text = false;
+    const char *templatesFile = NULL, *streamFile = NULL, *truthFile = NULL;
+    GVFCorpusVariations variations = GVFCorpus::defaultVariations();
+
+    for (int k = 1; k < argc; k++)
+    {
+        bool one = k + 1 < argc, two = k + 2 < argc;
+        if (strcmp(argv[k], "--dimensions") == 0 && one)
+            dimensions = atoi(argv[++k]);
+        else if (strcmp(argv[k], "--classes") == 0 && one)
+            numberOfClasses = atoi(argv[++k]);
+        else if (strcmp(argv[k], "--length") == 0 && one)
+            length = atoi(argv[++k]);
+        else if (strcmp(argv[k], "--seed") == 0 && one)
+            seed = strtoull(argv[++k], NULL, 10);
+        else if (strcmp(argv[k], "--templates") == 0 && one)
+            templatesFile = argv[++k];
+        else if (strcmp(argv[k], "--stream") == 0 && one)
+            streamFile = argv[++k];
+        else if (strcmp(argv[k], "--truth") == 0 && one)
+            truthFile = argv[++k];
+        else if (strcmp(argv[k], "--frames") == 0 && one)
+            numberOfFrames = atoll(argv[++k]);
+        else if (strcmp(argv[k], "--text") == 0)
+            text = true;
+        else if (strcmp(argv[k], "--speed") == 0 && two)
+        {
+            variations.minSpeed = atof(argv[++k]);
+            variations.maxSpeed = atof(argv[++k]);
+        }
+        else if (strcmp(argv[k], "--warp") == 0 && one)
+            variations.warp = atof(argv[++k]);
+        else if (strcmp(argv[k], "--scale") == 0 && two)
+        {
+            variations.minScale = atof(argv[++k]);
+            variations.maxScale = atof(argv[++k]);
+        }
+        else if (strcmp(argv[k], "--rotation") == 0 && one)
+            variations.rotation = atof(argv[++k]);
+        else if (strcmp(argv[k], "--offset") == 0 && one)
+            variations.offset = atof(argv[++k]);
+        else if (strcmp(argv[k], "--noise") == 0 && one)
+            variations.noise = atof(argv[++k]);
+        else if (strcmp(argv[k], "--gap") == 0 && two)
+        {
+            variations.minGap = atoi(argv[++k]);
+            variations.maxGap = atoi(argv[++k]);
+        }
+        else
+            return usage(argv[0]);
+    }
+    if (dimensions < 1 || numberOfClasses < 1 || length < 2 || variations.minSpeed <= 0.0f
+        || variations.maxSpeed < variations.minSpeed || variations.warp < 0.0f || variations.warp >= 1.0f
+        || variations.minGap < 0 || variations.maxGap < variations.minGap)
+        return usage(argv[0]);
+
+    GVFCorpus corpus(dimensions, numberOfClasses, seed);
+
+    if (templatesFile != NULL && !corpus.writeTemplates(templatesFile, length))
+    {
+        fprintf(stderr, "gvfcorpus: cannot write %s\n", templatesFile);
+        return 1;
+    }
+    if (streamFile == NULL && truthFile == NULL)
+        return 0;
+
+    FILE *stream = (streamFile != NULL) ? fopen(streamFile, text ? "w" : "wb") : NULL;
+    FILE *truth  = (truthFile != NULL) ? fopen(truthFile, "w") : NULL;
+    if ((streamFile != NULL && stream == NULL) || (truthFile != NULL && truth == NULL))
+    {
+        fprintf(stderr, "gvfcorpus: cannot write %s\n", (streamFile != NULL && stream == NULL) ? streamFile : truthFile);
+        return 1;
+    }
+
+    // one performance at a time, so that long streams do not need to fit in memory
+    vector< vector<float> > frames;
+    vector<GVFCorpusTruth> labels;
+    bool written = true;
+    for (long long frame = 0; frame < numberOfFrames && written; )
+    {
+        frames.clear();
+        labels.clear();
+        corpus.perform(-1, length, variations, frames, &labels);
+        int count = (int)min((long long)frames.size(), numberOfFrames - frame);
+        for (int t = 0; t < count && written; t++)
+        {
+            if (stream != NULL && text)
+            {
+                for (int d = 0; d < dimensions; d++)
+                    fprintf(stream, "%g ", frames[t][d]);
+                written = fprintf(stream, "\n") > 0;
+            }
+            else if (stream != NULL)
+                written = fwrite(&frames[t][0], sizeof(float), dimensions, stream) == (size_t)dimensions;
+            if (truth != NULL && written)
+                written = fprintf(truth, "%d %g %g %g %g\n", labels[t].label, labels[t].alignment,
+                                  labels[t].speed, labels[t].scaling, labels[t].rotation) > 0;
+        }
+        frame += count;
+    }
+    if (stream != NULL)
+        written = (fclose(stream) == 0) && written;
+    if (truth != NULL)
+        written = (fclose(truth) == 0) && written;
+    if (!written)
+    {
+        fprintf(stderr, "gvfcorpus: write error\n");
+        return 1;
+    }
+    return 0;
+}